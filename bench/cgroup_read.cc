@@ -0,0 +1,128 @@
+// Measures the cost of reading the CPU usage of a cgroup, as the time limit watcher does a few times per run:
+//   path:   resolving and checking the path, then reading with an ifstream, as done before CgroupHandle
+//   fresh:  ReadGroupProperty, which opens the property file for every read
+//   handle: a CgroupHandle kept open, i.e. a single `pread` per read
+//
+// Usage: sandbox-bench-cgroup-read [reads]
+// Both the time and the count of syscalls per read are reported. The syscalls are counted by running
+// the reads once more in a child process traced with PTRACE_SYSCALL, so they don't affect the timing.
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <chrono>
+#include <functional>
+#include <filesystem>
+
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/ptrace.h>
+
+#include <fmt/format.h>
+
+#include "../native/cgroup.h"
+#include "../native/utils.h"
+
+using std::string;
+using fmt::format;
+namespace fs = std::filesystem;
+
+// Count the syscalls made by `reads` calls to `read`, excluding `exit_group`.
+static double CountSyscalls(int reads, const std::function<void()> &read)
+{
+    pid_t pid = ENSURE(fork());
+    if (pid == 0)
+    {
+        // Warm up, so that lazy initialization is not counted.
+        read();
+        ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+        raise(SIGSTOP);
+        for (int i = 0; i < reads; i++)
+        {
+            read();
+        }
+        _exit(0);
+    }
+
+    int status;
+    ENSURE(waitpid(pid, &status, 0));
+    ptrace(PTRACE_SETOPTIONS, pid, nullptr, PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL);
+    int64_t stops = 0;
+    while (true)
+    {
+        ptrace(PTRACE_SYSCALL, pid, nullptr, nullptr);
+        ENSURE(waitpid(pid, &status, 0));
+        if (WIFEXITED(status) || WIFSIGNALED(status))
+            break;
+        if (WIFSTOPPED(status) && WSTOPSIG(status) == (SIGTRAP | 0x80))
+            stops++;
+    }
+    // Every syscall stops twice (on entry and exit), except `exit_group`, which stops on entry only.
+    return (double)(stops - 1) / 2 / reads;
+}
+
+static double MeasureNanoseconds(int reads, const std::function<void()> &read)
+{
+    using clock = std::chrono::steady_clock;
+    read();
+    auto begin = clock::now();
+    for (int i = 0; i < reads; i++)
+    {
+        read();
+    }
+    std::chrono::duration<double, std::nano> elapsed = clock::now() - begin;
+    return elapsed.count() / reads;
+}
+
+int main(int argc, char **argv)
+{
+    int reads = argc > 1 ? std::stoi(argv[1]) : 100000;
+
+    bool v2 = IsCgroupV2();
+    CgroupInfo info(v2 ? "unified" : "cpuacct", "sandbox-bench-cgroup-read");
+    string property = v2 ? "cpu.stat" : "cpuacct.usage";
+    CreateGroup(info);
+
+    // The group path is resolved the same way as in cgroup.cc.
+    fs::path groupPath;
+    {
+        auto mounts = InitializeCgroup();
+        groupPath = (v2 ? InitializeCgroup2() : mounts[info.Controller][0]) / info.Group;
+    }
+
+    volatile int64_t sink;
+    std::function<void()> path = [&]() {
+        if (!fs::exists(groupPath) || !fs::is_directory(groupPath))
+            throw std::runtime_error("The group is gone.");
+        std::ifstream ifs;
+        ifs.exceptions(std::ios::failbit | std::ios::badbit);
+        ifs.open(groupPath / property);
+        int64_t val;
+        if (v2)
+        {
+            string key;
+            ifs >> key;
+        }
+        ifs >> val;
+        sink = val;
+    };
+    std::function<void()> fresh = [&]() {
+        sink = v2 ? ReadGroupPropertyMap(info, property)["usage_usec"] : ReadGroupProperty(info, property);
+    };
+    CgroupHandle handle(info);
+    std::function<void()> cached = [&]() {
+        sink = v2 ? handle.ReadKey(property, "usage_usec") : handle.Read(property);
+    };
+
+    std::cout << format("reading {} of {} times:\n", property, reads);
+    for (auto &item : {std::make_pair("path", &path), std::make_pair("fresh", &fresh), std::make_pair("handle", &cached)})
+    {
+        double ns = MeasureNanoseconds(reads, *item.second);
+        double syscalls = CountSyscalls(std::min(reads, 1000), *item.second);
+        std::cout << format("{:>8}: {:10.1f} ns/read, {:5.1f} syscalls/read\n", item.first, ns, syscalls);
+    }
+
+    RemoveCgroup(info);
+    return 0;
+}
@@ -0,0 +1,231 @@
+// Runs sandboxes under a few kinds of load, and reports the results as JSON, to compare builds and machines:
+//   empty:         `/bin/true`, one at a time
+//   fork-bomb:     a shell forking `sleep` until it hits `pids.max` (the process limit, 16), then exiting with 2
+//   memory-hog:    a shell doubling a string until it's killed at the memory limit (64MB)
+//   time-limit:    a shell spinning until it's killed at a time limit of 200ms; its CPU time per run shows the overshoot
+//   concurrent-N:  `/bin/true`, N at a time, for N = 1, 8, 64 and 256
+//
+// Usage: sandbox-bench-load [rootfs] [runs] [scenario...]
+// The rootfs (`/` by default) needs `/bin/true` and `/bin/sh`; the sandboxes are run in it as `nobody`.
+// Every scenario runs `runs` (100 by default) sandboxes, and the concurrent ones at least 2 per thread.
+// All the others are limited to 2s of CPU time, so a broken scenario can't hang.
+//
+// For each scenario, the latency (from StartSandbox until reaped and its cgroups removed), the throughput,
+// the CPU time spent by this process per run (the overhead of the sandbox, outside of it) and the CPU time
+// of the sandbox itself per run are reported, with how the sandboxes have ended. The sandboxes failing to start
+// (e.g. timing out under a heavy load) are counted as errors, and left out of the latency; a scenario without
+// any run succeeding is reported with 0 runs, its errors and the first of them.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/utsname.h>
+
+#include <fmt/format.h>
+
+#include "../native/sandbox.h"
+#include "../native/cgroup.h"
+#include "../native/utils.h"
+#include "parameter.h"
+
+using std::string;
+using std::vector;
+using fmt::format;
+
+struct Scenario
+{
+    string name;
+    int concurrency;
+    vector<string> arguments;
+    // In nanoseconds, or 0 to keep that of the parameter.
+    int64_t timeLimit = 0;
+};
+
+struct Outcomes
+{
+    // Failed to start or to be reaped, e.g. the child not responding in time under a heavy load.
+    int errors = 0;
+    int exited = 0;
+    int failed = 0;
+    int signaled = 0;
+    int timeLimitExceeded = 0;
+    int oomKilled = 0;
+};
+
+static double CpuMilliseconds(int who)
+{
+    rusage usage;
+    ENSURE(getrusage(who, &usage));
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e3 + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e3;
+}
+
+// Nearest-rank, of sorted `values`.
+static double Percentile(const vector<double> &values, int percent)
+{
+    size_t rank = (values.size() * percent + 99) / 100;
+    return values[std::max<size_t>(rank, 1) - 1];
+}
+
+static string Quote(const string &value)
+{
+    string quoted = "\"";
+    for (char c : value)
+    {
+        if (c == '"' || c == '\\')
+            quoted += '\\';
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+static string Run(const SandboxParameter &base, const Scenario &scenario, int runs)
+{
+    SandboxParameter parameter = base;
+    parameter.executable = scenario.arguments[0];
+    parameter.executableParameters = scenario.arguments;
+    if (scenario.timeLimit)
+        parameter.timeLimit = scenario.timeLimit;
+    runs = std::max(runs, scenario.concurrency * (scenario.concurrency > 1 ? 2 : 1));
+
+    vector<double> latencies(runs, -1);
+    vector<ExecutionResult> results(runs);
+    std::atomic<int> next(0);
+    std::mutex mutex;
+    string error;
+
+    using clock = std::chrono::steady_clock;
+    double cpuBegin = CpuMilliseconds(RUSAGE_SELF);
+    auto begin = clock::now();
+    vector<std::thread> threads;
+    for (int t = 0; t < scenario.concurrency; t++)
+    {
+        threads.emplace_back([&]() {
+            int i;
+            while ((i = next++) < runs)
+            {
+                SandboxParameter runParameter = parameter;
+                runParameter.cgroupName = format("{}/{}-{}", parameter.cgroupName, scenario.name, i);
+                try
+                {
+                    auto runBegin = clock::now();
+                    pid_t pid;
+                    void *execParam = StartSandbox(runParameter, pid);
+                    results[i] = WaitForProcess(pid, execParam);
+                    RemoveSandboxCgroups(runParameter.cgroupName);
+                    latencies[i] = std::chrono::duration<double, std::milli>(clock::now() - runBegin).count();
+                }
+                catch (std::exception &ex)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (error.empty())
+                        error = ex.what();
+                }
+            }
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+    std::chrono::duration<double> elapsed = clock::now() - begin;
+    double cpu = CpuMilliseconds(RUSAGE_SELF) - cpuBegin;
+
+    Outcomes outcomes;
+    double sandboxCpu = 0;
+    vector<double> succeeded;
+    for (int i = 0; i < runs; i++)
+    {
+        if (latencies[i] < 0)
+        {
+            outcomes.errors++;
+            // Removed only now, since the child may have still been exiting when it failed.
+            try
+            {
+                RemoveSandboxCgroups(format("{}/{}-{}", parameter.cgroupName, scenario.name, i));
+            }
+            catch (...)
+            {
+            }
+            continue;
+        }
+        succeeded.push_back(latencies[i]);
+        const ExecutionResult &result = results[i];
+        sandboxCpu += result.usage.time / 1e6;
+        if (result.timeLimitExceeded)
+            outcomes.timeLimitExceeded++;
+        else if (result.status == SIGNALED)
+            outcomes.signaled++;
+        else if (result.code != 0)
+            outcomes.failed++;
+        else
+            outcomes.exited++;
+        if (result.usage.oomKilled)
+            outcomes.oomKilled++;
+    }
+
+    string firstError = error.empty() ? "" : format(",\n     \"firstError\": {}", Quote(error));
+    if (succeeded.empty())
+    {
+        // Still reported, so that the other scenarios are; the outcomes only count the errors.
+        return format("    {{\"name\": {}, \"concurrency\": {}, \"runs\": 0, \"seconds\": {:.3f},\n"
+                      "     \"outcomes\": {{\"errors\": {}, \"exited\": 0, \"failed\": 0, \"signaled\": 0, \"timeLimitExceeded\": 0, \"oomKilled\": 0}}{}}}",
+                      Quote(scenario.name), scenario.concurrency, elapsed.count(), outcomes.errors, firstError);
+    }
+    double mean = 0;
+    for (double latency : succeeded)
+        mean += latency / succeeded.size();
+    std::sort(succeeded.begin(), succeeded.end());
+    return format("    {{\"name\": {}, \"concurrency\": {}, \"runs\": {}, \"seconds\": {:.3f}, \"runsPerSecond\": {:.1f},\n"
+                  "     \"latencyMs\": {{\"mean\": {:.3f}, \"p50\": {:.3f}, \"p90\": {:.3f}, \"p99\": {:.3f}, \"max\": {:.3f}}},\n"
+                  "     \"cpuMsPerRun\": {{\"overhead\": {:.3f}, \"sandbox\": {:.3f}}},\n"
+                  "     \"outcomes\": {{\"errors\": {}, \"exited\": {}, \"failed\": {}, \"signaled\": {}, \"timeLimitExceeded\": {}, \"oomKilled\": {}}}{}}}",
+                  Quote(scenario.name), scenario.concurrency, runs, elapsed.count(), runs / elapsed.count(),
+                  mean, Percentile(succeeded, 50), Percentile(succeeded, 90), Percentile(succeeded, 99), succeeded.back(),
+                  cpu / runs, sandboxCpu / succeeded.size(),
+                  outcomes.errors, outcomes.exited, outcomes.failed, outcomes.signaled, outcomes.timeLimitExceeded, outcomes.oomKilled,
+                  firstError);
+}
+
+int main(int argc, char **argv)
+{
+    string rootfs = argc > 1 ? argv[1] : "/";
+    int runs = argc > 2 ? std::stoi(argv[2]) : 100;
+    vector<string> selected(argv + std::min(argc, 3), argv + argc);
+
+    vector<Scenario> scenarios = {
+        {"empty", 1, {"/bin/true"}},
+        {"fork-bomb", 1, {"/bin/sh", "-c", "while :; do sleep 10 & done"}},
+        {"memory-hog", 1, {"/bin/sh", "-c", "x=x; while :; do x=$x$x; done"}},
+        {"time-limit", 1, {"/bin/sh", "-c", "while :; do :; done"}, 200000000},
+    };
+    for (int concurrency : {1, 8, 64, 256})
+    {
+        scenarios.push_back({format("concurrent-{}", concurrency), concurrency, {"/bin/true"}});
+    }
+
+    SandboxParameter parameter = BenchParameter(rootfs, "sandbox-bench-load");
+    parameter.timeLimit = 2000000000;
+    parameter.memoryLimit = 64 * 1024 * 1024;
+    parameter.processLimit = 16;
+
+    utsname system;
+    ENSURE(uname(&system));
+    std::cout << format("{{\n  \"kernel\": {}, \"cgroup\": {}, \"cpus\": {}, \"rootfs\": {},\n  \"scenarios\": [\n",
+                        Quote(system.release), IsCgroupV2() ? 2 : 1, std::thread::hardware_concurrency(), Quote(rootfs));
+    bool first = true;
+    for (auto &scenario : scenarios)
+    {
+        if (!selected.empty() && std::find(selected.begin(), selected.end(), scenario.name) == selected.end())
+            continue;
+        std::cout << (first ? "" : ",\n") << Run(parameter, scenario, runs) << std::flush;
+        first = false;
+    }
+    std::cout << "\n  ]\n}\n";
+    return 0;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+#include <filesystem>
+
+#include "../native/sandbox.h"
+
+// The parameter the benchmarks start from: every field set, as ParseSandboxParameter would,
+// for a sandbox run in `rootfs` as `nobody`, with 256MB of memory, 10 processes and no time limit.
+// The executable and its arguments are left to the benchmark.
+inline SandboxParameter BenchParameter(const std::filesystem::path &rootfs, const std::string &cgroupName)
+{
+    SandboxParameter parameter;
+    parameter.timeLimit = -1;
+    parameter.outputLimit = -1;
+    parameter.stackSize = -2;
+    parameter.memoryLimit = 256 * 1024 * 1024;
+    parameter.memoryHigh = -1;
+    parameter.processLimit = 10;
+    parameter.cpuQuota = -1;
+    parameter.cpuPeriod = 0;
+    parameter.compareMode = COMPARE_NONE;
+    parameter.compareEpsilon = 0;
+    parameter.stopOnMismatch = false;
+    parameter.redirectBeforeChroot = false;
+    parameter.mountProc = false;
+    parameter.chrootDirectory = rootfs;
+    parameter.chrootLimit = 0;
+    parameter.workingDirectory = "/";
+    parameter.environmentVariables = {"PATH=/bin:/usr/bin"};
+    parameter.stdinRedirectionFileDescriptor = parameter.stdoutRedirectionFileDescriptor =
+        parameter.stderrRedirectionFileDescriptor = -1;
+    parameter.uid = parameter.gid = 65534;
+    parameter.cgroupName = cgroupName;
+    return parameter;
+}
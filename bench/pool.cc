@@ -0,0 +1,93 @@
+// Compares the throughput of starting sandboxes with StartSandbox (the cold path)
+// against starting them from a pre-warmed SandboxPool.
+//
+// Usage: sandbox-bench-pool [rootfs] [runs] [pool size] [run time in ms]
+// `/bin/sleep <run time>` is run in the rootfs (`/` by default) as `nobody`, for 10ms by default,
+// to leave the pool some time to refill, as a judge would do while a submission is running.
+// Both the throughput and the mean latency of starting a sandbox are reported.
+
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <functional>
+
+#include <fmt/format.h>
+
+#include "../native/sandbox.h"
+#include "../native/pool.h"
+#include "parameter.h"
+
+using std::string;
+using fmt::format;
+
+struct Result
+{
+    double runsPerSecond;
+    double startMilliseconds;
+};
+
+// `start` starts a sandbox and returns a function that waits for it.
+static Result Measure(int runs, const std::function<std::function<void()>(int)> &start)
+{
+    using clock = std::chrono::steady_clock;
+    std::chrono::duration<double, std::milli> startTime(0);
+    auto begin = clock::now();
+    for (int i = 0; i < runs; i++)
+    {
+        auto startBegin = clock::now();
+        auto wait = start(i);
+        startTime += clock::now() - startBegin;
+        wait();
+    }
+    std::chrono::duration<double> elapsed = clock::now() - begin;
+    return {runs / elapsed.count(), startTime.count() / runs};
+}
+
+int main(int argc, char **argv)
+{
+    string rootfs = argc > 1 ? argv[1] : "/";
+    int runs = argc > 2 ? std::stoi(argv[2]) : 200;
+    int poolSize = argc > 3 ? std::stoi(argv[3]) : 4;
+    string runTime = argc > 4 ? argv[4] : "10";
+
+    SandboxParameter parameter = BenchParameter(rootfs, "sandbox-bench-pool");
+
+    SandboxRunParameter run;
+    run.executable = "/bin/sleep";
+    run.executableParameters = {"sleep", format("{}", std::stod(runTime) / 1000)};
+    run.environmentVariables = {"PATH=/bin:/usr/bin"};
+    run.stdinRedirectionFileDescriptor = run.stdoutRedirectionFileDescriptor = run.stderrRedirectionFileDescriptor = -1;
+
+    parameter.executable = run.executable;
+    parameter.executableParameters = run.executableParameters;
+    parameter.environmentVariables = run.environmentVariables;
+
+    Result cold = Measure(runs, [&](int i) {
+        SandboxParameter coldParameter = parameter;
+        coldParameter.cgroupName = format("{}/cold-{}", parameter.cgroupName, i);
+        pid_t pid;
+        void *execParam = StartSandbox(coldParameter, pid);
+        return [=]() {
+            WaitForProcess(pid, execParam);
+            RemoveSandboxCgroups(coldParameter.cgroupName);
+        };
+    });
+
+    Result pooled;
+    {
+        SandboxPool pool(parameter, poolSize);
+        pooled = Measure(runs, [&](int) {
+            pid_t pid;
+            string cgroupName;
+            void *execParam = pool.Start(run, pid, cgroupName);
+            return [=]() {
+                WaitForProcess(pid, execParam);
+                RemoveSandboxCgroups(cgroupName);
+            };
+        });
+    }
+
+    std::cout << format("cold: {:.1f} runs/s, {:.3f} ms to start\n", cold.runsPerSecond, cold.startMilliseconds)
+              << format("pool (size {}): {:.1f} runs/s, {:.3f} ms to start\n", poolSize, pooled.runsPerSecond, pooled.startMilliseconds);
+    return 0;
+}
@@ -0,0 +1,109 @@
+// Compares the setup and teardown latency of giving each sandbox a writable `/tmp`:
+//   bind:    a directory is created on the host for every run, bind-mounted to `/tmp`, and removed afterwards
+//   overlay: `chrootLimit` is set, i.e. an overlay with a tmpfs upper layer is mounted on the chroot
+//
+// Usage: sandbox-bench-rootfs <rootfs> [runs] [scratch directory]
+// The rootfs must not be `/`, and must have `/tmp` for the bind mode. The host directories for the bind mode
+// are created in the scratch directory (`/tmp/sandbox-bench-rootfs` by default).
+// Every run writes a small file to `/tmp` as `nobody`.
+// The setup is measured up to StartSandbox returning, and the teardown from the exit of the sandbox,
+// to its cgroups (and the host directory) being removed. The throughput includes both and the run itself.
+
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <functional>
+#include <filesystem>
+
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <fmt/format.h>
+
+#include "../native/sandbox.h"
+#include "../native/utils.h"
+#include "parameter.h"
+
+using std::string;
+using fmt::format;
+namespace fs = std::filesystem;
+
+struct Result
+{
+    double runsPerSecond;
+    double setupMilliseconds;
+    double teardownMilliseconds;
+};
+
+// `setup` starts a sandbox and returns a function that cleans it up once it has exited.
+static Result Measure(int runs, const std::function<std::function<void()>(int, pid_t &)> &setup)
+{
+    using clock = std::chrono::steady_clock;
+    std::chrono::duration<double, std::milli> setupTime(0), teardownTime(0);
+    auto begin = clock::now();
+    for (int i = 0; i < runs; i++)
+    {
+        pid_t pid;
+        auto setupBegin = clock::now();
+        auto teardown = setup(i, pid);
+        setupTime += clock::now() - setupBegin;
+
+        siginfo_t info;
+        ENSURE(waitid(P_PID, pid, &info, WEXITED | WNOWAIT));
+        auto teardownBegin = clock::now();
+        teardown();
+        teardownTime += clock::now() - teardownBegin;
+    }
+    std::chrono::duration<double> elapsed = clock::now() - begin;
+    return {runs / elapsed.count(), setupTime.count() / runs, teardownTime.count() / runs};
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: sandbox-bench-rootfs <rootfs> [runs] [scratch directory]\n";
+        return 1;
+    }
+    string rootfs = argv[1];
+    int runs = argc > 2 ? std::stoi(argv[2]) : 200;
+    fs::path scratch = argc > 3 ? argv[3] : "/tmp/sandbox-bench-rootfs";
+
+    SandboxParameter parameter = BenchParameter(rootfs, "sandbox-bench-rootfs");
+    parameter.executable = "/bin/sh";
+    parameter.executableParameters = {"sh", "-c", "echo test > /tmp/file"};
+
+    auto start = [](const SandboxParameter &parameter, pid_t &pid, std::function<void()> cleanup) {
+        void *execParam = StartSandbox(parameter, pid);
+        pid_t sandbox = pid;
+        return std::function<void()>([=]() {
+            ExecutionResult result = WaitForProcess(sandbox, execParam);
+            RemoveSandboxCgroups(parameter.cgroupName);
+            cleanup();
+            if (result.status != EXITED || result.code != 0)
+                throw std::runtime_error("The sandbox has failed to write to /tmp.");
+        });
+    };
+
+    fs::create_directories(scratch);
+    Result bind = Measure(runs, [&](int i, pid_t &pid) {
+        fs::path directory = scratch / format("run-{}", i);
+        fs::create_directory(directory);
+        ENSURE(chown(directory.c_str(), parameter.uid, parameter.gid));
+        SandboxParameter bindParameter = parameter;
+        bindParameter.mounts = {{directory, "/tmp", -1, false}};
+        return start(bindParameter, pid, [directory]() { fs::remove_all(directory); });
+    });
+
+    Result overlay = Measure(runs, [&](int, pid_t &pid) {
+        SandboxParameter overlayParameter = parameter;
+        overlayParameter.chrootLimit = 64 * 1024 * 1024;
+        return start(overlayParameter, pid, []() {});
+    });
+
+    std::cout << format("bind: {:.1f} runs/s, {:.3f} ms to set up, {:.3f} ms to tear down\n",
+                        bind.runsPerSecond, bind.setupMilliseconds, bind.teardownMilliseconds)
+              << format("overlay: {:.1f} runs/s, {:.3f} ms to set up, {:.3f} ms to tear down\n",
+                        overlay.runsPerSecond, overlay.setupMilliseconds, overlay.teardownMilliseconds);
+    return 0;
+}
@@ -0,0 +1,125 @@
+// Compares the spawn-to-exec latency of the ways a sandbox child has been cloned, with the heap of a large process:
+//   clone:  clone() on a freshly allocated (and zeroed) 700KB stack, then pidfd_open (the former cgroup v1 path)
+//   fork:   clone3 with CLONE_PIDFD and no stack, i.e. on a copy of our memory (the former cgroup v2 path, and pools)
+//   shared: SharedMemoryChild, i.e. CLONE_VM on a pooled stack (StartSandbox with cgroup v2)
+//
+// Usage: sandbox-bench-spawn [heap size in MB] [runs] [executable]
+// The heap (1024MB by default) is allocated and touched before measuring, as in a busy Node.js process.
+// The executable (`/bin/true` by default) is exec'd directly; no namespaces are created, since they cost the same for all.
+// The latency is measured from cloning to the child having exec'd, which is seen as the EOF of a close-on-exec pipe
+// for the first two, and by SharedMemoryChild::WaitForExec for the last one.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <functional>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <syscall.h>
+#include <sys/wait.h>
+
+#include <fmt/format.h>
+
+#include "../native/spawn.h"
+#include "../native/utils.h"
+
+using std::string;
+using std::vector;
+using fmt::format;
+
+// Runs in the child, with the null-terminated arguments.
+static int ExecChild(void *arguments)
+{
+    char **argv = reinterpret_cast<char **>(arguments);
+    execv(argv[0], argv);
+    return 127;
+}
+
+// Wait for the write end of `pipefd` to be closed in the child by the exec.
+static void WaitForPipe(int pipefd[2])
+{
+    (void)close(pipefd[1]);
+    char buffer;
+    (void)read(pipefd[0], &buffer, 1);
+    (void)close(pipefd[0]);
+}
+
+// `spawn` clones the child and waits for its exec, returning its PID and pidfd.
+static double Measure(int runs, const std::function<pid_t(int &)> &spawn)
+{
+    using clock = std::chrono::steady_clock;
+    std::chrono::duration<double, std::milli> time(0);
+    for (int i = 0; i < runs; i++)
+    {
+        int pidfd = -1;
+        auto begin = clock::now();
+        pid_t pid = spawn(pidfd);
+        time += clock::now() - begin;
+
+        int status;
+        ENSURE(waitpid(pid, &status, 0));
+        if (pidfd != -1)
+            (void)close(pidfd);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            throw std::runtime_error(format("The child has exited with status {}.", status));
+        }
+    }
+    return time.count() / runs;
+}
+
+int main(int argc, char **argv)
+{
+    size_t heapSize = (argc > 1 ? std::stoul(argv[1]) : 1024) * 1024 * 1024;
+    int runs = argc > 2 ? std::stoi(argv[2]) : 200;
+    string executable = argc > 3 ? argv[3] : "/bin/true";
+
+    vector<char> heap(heapSize, 1);
+    vector<string> argumentStrings = {executable};
+    vector<char *> arguments = StringToPtr(argumentStrings);
+
+    double cloneTime = Measure(runs, [&](int &pidfd) {
+        int pipefd[2];
+        ENSURE(pipe2(pipefd, O_CLOEXEC));
+        vector<char> stack(1024 * 700);
+        pid_t pid = ENSURE(clone(ExecChild, &*stack.end(), SIGCHLD, arguments.data()));
+        pidfd = syscall(SYS_pidfd_open, pid, 0);
+        WaitForPipe(pipefd);
+        return pid;
+    });
+
+    double forkTime = Measure(runs, [&](int &pidfd) {
+        int pipefd[2];
+        ENSURE(pipe2(pipefd, O_CLOEXEC));
+        clone_args args = {};
+        args.flags = CLONE_PIDFD;
+        args.pidfd = reinterpret_cast<uint64_t>(&pidfd);
+        args.exit_signal = SIGCHLD;
+        pid_t pid = ENSURE(syscall(SYS_clone3, &args, sizeof(args)));
+        if (pid == 0)
+        {
+            _exit(ExecChild(arguments.data()));
+        }
+        WaitForPipe(pipefd);
+        return pid;
+    });
+
+    double sharedTime = Measure(runs, [&](int &pidfd) {
+        clone_args args = {};
+        args.flags = CLONE_PIDFD;
+        args.pidfd = reinterpret_cast<uint64_t>(&pidfd);
+        args.exit_signal = SIGCHLD;
+        SharedMemoryChild sharedChild(args, ExecChild, arguments.data());
+        sharedChild.WaitForExec();
+        return sharedChild.Pid();
+    });
+
+    std::cout << format("heap: {} MB, {} runs of {}\n", heapSize / 1024 / 1024, runs, executable)
+              << format("clone:  {:.3f} ms to exec\n", cloneTime)
+              << format("fork:   {:.3f} ms to exec\n", forkTime)
+              << format("shared: {:.3f} ms to exec\n", sharedTime);
+    return 0;
+}
@@ -1,16 +1,28 @@
 #include <map>
+#include <memory>
 #include <vector>
 #include <string>
+#include <thread>
 #include <functional>
 #include <exception>
 #include <cstring>
 #include <filesystem>
 
+#include <dlfcn.h>
+
 #include <napi.h>
 #include <fmt/format.h>
 
 #include "sandbox.h"
 #include "cgroup.h"
+#include "pool.h"
+#include "sandboxtemplate.h"
+#include "batch.h"
+#include "zygote.h"
+#include "scheduler.h"
+#include "interactive.h"
+#include "compileserver.h"
+#include "telemetry.h"
 
 using std::string;
 namespace fs = std::filesystem;
@@ -89,6 +101,25 @@ void NodeRemoveCgroup(const Napi::CallbackInfo &info)
     }
 }
 
+void NodeRemoveSandboxCgroups(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    string cgroupName = GetStringWithEmptyCheck(info[0]);
+    try
+    {
+        RemoveSandboxCgroups(cgroupName);
+    }
+    catch (std::exception &ex)
+    {
+        Napi::Error::New(env, ex.what()).ThrowAsJavaScriptException();
+    }
+    catch (...)
+    {
+        Napi::Error::New(env, "Something unexpected happened while removing cgroup.").ThrowAsJavaScriptException();
+    }
+}
+
 std::vector<string> StringArrayToVector(const Napi::Array &array) {
     std::vector<string> result(array.Length());
     for (size_t i = 0; i < array.Length(); i++) result[i] = GetStringWithEmptyCheck(array[i]);
@@ -101,19 +132,54 @@ std::vector<int> IntArrayToVector(const Napi::Array &array) {
     return result;
 }
 
-Napi::Value NodeStartSandbox(const Napi::CallbackInfo &info)
+#define SET_REDIRECTION(_name_)                                                                  \
+    if (jsparam.Get(#_name_).IsNumber())                                                         \
+    {                                                                                            \
+        param._name_##RedirectionFileDescriptor = jsparam.Get(#_name_).ToNumber().Int32Value();  \
+    }                                                                                            \
+    else                                                                                         \
+    {                                                                                            \
+        param._name_##RedirectionFileDescriptor = -1;                                            \
+        param._name_##Redirection = GetStringWithEmptyCheck(jsparam.Get(#_name_));               \
+    }
+
+static CompareMode ParseCompareMode(const Napi::Value &value)
 {
-    Napi::Env env = info.Env();
+    if (!value.IsString())
+        return COMPARE_NONE;
+    string mode = value.ToString().Utf8Value();
+    if (mode == "exact")
+        return COMPARE_EXACT;
+    if (mode == "lines")
+        return COMPARE_LINES;
+    if (mode == "tokens")
+        return COMPARE_TOKENS;
+    if (mode == "float")
+        return COMPARE_FLOATING_POINT;
+    throw std::invalid_argument("Unknown comparison mode: " + mode);
+}
 
+// Optional; empty if not given.
+static fs::path ParseExpectedOutput(const Napi::Object &jsparam)
+{
+    return jsparam.Get("expectedOutput").IsString() ? fs::path(jsparam.Get("expectedOutput").ToString().Utf8Value()) : fs::path();
+}
+
+SandboxParameter ParseSandboxParameter(const Napi::Object &jsparam)
+{
     SandboxParameter param;
-    Napi::Object jsparam = info[0].As<Napi::Object>();
 
-    // param.timeLimit = jsparam.Get("time").ToNumber().Int32Value();
+    double timeLimit = jsparam.Get("time").ToNumber().DoubleValue(); // In milliseconds.
+    param.timeLimit = timeLimit >= 0 ? static_cast<int64_t>(timeLimit * 1000 * 1000) : -1;
+    param.outputLimit = jsparam.Get("output").IsNumber() ? jsparam.Get("output").ToNumber().Int64Value() : -1;
     param.memoryLimit = jsparam.Get("memory").ToNumber().Int64Value() / 4 * 5; // Reserve some space to detect memory limit exceeding.
+    // Throttled at the limit itself, and killed once over it; the reserve is then left for the page cache.
+    param.memoryHigh = jsparam.Get("throttleMemory").ToBoolean().Value() ? jsparam.Get("memory").ToNumber().Int64Value() : -1;
     param.processLimit = jsparam.Get("process").ToNumber().Int32Value();
     param.redirectBeforeChroot = jsparam.Get("redirectBeforeChroot").ToBoolean().Value();
     param.mountProc = jsparam.Get("mountProc").ToBoolean().Value();
     param.chrootDirectory = fs::path(GetStringWithEmptyCheck(jsparam.Get("chroot")));
+    param.chrootLimit = jsparam.Get("chrootLimit").IsNumber() ? jsparam.Get("chrootLimit").ToNumber().Int64Value() : 0;
     param.workingDirectory = fs::path(GetStringWithEmptyCheck(jsparam.Get("workingDirectory")));
     param.executable = GetStringWithEmptyCheck(jsparam.Get("executable"));
     param.hostname = GetStringWithEmptyCheck(jsparam.Get("hostname"));
@@ -122,17 +188,24 @@ Napi::Value NodeStartSandbox(const Napi::CallbackInfo &info)
     if (cpuAffinity.IsArray()) {
         param.cpuAffinity = IntArrayToVector(cpuAffinity.As<Napi::Array>());
     }
-
-#define SET_REDIRECTION(_name_)                                                                  \
-    if (jsparam.Get(#_name_).IsNumber())                                                         \
-    {                                                                                            \
-        param._name_##RedirectionFileDescriptor = jsparam.Get(#_name_).ToNumber().Int32Value();  \
-    }                                                                                            \
-    else                                                                                         \
-    {                                                                                            \
-        param._name_##RedirectionFileDescriptor = -1;                                            \
-        param._name_##Redirection = GetStringWithEmptyCheck(jsparam.Get(#_name_));               \
+    // In milliseconds, as `time`.
+    double cpuQuota = jsparam.Get("cpuQuota").IsNumber() ? jsparam.Get("cpuQuota").ToNumber().DoubleValue() : -1;
+    double cpuPeriod = jsparam.Get("cpuPeriod").IsNumber() ? jsparam.Get("cpuPeriod").ToNumber().DoubleValue() : 0;
+    param.cpuQuota = cpuQuota > 0 ? static_cast<int64_t>(cpuQuota * 1000) : -1;
+    param.cpuPeriod = cpuPeriod > 0 ? static_cast<int64_t>(cpuPeriod * 1000) : 0;
+    if (jsparam.Get("cpuset").IsArray()) {
+        param.cpuset = IntArrayToVector(jsparam.Get("cpuset").As<Napi::Array>());
+    }
+    if (jsparam.Get("memoryNodes").IsArray()) {
+        param.memoryNodes = IntArrayToVector(jsparam.Get("memoryNodes").As<Napi::Array>());
     }
+    if (jsparam.Get("seccomp").IsString()) {
+        param.seccompProfile = jsparam.Get("seccomp").ToString().Utf8Value();
+    }
+    param.compareMode = ParseCompareMode(jsparam.Get("compareMode"));
+    param.expectedOutput = ParseExpectedOutput(jsparam);
+    param.compareEpsilon = jsparam.Get("compareEpsilon").IsNumber() ? jsparam.Get("compareEpsilon").ToNumber().DoubleValue() : 1e-6;
+    param.stopOnMismatch = jsparam.Get("stopOnMismatch").ToBoolean().Value();
 
     SET_REDIRECTION(stdin);
     SET_REDIRECTION(stdout);
@@ -157,19 +230,227 @@ Napi::Value NodeStartSandbox(const Napi::CallbackInfo &info)
         MountInfo mnt;
         mnt.src = fs::path(GetStringWithEmptyCheck(mntObj.Get("src")));
         mnt.dst = fs::path(GetStringWithEmptyCheck(mntObj.Get("dst")));
-        mnt.limit = mntObj.Get("limit").ToNumber().Int32Value();
+        mnt.limit = mntObj.Get("limit").ToNumber().Int64Value();
+        mnt.copyOut = mntObj.Get("copyOut").ToBoolean();
         param.mounts.push_back(mnt);
     }
 
+    return param;
+}
+
+// Only the fields in SandboxRunParameter are taken from `jsparam`.
+SandboxRunParameter ParseRunParameter(const Napi::Object &jsparam)
+{
+    SandboxRunParameter param;
+    param.executable = GetStringWithEmptyCheck(jsparam.Get("executable"));
+    param.executableParameters = StringArrayToVector(jsparam.Get("parameters").As<Napi::Array>());
+    param.environmentVariables = StringArrayToVector(jsparam.Get("environments").As<Napi::Array>());
+
+    const auto &cpuAffinity = jsparam.Get("cpuAffinity");
+    if (cpuAffinity.IsArray()) {
+        param.cpuAffinity = IntArrayToVector(cpuAffinity.As<Napi::Array>());
+    }
+    param.expectedOutput = ParseExpectedOutput(jsparam);
+
+    SET_REDIRECTION(stdin);
+    SET_REDIRECTION(stdout);
+    SET_REDIRECTION(stderr);
+
+    return param;
+}
+
+// Only the cgroup and the redirections are taken from `jsparam`.
+SandboxTemplateRun ParseTemplateRun(const Napi::Object &jsparam)
+{
+    SandboxTemplateRun param;
+    param.cgroupName = GetStringWithEmptyCheck(jsparam.Get("cgroup"));
+    param.expectedOutput = ParseExpectedOutput(jsparam);
+
+    SET_REDIRECTION(stdin);
+    SET_REDIRECTION(stdout);
+    SET_REDIRECTION(stderr);
+
+    return param;
+}
+
+Napi::Object StartResultToObject(Napi::Env env, pid_t pid, void *execParam)
+{
+    Napi::Object result = Napi::Object::New(env);
+    result.Set("pid", Napi::Number::New(env, pid));
+    Napi::ArrayBuffer pointerToExecParam = Napi::ArrayBuffer::New(env, sizeof(execParam));
+    *reinterpret_cast<void **>(pointerToExecParam.Data()) = execParam;
+    result.Set("execParam", pointerToExecParam);
+    return result;
+}
+
+// Once started by `startZygote`, `startSandbox` starts the sandboxes from it.
+std::unique_ptr<Zygote> zygote;
+
+// The zygote executable is built next to the addon, by default.
+static fs::path DefaultZygoteExecutable()
+{
+    Dl_info info;
+    if (dladdr(reinterpret_cast<void *>(&DefaultZygoteExecutable), &info) == 0 || info.dli_fname == nullptr)
+    {
+        throw std::runtime_error("Failed to locate the addon.");
+    }
+    return fs::path(info.dli_fname).parent_path() / "sandbox-zygote";
+}
+
+void NodeStartZygote(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
     try
     {
+        if (zygote)
+        {
+            throw std::logic_error("The zygote has already been started.");
+        }
+        fs::path executable = info[0].IsString() ? fs::path(info[0].ToString().Utf8Value()) : DefaultZygoteExecutable();
+        zygote = std::make_unique<Zygote>(executable);
+    }
+    catch (std::exception &ex)
+    {
+        Napi::Error::New(env, ex.what()).ThrowAsJavaScriptException();
+    }
+}
+
+Napi::Value NodeStartSandbox(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    try
+    {
+        // Throws for an unknown comparison mode.
+        SandboxParameter param = ParseSandboxParameter(info[0].As<Napi::Object>());
         pid_t pid;
+        if (zygote)
+        {
+            void *handle = zygote->Start(param, pid);
+            Napi::Object result = StartResultToObject(env, pid, handle);
+            result.Set("zygote", true);
+            return result;
+        }
         void *execParam = StartSandbox(param, pid);
-        Napi::Object result = Napi::Object::New(env);
-        result.Set("pid", Napi::Number::New(env, pid));
-        Napi::ArrayBuffer pointerToExecParam = Napi::ArrayBuffer::New(env, sizeof(execParam));
-        *reinterpret_cast<void **>(pointerToExecParam.Data()) = execParam;
-        result.Set("execParam", pointerToExecParam);
+        return StartResultToObject(env, pid, execParam);
+    }
+    catch (std::exception &ex)
+    {
+        Napi::Error::New(env, ex.what()).ThrowAsJavaScriptException();
+    }
+    catch (...)
+    {
+        Napi::Error::New(env, "Something unexpected happened while starting sandbox.").ThrowAsJavaScriptException();
+    }
+    return Napi::Value();
+}
+
+Napi::Value NodeCompileSandboxTemplate(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    try
+    {
+        SandboxParameter param = ParseSandboxParameter(info[0].As<Napi::Object>());
+        SandboxTemplate *sandboxTemplate = new SandboxTemplate(std::move(param));
+        Napi::ArrayBuffer pointerToTemplate = Napi::ArrayBuffer::New(env, sizeof(sandboxTemplate));
+        *reinterpret_cast<SandboxTemplate **>(pointerToTemplate.Data()) = sandboxTemplate;
+        return pointerToTemplate;
+    }
+    catch (std::exception &ex)
+    {
+        Napi::Error::New(env, ex.what()).ThrowAsJavaScriptException();
+    }
+    return Napi::Value();
+}
+
+Napi::Value NodeStartSandboxFromTemplate(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    SandboxTemplate *sandboxTemplate = *reinterpret_cast<SandboxTemplate **>(info[0].As<Napi::ArrayBuffer>().Data());
+    if (sandboxTemplate == nullptr)
+    {
+        Napi::Error::New(env, "The sandbox template has been destroyed.").ThrowAsJavaScriptException();
+        return Napi::Value();
+    }
+
+    try
+    {
+        const SandboxParameter &param = sandboxTemplate->Apply(ParseTemplateRun(info[1].As<Napi::Object>()));
+        pid_t pid;
+        if (zygote)
+        {
+            void *handle = zygote->Start(param, pid);
+            Napi::Object result = StartResultToObject(env, pid, handle);
+            result.Set("zygote", true);
+            return result;
+        }
+        void *execParam = StartSandbox(param, pid, &sandboxTemplate->Arena());
+        return StartResultToObject(env, pid, execParam);
+    }
+    catch (std::exception &ex)
+    {
+        Napi::Error::New(env, ex.what()).ThrowAsJavaScriptException();
+    }
+    catch (...)
+    {
+        Napi::Error::New(env, "Something unexpected happened while starting sandbox.").ThrowAsJavaScriptException();
+    }
+    return Napi::Value();
+}
+
+void NodeDestroySandboxTemplate(const Napi::CallbackInfo &info)
+{
+    SandboxTemplate **pointerToTemplate = reinterpret_cast<SandboxTemplate **>(info[0].As<Napi::ArrayBuffer>().Data());
+    delete *pointerToTemplate;
+    *pointerToTemplate = nullptr;
+}
+
+Napi::Value NodeCreateSandboxPool(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    int size = info[1].ToNumber().Int32Value();
+
+    try
+    {
+        SandboxParameter param = ParseSandboxParameter(info[0].As<Napi::Object>());
+        SandboxPool *pool = new SandboxPool(param, size);
+        Napi::ArrayBuffer pointerToPool = Napi::ArrayBuffer::New(env, sizeof(pool));
+        *reinterpret_cast<SandboxPool **>(pointerToPool.Data()) = pool;
+        return pointerToPool;
+    }
+    catch (std::exception &ex)
+    {
+        Napi::Error::New(env, ex.what()).ThrowAsJavaScriptException();
+    }
+    catch (...)
+    {
+        Napi::Error::New(env, "Something unexpected happened while creating sandbox pool.").ThrowAsJavaScriptException();
+    }
+    return Napi::Value();
+}
+
+Napi::Value NodeStartSandboxFromPool(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    SandboxPool *pool = *reinterpret_cast<SandboxPool **>(info[0].As<Napi::ArrayBuffer>().Data());
+    SandboxRunParameter param = ParseRunParameter(info[1].As<Napi::Object>());
+    if (pool == nullptr)
+    {
+        Napi::Error::New(env, "The sandbox pool has been destroyed.").ThrowAsJavaScriptException();
+        return Napi::Value();
+    }
+
+    try
+    {
+        pid_t pid;
+        string cgroupName;
+        void *execParam = pool->Start(param, pid, cgroupName);
+        Napi::Object result = StartResultToObject(env, pid, execParam);
+        result.Set("cgroup", Napi::String::New(env, cgroupName));
         return result;
     }
     catch (std::exception &ex)
@@ -183,57 +464,550 @@ Napi::Value NodeStartSandbox(const Napi::CallbackInfo &info)
     return Napi::Value();
 }
 
-class WaitForProcessWorker : public Napi::AsyncWorker
+void NodeDestroySandboxPool(const Napi::CallbackInfo &info)
 {
-private:
-    pid_t pid;
-    void *executionParameter;
-    ExecutionResult result;
+    SandboxPool **pointerToPool = reinterpret_cast<SandboxPool **>(info[0].As<Napi::ArrayBuffer>().Data());
+    delete *pointerToPool;
+    *pointerToPool = nullptr;
+}
 
-public:
-    WaitForProcessWorker(Napi::Function &callback, pid_t pid, void *executionParameter)
-        : Napi::AsyncWorker(callback), pid(pid), executionParameter(executionParameter) {}
+// The scheduler is shared by the JavaScript object and the cores it has granted,
+// so that destroying the former doesn't affect the sandboxes still running.
+typedef std::shared_ptr<CoreScheduler> SchedulerHandle;
 
-    void Execute()
+static SchedulerHandle GetScheduler(const Napi::Value &value)
+{
+    SchedulerHandle *handle = *reinterpret_cast<SchedulerHandle **>(value.As<Napi::ArrayBuffer>().Data());
+    if (handle == nullptr)
     {
-        try
+        throw std::logic_error("The core scheduler has been destroyed.");
+    }
+    return *handle;
+}
+
+// createCoreScheduler(cpus, isolateSiblings)
+Napi::Value NodeCreateCoreScheduler(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    try
+    {
+        std::vector<int> cpus;
+        if (info[0].IsArray())
         {
-            result = WaitForProcess(pid, executionParameter);
+            cpus = IntArrayToVector(info[0].As<Napi::Array>());
         }
-        catch (std::exception &ex)
+        SchedulerHandle *handle = new SchedulerHandle(std::make_shared<CoreScheduler>(cpus, info[1].ToBoolean().Value()));
+        Napi::ArrayBuffer pointerToHandle = Napi::ArrayBuffer::New(env, sizeof(handle));
+        *reinterpret_cast<SchedulerHandle **>(pointerToHandle.Data()) = handle;
+        return pointerToHandle;
+    }
+    catch (std::exception &ex)
+    {
+        Napi::Error::New(env, ex.what()).ThrowAsJavaScriptException();
+    }
+    return Napi::Value();
+}
+
+// A core granted by a scheduler, held by JavaScript until it's given to a sandbox (see GetCoreRelease) or released.
+// It holds the scheduler as well, so that destroying the scheduler only stops new requests.
+struct CoreLease
+{
+    SchedulerHandle scheduler;
+    int cpu;
+};
+
+// Take the lease out of its handle, which is then empty; nullptr if it has been taken already.
+static std::unique_ptr<CoreLease> TakeCoreLease(const Napi::Value &value)
+{
+    CoreLease **pointerToLease = reinterpret_cast<CoreLease **>(value.As<Napi::ArrayBuffer>().Data());
+    std::unique_ptr<CoreLease> lease(*pointerToLease);
+    *pointerToLease = nullptr;
+    return lease;
+}
+
+// requestCore(scheduler, callback(cpu, lease)), where the callback is called once a core is granted,
+// with the handle of its lease.
+void NodeRequestCore(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    try
+    {
+        SchedulerHandle scheduler = GetScheduler(info[0]);
+        Napi::ThreadSafeFunction tsfn = Napi::ThreadSafeFunction::New(env, info[1].As<Napi::Function>(), "requestCore", 0, 1);
+        // Not owned by the callback, which the scheduler owns while it's queued.
+        std::weak_ptr<CoreScheduler> weakScheduler = scheduler;
+        scheduler->Request([tsfn, weakScheduler](int cpu) mutable {
+            // Whoever grants the core (a release, or the request itself) holds the scheduler.
+            CoreLease *lease = new CoreLease{weakScheduler.lock(), cpu};
+            tsfn.NonBlockingCall(lease, [](Napi::Env env, Napi::Function callback, CoreLease *lease) {
+                Napi::ArrayBuffer pointerToLease = Napi::ArrayBuffer::New(env, sizeof(lease));
+                *reinterpret_cast<CoreLease **>(pointerToLease.Data()) = lease;
+                callback.Call({Napi::Number::New(env, lease->cpu), pointerToLease});
+            });
+            tsfn.Release();
+        });
+    }
+    catch (std::exception &ex)
+    {
+        Napi::Error::New(env, ex.what()).ThrowAsJavaScriptException();
+    }
+}
+
+// releaseCore(lease), for a core that hasn't been given to a sandbox (e.g. it has failed to start);
+// nothing to do if it has.
+void NodeReleaseCore(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    try
+    {
+        std::unique_ptr<CoreLease> lease = TakeCoreLease(info[0]);
+        if (lease)
+            lease->scheduler->Release(lease->cpu);
+    }
+    catch (std::exception &ex)
+    {
+        Napi::Error::New(env, ex.what()).ThrowAsJavaScriptException();
+    }
+}
+
+Napi::Value NodeGetCoreSchedulerStats(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    try
+    {
+        CoreSchedulerStats stats = GetScheduler(info[0])->GetStats();
+        Napi::Object obj = Napi::Object::New(env);
+        obj.Set("running", Napi::Number::New(env, stats.running));
+        obj.Set("cores", Napi::Number::New(env, stats.cores));
+        obj.Set("queued", Napi::Number::New(env, stats.queued));
+        obj.Set("admitted", Napi::Number::New(env, stats.admitted));
+        obj.Set("totalWaitTime", Napi::Number::New(env, stats.totalWaitTime));
+        obj.Set("maxWaitTime", Napi::Number::New(env, stats.maxWaitTime));
+        return obj;
+    }
+    catch (std::exception &ex)
+    {
+        Napi::Error::New(env, ex.what()).ThrowAsJavaScriptException();
+    }
+    return Napi::Value();
+}
+
+void NodeDestroyCoreScheduler(const Napi::CallbackInfo &info)
+{
+    SchedulerHandle **pointerToHandle = reinterpret_cast<SchedulerHandle **>(info[0].As<Napi::ArrayBuffer>().Data());
+    delete *pointerToHandle;
+    *pointerToHandle = nullptr;
+}
+
+// The core granted to a sandbox, given as the handle of its lease at `index` of the arguments, if any,
+// which is taken. The returned function releases it, and is empty without one.
+static std::function<void()> GetCoreRelease(const Napi::CallbackInfo &info, size_t index)
+{
+    if (!info[index].IsArrayBuffer())
+    {
+        return nullptr;
+    }
+    std::unique_ptr<CoreLease> lease = TakeCoreLease(info[index]);
+    if (!lease)
+    {
+        throw std::logic_error("The core has been given to another sandbox, or released.");
+    }
+    SchedulerHandle scheduler = lease->scheduler;
+    int cpu = lease->cpu;
+    return [scheduler, cpu]() {
+        try
         {
-            SetError(ex.what());
+            scheduler->Release(cpu);
         }
         catch (...)
         {
-            SetError("Something unexpected occurred while waiting for process termiation");
         }
+    };
+}
+
+static double TimevalToNano(const timeval &time)
+{
+    return time.tv_sec * 1e9 + time.tv_usec * 1e3;
+}
+
+Napi::Object ExecutionResultToObject(Napi::Env env, const ExecutionResult &result)
+{
+    Napi::Object obj = Napi::Object::New(env);
+    obj.Set("status", result.status == EXITED ? "exited" : "signaled");
+    obj.Set("code", result.code);
+    obj.Set("timeLimitExceeded", result.timeLimitExceeded);
+    obj.Set("outputLimitExceeded", result.outputLimitExceeded);
+    obj.Set("memoryLimitExceeded", result.memoryLimitExceeded);
+    obj.Set("mismatchOffset", Napi::Number::New(env, result.mismatchOffset));
+    obj.Set("killedOnMismatch", result.killedOnMismatch);
+    // Well below 2^53, so a Number is fine.
+    obj.Set("time", Napi::Number::New(env, result.usage.time));
+    obj.Set("memory", Napi::Number::New(env, result.usage.memory));
+    Napi::Object memoryPeaks = Napi::Object::New(env);
+    memoryPeaks.Set("anon", Napi::Number::New(env, result.usage.memoryPeaks.anon));
+    memoryPeaks.Set("file", Napi::Number::New(env, result.usage.memoryPeaks.file));
+    memoryPeaks.Set("shmem", Napi::Number::New(env, result.usage.memoryPeaks.shmem));
+    obj.Set("memoryPeaks", memoryPeaks);
+    obj.Set("oomKilled", result.usage.oomKilled);
+    if (!result.killedSyscall.empty())
+    {
+        obj.Set("killedSyscall", result.killedSyscall);
+    }
+
+    const rusage &usage = result.resourceUsage;
+    Napi::Object resourceUsage = Napi::Object::New(env);
+    resourceUsage.Set("userTime", Napi::Number::New(env, TimevalToNano(usage.ru_utime)));
+    resourceUsage.Set("systemTime", Napi::Number::New(env, TimevalToNano(usage.ru_stime)));
+    resourceUsage.Set("maxResidentSetSize", Napi::Number::New(env, usage.ru_maxrss * 1024.0)); // In bytes, from `ru_maxrss` in KiB.
+    resourceUsage.Set("minorPageFaults", Napi::Number::New(env, usage.ru_minflt));
+    resourceUsage.Set("majorPageFaults", Napi::Number::New(env, usage.ru_majflt));
+    resourceUsage.Set("voluntaryContextSwitches", Napi::Number::New(env, usage.ru_nvcsw));
+    resourceUsage.Set("involuntaryContextSwitches", Napi::Number::New(env, usage.ru_nivcsw));
+    obj.Set("resourceUsage", resourceUsage);
+    return obj;
+}
+
+struct WaitResult
+{
+    ExecutionResult result;
+    string error;
+};
+
+// Call back `callback` through a thread-safe function, from the thread `wait` calls its callback on.
+// `releaseCore` (if any) is called there first, so the core of the sandbox goes to the next one as soon as it's reaped.
+static void WaitWithCallback(Napi::Env env, Napi::Function callback, const std::function<void(WaitCallback)> &wait,
+                             std::function<void()> releaseCore)
+{
+    Napi::ThreadSafeFunction tsfn = Napi::ThreadSafeFunction::New(env, callback, "waitForProcess", 0, 1);
+    try
+    {
+        wait([tsfn, releaseCore](const ExecutionResult &result, const string &error) mutable {
+            if (releaseCore)
+            {
+                releaseCore();
+            }
+            tsfn.NonBlockingCall(new WaitResult{result, error}, [](Napi::Env env, Napi::Function callback, WaitResult *result) {
+                if (result->error.empty())
+                    callback.Call({env.Undefined(), ExecutionResultToObject(env, result->result)});
+                else
+                    callback.Call({Napi::Error::New(env, result->error).Value()});
+                delete result;
+            });
+            tsfn.Release();
+        });
+    }
+    catch (std::exception &ex)
+    {
+        tsfn.Release();
+        if (releaseCore)
+        {
+            releaseCore();
+        }
+        Napi::Error::New(env, ex.what()).ThrowAsJavaScriptException();
     }
+}
 
-    void OnOK()
+// The sandbox is reaped on the monitor thread, which calls back through a thread-safe function,
+// so no thread of the libuv threadpool is blocked while the sandbox is running.
+// waitForProcess(pid, execParam, callback[, lease])
+void NodeWaitForProcess(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    try
     {
-        Napi::Env env = Env();
+        pid_t pid = info[0].ToNumber().Int32Value();
+        void *executionParameter = *reinterpret_cast<void **>(info[1].As<Napi::ArrayBuffer>().Data());
+        WaitWithCallback(env, info[2].As<Napi::Function>(), [pid, executionParameter](WaitCallback callback) {
+            WaitForProcessAsync(pid, executionParameter, callback);
+        }, GetCoreRelease(info, 3));
+    }
+    catch (std::exception &ex)
+    {
+        Napi::Error::New(env, ex.what()).ThrowAsJavaScriptException();
+    }
+}
 
-        Napi::Object obj = Napi::Object::New(env);
+// For a sandbox started from the zygote, whose result is received on the monitor thread.
+// waitForZygoteProcess(handle, callback[, lease])
+void NodeWaitForZygoteProcess(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    try
+    {
+        void *handle = *reinterpret_cast<void **>(info[0].As<Napi::ArrayBuffer>().Data());
+        WaitWithCallback(env, info[1].As<Napi::Function>(), [handle](WaitCallback callback) {
+            WaitForZygoteProcessAsync(handle, callback);
+        }, GetCoreRelease(info, 2));
+    }
+    catch (std::exception &ex)
+    {
+        Napi::Error::New(env, ex.what()).ThrowAsJavaScriptException();
+    }
+}
 
-        obj.Set("status", result.status == EXITED ? "exited" : "signaled");
-        obj.Set("code", result.code);
+// startInteractive(contestant, interactor, countTraffic)
+// Neither is started from the zygote, since the pipes between them are created here.
+Napi::Value NodeStartInteractive(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
 
-        Callback().Call({env.Undefined(), obj});
+    try
+    {
+        SandboxParameter contestant = ParseSandboxParameter(info[0].As<Napi::Object>());
+        SandboxParameter interactor = ParseSandboxParameter(info[1].As<Napi::Object>());
+        pid_t contestantPid, interactorPid;
+        void *interactive = StartInteractive(contestant, interactor, info[2].ToBoolean().Value(), contestantPid, interactorPid);
+        Napi::Object result = Napi::Object::New(env);
+        result.Set("contestantPid", Napi::Number::New(env, contestantPid));
+        result.Set("interactorPid", Napi::Number::New(env, interactorPid));
+        Napi::ArrayBuffer pointerToInteractive = Napi::ArrayBuffer::New(env, sizeof(interactive));
+        *reinterpret_cast<void **>(pointerToInteractive.Data()) = interactive;
+        result.Set("handle", pointerToInteractive);
+        return result;
     }
+    catch (std::exception &ex)
+    {
+        Napi::Error::New(env, ex.what()).ThrowAsJavaScriptException();
+    }
+    catch (...)
+    {
+        Napi::Error::New(env, "Something unexpected happened while starting sandbox.").ThrowAsJavaScriptException();
+    }
+    return Napi::Value();
+}
+
+struct InteractiveWaitResult
+{
+    InteractiveResult result;
+    string error;
 };
 
+// waitForInteractive(handle, callback), where the callback gets both results once both sandboxes are reaped.
+void NodeWaitForInteractive(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    void *interactive = *reinterpret_cast<void **>(info[0].As<Napi::ArrayBuffer>().Data());
+    Napi::ThreadSafeFunction tsfn = Napi::ThreadSafeFunction::New(env, info[1].As<Napi::Function>(), "waitForInteractive", 0, 1);
+    WaitForInteractiveAsync(interactive, [tsfn](const InteractiveResult &result, const string &error) mutable {
+        tsfn.NonBlockingCall(new InteractiveWaitResult{result, error}, [](Napi::Env env, Napi::Function callback, InteractiveWaitResult *result) {
+            if (result->error.empty())
+            {
+                Napi::Object obj = Napi::Object::New(env);
+                obj.Set("contestant", ExecutionResultToObject(env, result->result.contestant));
+                obj.Set("interactor", ExecutionResultToObject(env, result->result.interactor));
+                obj.Set("interactorFirst", result->result.interactorFirst);
+                obj.Set("contestantBytes", Napi::Number::New(env, result->result.contestantBytes));
+                obj.Set("interactorBytes", Napi::Number::New(env, result->result.interactorBytes));
+                callback.Call({env.Undefined(), obj});
+            }
+            else
+            {
+                callback.Call({Napi::Error::New(env, result->error).Value()});
+            }
+            delete result;
+        });
+        tsfn.Release();
+    });
+}
 
-void NodeWaitForProcess(const Napi::CallbackInfo &info)
+// The helper is started on the thread of the server, with the first job.
+Napi::Value NodeCreateCompileServer(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    try
+    {
+        SandboxParameter param = ParseSandboxParameter(info[0].As<Napi::Object>());
+        CompileServer *server = new CompileServer(param);
+        Napi::ArrayBuffer pointerToServer = Napi::ArrayBuffer::New(env, sizeof(server));
+        *reinterpret_cast<CompileServer **>(pointerToServer.Data()) = server;
+        return pointerToServer;
+    }
+    catch (std::exception &ex)
+    {
+        Napi::Error::New(env, ex.what()).ThrowAsJavaScriptException();
+    }
+    return Napi::Value();
+}
+
+struct CompileWaitResult
+{
+    CompileResult result;
+    string error;
+};
+
+// compile(server, line, time, callback(err, result)), where `time` is in milliseconds as in the parameter.
+void NodeCompile(const Napi::CallbackInfo &info)
 {
     Napi::Env env = info.Env();
 
-    pid_t pid = info[0].ToNumber().Int32Value();
-    void *executionParameter = *reinterpret_cast<void **>(info[1].As<Napi::ArrayBuffer>().Data());
-    Napi::Function callback = info[2].As<Napi::Function>();
+    CompileServer *server = *reinterpret_cast<CompileServer **>(info[0].As<Napi::ArrayBuffer>().Data());
+    if (server == nullptr)
+    {
+        Napi::Error::New(env, "The compile server has been destroyed.").ThrowAsJavaScriptException();
+        return;
+    }
+    string line = GetStringWithEmptyCheck(info[1]);
+    double timeLimit = info[2].ToNumber().DoubleValue();
 
-    WaitForProcessWorker *waitForProcessWorker = new WaitForProcessWorker(callback, pid, executionParameter);
-    waitForProcessWorker->Queue();
+    Napi::ThreadSafeFunction tsfn = Napi::ThreadSafeFunction::New(env, info[3].As<Napi::Function>(), "compile", 0, 1);
+    try
+    {
+        server->Submit(line, timeLimit >= 0 ? static_cast<int64_t>(timeLimit * 1000 * 1000) : -1,
+                       [tsfn](const CompileResult &result, const string &error) mutable {
+            tsfn.NonBlockingCall(new CompileWaitResult{result, error}, [](Napi::Env env, Napi::Function callback, CompileWaitResult *result) {
+                if (result->error.empty())
+                {
+                    Napi::Object obj = Napi::Object::New(env);
+                    obj.Set("reply", result->result.reply);
+                    obj.Set("time", Napi::Number::New(env, result->result.time));
+                    obj.Set("timeLimitExceeded", result->result.timeLimitExceeded);
+                    obj.Set("helperExited", result->result.helperExited);
+                    if (result->result.helperExited)
+                    {
+                        obj.Set("helperResult", ExecutionResultToObject(env, result->result.helperResult));
+                    }
+                    callback.Call({env.Undefined(), obj});
+                }
+                else
+                {
+                    callback.Call({Napi::Error::New(env, result->error).Value()});
+                }
+                delete result;
+            });
+            tsfn.Release();
+        });
+    }
+    catch (std::exception &ex)
+    {
+        tsfn.Release();
+        Napi::Error::New(env, ex.what()).ThrowAsJavaScriptException();
+    }
+}
+
+void NodeDestroyCompileServer(const Napi::CallbackInfo &info)
+{
+    CompileServer **pointerToServer = reinterpret_cast<CompileServer **>(info[0].As<Napi::ArrayBuffer>().Data());
+    delete *pointerToServer;
+    *pointerToServer = nullptr;
+}
+
+// The state of a batch started by `runBatch`, which lives until the thread-safe function is finalized.
+struct BatchContext
+{
+    SandboxParameter parameter;
+    std::vector<SandboxRunParameter> cases;
+    int concurrency;
+    // Null if the cases are not pinned to cores.
+    SchedulerHandle scheduler;
+
+    Napi::ThreadSafeFunction onResult;
+    Napi::FunctionReference onDone;
+    // Set if the batch can't be run at all.
+    string error;
+    std::thread thread;
+};
+
+// runBatch(template, cases, concurrency, onResult(err, index, result), onDone(err)[, scheduler])
+// The parameters are converted only once; the cases are run on native threads (see RunBatch),
+// and each result is sent to `onResult` as soon as the case finishes.
+void NodeRunBatch(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    BatchContext *context = new BatchContext();
+    try
+    {
+        context->parameter = ParseSandboxParameter(info[0].As<Napi::Object>());
+        Napi::Array cases = info[1].As<Napi::Array>();
+        for (size_t i = 0; i < cases.Length(); i++)
+        {
+            context->cases.push_back(ParseRunParameter(static_cast<Napi::Value>(cases[i]).As<Napi::Object>()));
+        }
+        context->concurrency = info[2].ToNumber().Int32Value();
+        context->onDone = Napi::Persistent(info[4].As<Napi::Function>());
+        if (info[5].IsArrayBuffer())
+        {
+            context->scheduler = GetScheduler(info[5]);
+        }
+    }
+    catch (std::exception &ex)
+    {
+        delete context;
+        Napi::Error::New(env, ex.what()).ThrowAsJavaScriptException();
+        return;
+    }
+    catch (...)
+    {
+        delete context;
+        Napi::Error::New(env, "Something unexpected happened while starting the batch.").ThrowAsJavaScriptException();
+        return;
+    }
+
+    context->onResult = Napi::ThreadSafeFunction::New(
+        env, info[3].As<Napi::Function>(), "runBatch", 0, 1, context,
+        [](Napi::Env env, BatchContext *context) {
+            context->thread.join();
+            if (context->error.empty())
+                context->onDone.Call({env.Undefined()});
+            else
+                context->onDone.Call({Napi::Error::New(env, context->error).Value()});
+            delete context;
+        });
+
+    context->thread = std::thread([context]() {
+        try
+        {
+            RunBatch(context->parameter, context->cases, context->concurrency, [context](BatchResult &&result) {
+                context->onResult.BlockingCall(new BatchResult(std::move(result)), [](Napi::Env env, Napi::Function callback, BatchResult *result) {
+                    Napi::Value error = env.Undefined(), value = env.Undefined();
+                    if (!result->error.empty())
+                    {
+                        error = Napi::Error::New(env, result->error).Value();
+                    }
+                    else
+                    {
+                        value = ExecutionResultToObject(env, result->result);
+                    }
+                    callback.Call({error, Napi::Number::New(env, result->index), value});
+                    delete result;
+                });
+            }, context->scheduler.get());
+        }
+        catch (std::exception &ex)
+        {
+            context->error = ex.what();
+        }
+        catch (...)
+        {
+            context->error = "Something unexpected happened while running the batch.";
+        }
+        context->onResult.Release();
+    });
+}
+
+// The histograms of the phases of starting sandboxes (see telemetry.h), as a Float64Array of
+// (count, p50, p99, max) for each of `phases`, in nanoseconds.
+Napi::Value NodeGetSandboxTelemetry(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    std::vector<PhaseHistogram> histograms = CollectTelemetry();
+    const size_t fields = 4;
+    Napi::Float64Array values = Napi::Float64Array::New(env, histograms.size() * fields);
+    Napi::Array phases = Napi::Array::New(env, histograms.size());
+    for (size_t i = 0; i < histograms.size(); i++)
+    {
+        phases.Set(static_cast<uint32_t>(i), Napi::String::New(env, sandboxPhaseNames[i]));
+        values[i * fields] = histograms[i].count;
+        values[i * fields + 1] = histograms[i].p50;
+        values[i * fields + 2] = histograms[i].p99;
+        values[i * fields + 3] = histograms[i].max;
+    }
+    Napi::Object result = Napi::Object::New(env);
+    result.Set("phases", phases);
+    result.Set("histograms", values);
+    return result;
 }
 
 Napi::Value NodeGetUidAndGidInSandbox(const Napi::CallbackInfo &info)
@@ -262,9 +1036,31 @@ Napi::Object Init(Napi::Env env, Napi::Object exports) {
     exports.Set("getCgroupProperty", Napi::Function::New(env, NodeGetCgroupProperty));
     exports.Set("getCgroupProperty2", Napi::Function::New(env, NodeGetCgroupProperty2));
     exports.Set("removeCgroup", Napi::Function::New(env, NodeRemoveCgroup));
+    exports.Set("removeSandboxCgroups", Napi::Function::New(env, NodeRemoveSandboxCgroups));
+    exports.Set("cgroupVersion", Napi::Number::New(env, IsCgroupV2() ? 2 : 1));
     exports.Set("getUidAndGidInSandbox", Napi::Function::New(env, NodeGetUidAndGidInSandbox));
     exports.Set("startSandbox", Napi::Function::New(env, NodeStartSandbox));
     exports.Set("waitForProcess", Napi::Function::New(env, NodeWaitForProcess));
+    exports.Set("startZygote", Napi::Function::New(env, NodeStartZygote));
+    exports.Set("waitForZygoteProcess", Napi::Function::New(env, NodeWaitForZygoteProcess));
+    exports.Set("compileSandboxTemplate", Napi::Function::New(env, NodeCompileSandboxTemplate));
+    exports.Set("startSandboxFromTemplate", Napi::Function::New(env, NodeStartSandboxFromTemplate));
+    exports.Set("destroySandboxTemplate", Napi::Function::New(env, NodeDestroySandboxTemplate));
+    exports.Set("createSandboxPool", Napi::Function::New(env, NodeCreateSandboxPool));
+    exports.Set("startSandboxFromPool", Napi::Function::New(env, NodeStartSandboxFromPool));
+    exports.Set("destroySandboxPool", Napi::Function::New(env, NodeDestroySandboxPool));
+    exports.Set("createCoreScheduler", Napi::Function::New(env, NodeCreateCoreScheduler));
+    exports.Set("requestCore", Napi::Function::New(env, NodeRequestCore));
+    exports.Set("releaseCore", Napi::Function::New(env, NodeReleaseCore));
+    exports.Set("getCoreSchedulerStats", Napi::Function::New(env, NodeGetCoreSchedulerStats));
+    exports.Set("destroyCoreScheduler", Napi::Function::New(env, NodeDestroyCoreScheduler));
+    exports.Set("runBatch", Napi::Function::New(env, NodeRunBatch));
+    exports.Set("startInteractive", Napi::Function::New(env, NodeStartInteractive));
+    exports.Set("waitForInteractive", Napi::Function::New(env, NodeWaitForInteractive));
+    exports.Set("createCompileServer", Napi::Function::New(env, NodeCreateCompileServer));
+    exports.Set("compile", Napi::Function::New(env, NodeCompile));
+    exports.Set("destroyCompileServer", Napi::Function::New(env, NodeDestroyCompileServer));
+    exports.Set("getSandboxTelemetry", Napi::Function::New(env, NodeGetSandboxTelemetry));
     return exports;
 }
 
@@ -0,0 +1,133 @@
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <stdexcept>
+
+#include "batch.h"
+#include "pool.h"
+
+using std::string;
+using std::vector;
+
+// The same as the retrying in `retryStart` (sandboxProcess.ts): only a child that has died or hung while setting up
+// (e.g. killed on a loaded host) is retried; an error it has reported (e.g. a missing directory) would happen again.
+const int maxStartRetries = 2;
+
+static bool IsTransientChildFailure(const std::exception &ex)
+{
+    string message = ex.what();
+    return message == "The child process is not responding." || message == "The child process has exited unexpectedly.";
+}
+
+static void *StartCase(SandboxPool &pool, const SandboxRunParameter &run, pid_t &pid, string &cgroupName)
+{
+    for (int retries = 0;; retries++)
+    {
+        try
+        {
+            return pool.Start(run, pid, cgroupName);
+        }
+        catch (std::exception &ex)
+        {
+            if (retries >= maxStartRetries || !IsTransientChildFailure(ex))
+                throw;
+        }
+    }
+}
+
+static void RunCase(SandboxPool &pool, const SandboxRunParameter &run, BatchResult &result)
+{
+    pid_t pid;
+    string cgroupName;
+    void *execParam = StartCase(pool, run, pid, cgroupName);
+    try
+    {
+        result.result = WaitForProcess(pid, execParam);
+    }
+    catch (...)
+    {
+        try
+        {
+            RemoveSandboxCgroups(cgroupName);
+        }
+        catch (...)
+        {
+        }
+        throw;
+    }
+    RemoveSandboxCgroups(cgroupName);
+}
+
+void RunBatch(const SandboxParameter &parameter,
+              const vector<SandboxRunParameter> &cases,
+              int concurrency,
+              const BatchCallback &callback,
+              CoreScheduler *scheduler)
+{
+    if (concurrency <= 0)
+    {
+        throw std::invalid_argument("Concurrency must be positive.");
+    }
+    if (cases.empty())
+    {
+        return;
+    }
+
+    int workerCount = std::min<size_t>(concurrency, cases.size());
+    SandboxPool pool(parameter, workerCount);
+    std::atomic<size_t> next(0);
+
+    auto work = [&]() {
+        size_t index;
+        while ((index = next++) < cases.size())
+        {
+            BatchResult result;
+            result.index = index;
+            try
+            {
+                if (scheduler != nullptr)
+                {
+                    SandboxRunParameter run = cases[index];
+                    run.cpuAffinity = {scheduler->Acquire()};
+                    try
+                    {
+                        RunCase(pool, run, result);
+                    }
+                    catch (...)
+                    {
+                        scheduler->Release(run.cpuAffinity[0]);
+                        throw;
+                    }
+                    scheduler->Release(run.cpuAffinity[0]);
+                }
+                else
+                {
+                    RunCase(pool, cases[index], result);
+                }
+            }
+            catch (std::exception &ex)
+            {
+                result.error = ex.what();
+            }
+            catch (...)
+            {
+                result.error = "Something unexpected happened while running the case.";
+            }
+            callback(std::move(result));
+        }
+    };
+
+    vector<std::thread> workers;
+    for (int i = 1; i < workerCount; i++)
+    {
+        workers.emplace_back(work);
+    }
+    // This thread is a worker too.
+    work();
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+
+#include "sandbox.h"
+#include "scheduler.h"
+
+struct BatchResult
+{
+    // The index of the case in the batch.
+    size_t index;
+    // Empty if the case has been run; otherwise, why it couldn't be, and the other fields are not valid.
+    std::string error;
+    ExecutionResult result;
+};
+
+// Called on the worker threads, possibly concurrently, once each case has finished (in no particular order).
+typedef std::function<void(BatchResult &&)> BatchCallback;
+
+// Run each of `cases` with a sandbox made from the template `parameter`, at most `concurrency` at a time,
+// and return once all of them have finished.
+// The sandboxes are started from a SandboxPool of `concurrency` sandboxes, so the setup of the next case
+// (cloning, mounting, creating its cgroup) happens while the current one is running.
+// With a `scheduler`, each case waits for a core of its own, is pinned to it, and gives it back once reaped.
+void RunBatch(const SandboxParameter &parameter,
+              const std::vector<SandboxRunParameter> &cases,
+              int concurrency,
+              const BatchCallback &callback,
+              CoreScheduler *scheduler = nullptr);
@@ -6,14 +6,18 @@
 #include <fstream>
 #include <iostream>
 #include <stdexcept>
+#include <string_view>
+#include <system_error>
 
 #include <filesystem>
 
 #include <mntent.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <signal.h>
 #include <string.h>
+#include <inttypes.h>
 
 #include <fmt/format.h>
 #include <fmt/ostream.h>
@@ -27,11 +31,11 @@ using std::vector;
 using std::list;
 using std::map;
 using std::ifstream;
-using std::ofstream;
 namespace fs = std::filesystem;
 using fmt::format;
 
 const map<string, vector<fs::path>> cgroup_mnt = InitializeCgroup();
+const fs::path cgroup2_mnt = InitializeCgroup2();
 
 static bool IsEmpty(const string &str)
 {
@@ -93,8 +97,36 @@ map<string, vector<fs::path>> InitializeCgroup()
     return cgroup_mnt;
 }
 
+fs::path InitializeCgroup2()
+{
+    char buf[4 * FILENAME_MAX];
+
+    std::unique_ptr<FILE, decltype(fclose) *> proc_mount(CHECKNULL(fopen("/proc/mounts", "re")), fclose);
+    std::unique_ptr<mntent> temp_ent = std::make_unique<mntent>();
+    mntent *ent;
+    while ((ent = getmntent_r(proc_mount.get(), temp_ent.get(),
+                              buf,
+                              sizeof(buf))) != NULL)
+    {
+        if (!strcmp(ent->mnt_type, "cgroup2"))
+            return fs::path(string(ent->mnt_dir));
+    }
+
+    return fs::path();
+}
+
+bool IsCgroupV2()
+{
+    return cgroup_mnt.find("memory") == cgroup_mnt.end() && !cgroup2_mnt.empty();
+}
+
 static const fs::path &GetPath(const string &controller)
 {
+    if (IsCgroupV2())
+    {
+        return cgroup2_mnt;
+    }
+
     auto mnts = cgroup_mnt.find(controller);
     if (mnts == cgroup_mnt.end())
     {
@@ -113,87 +145,473 @@ static fs::path EnsureGroup(const CgroupInfo &info)
     return groupDirectory;
 }
 
-template <typename T>
-static void WriteFile(const fs::path &path, T val, bool overwrite)
+// Write the whole value with a single `write`, since each write to a cgroup file is taken as one operation.
+static void WriteValue(int fd, const char *value, size_t length, const fs::path &directory, const string &property)
 {
-    ofstream ofs;
-    ofs.exceptions(std::ios::failbit | std::ios::badbit);
-    auto flags = ofstream::out | (overwrite ? ofstream::trunc : ofstream::app);
-    ofs.open(path, flags);
-    ofs << val << std::endl;
+    ssize_t written = pwrite(fd, value, length, 0);
+    if (written == -1)
+    {
+        throw std::system_error(errno, std::system_category(), format("Writing {}", directory / property));
+    }
+    else if ((size_t)written != length)
+    {
+        throw std::runtime_error(format("Short write to {}", directory / property));
+    }
 }
 
-static void ReadArray64(const fs::path &path, list<int64_t> &cc)
+// Parse a decimal integer starting at `*position`, skipping spaces before it, and advance `*position` past it.
+// "max", as used by cgroup v2 for no limit, is parsed as -1.
+static bool ParseInt64(const char *&position, const char *end, int64_t &val)
+{
+    while (position < end && (*position == ' ' || *position == '\t' || *position == '\n'))
+        position++;
+    if (end - position >= 3 && memcmp(position, "max", 3) == 0)
+    {
+        position += 3;
+        val = -1;
+        return true;
+    }
+
+    bool negative = position < end && *position == '-';
+    if (negative)
+        position++;
+    if (position == end || *position < '0' || *position > '9')
+        return false;
+    val = 0;
+    while (position < end && *position >= '0' && *position <= '9')
+    {
+        val = val * 10 + (*position - '0');
+        position++;
+    }
+    if (negative)
+        val = -val;
+    return true;
+}
+
+bool CreateGroup(const CgroupInfo &info)
+{
+    auto groupDirectory = GetPath(info.Controller) / info.Group;
+    if (!fs::exists(groupDirectory))
+    {
+        fs::create_directories(groupDirectory);
+        return true;
+    }
+    else if (!fs::is_directory(groupDirectory))
+    {
+        throw std::runtime_error((format("Path {} has already been used and is not a directory.", groupDirectory)));
+    }
+    return false;
+}
+
+static string ReadFirstLine(const fs::path &path)
 {
     ifstream ifs;
-    // No fail bit; just ignore when failed.
     ifs.exceptions(std::ios::badbit);
     ifs.open(path);
-    cc.clear();
-    int64_t val;
-    while (ifs >> val)
+    string line;
+    std::getline(ifs, line);
+    return line;
+}
+
+bool CreateCpusetGroup(const CgroupInfo &info)
+{
+    if (IsCgroupV2())
+    {
+        throw std::logic_error("Only cgroup v1 needs the cpuset groups to be filled.");
+    }
+
+    // Walk down from the root, since the parent must have been filled first.
+    fs::path directory = GetPath(info.Controller), group;
+    bool created = false;
+    for (auto &component : fs::path(info.Group).relative_path())
+    {
+        fs::path parent = directory;
+        directory /= component;
+        group /= component;
+        if (fs::exists(directory))
+        {
+            continue;
+        }
+        fs::create_directory(directory);
+        created = true;
+        for (const char *property : {"cpuset.cpus", "cpuset.mems"})
+        {
+            WriteGroupProperty(CgroupInfo(info.Controller, group), property, ReadFirstLine(parent / property));
+        }
+    }
+    if (!created && !fs::is_directory(directory))
     {
-        cc.push_back(val);
+        throw std::runtime_error((format("Path {} has already been used and is not a directory.", directory)));
     }
+    return created;
 }
 
-static int64_t ReadInt64(const fs::path &path)
+bool GroupExists(const CgroupInfo &info)
 {
-    ifstream ifs;
-    ifs.exceptions(std::ios::failbit | std::ios::badbit);
-    ifs.open(path);
+    if (!IsCgroupV2() && cgroup_mnt.find(info.Controller) == cgroup_mnt.end())
+    {
+        return false;
+    }
+    return fs::is_directory(GetPath(info.Controller) / info.Group);
+}
+
+vector<int> GetLocalMemoryNodes(const vector<int> &cpus)
+{
+    vector<int> nodes;
+    std::error_code error;
+    for (auto &entry : fs::directory_iterator("/sys/devices/system/node", error))
+    {
+        string name = entry.path().filename();
+        if (name.rfind("node", 0) != 0 || name.size() == 4 || !std::all_of(name.begin() + 4, name.end(), ::isdigit))
+        {
+            continue;
+        }
+        vector<int> nodeCpus = ParseCpuList(ReadFirstLine(entry.path() / "cpulist"));
+        if (std::any_of(cpus.begin(), cpus.end(), [&](int cpu) { return std::find(nodeCpus.begin(), nodeCpus.end(), cpu) != nodeCpus.end(); }))
+        {
+            nodes.push_back(std::stoi(name.substr(4)));
+        }
+    }
+    std::sort(nodes.begin(), nodes.end());
+    return nodes;
+}
+
+CgroupHandle::CgroupHandle(const CgroupInfo &info)
+    : m_path(GetPath(info.Controller) / info.Group)
+{
+    m_directory = open(m_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (m_directory == -1)
+    {
+        throw std::runtime_error((format("Path {} is not valid (does not exist or is not a directory).", m_path)));
+    }
+}
+
+CgroupHandle::~CgroupHandle()
+{
+    for (auto &item : m_readFiles)
+        (void)close(item.second);
+    for (auto &item : m_writeFiles)
+        (void)close(item.second);
+    (void)close(m_directory);
+}
+
+int CgroupHandle::GetFile(const string &property, bool write)
+{
+    auto &files = write ? m_writeFiles : m_readFiles;
+    auto iter = files.find(property);
+    if (iter != files.end())
+    {
+        return iter->second;
+    }
+
+    int fd = EnsureNot(openat(m_directory, property.c_str(), (write ? O_WRONLY : O_RDONLY) | O_CLOEXEC), -1,
+                       format("Opening {}", m_path / property));
+    files.emplace(property, fd);
+    return fd;
+}
+
+// Read a whole property file from the beginning into `buffer`.
+// A single `pread` is enough unless the file is larger than the buffer (some `memory.stat`).
+static std::string_view ReadContent(int fd, vector<char> &buffer, const fs::path &directory, const string &property)
+{
+    size_t length = 0;
+    while (true)
+    {
+        if (length == buffer.size())
+        {
+            buffer.resize(std::max<size_t>(buffer.size() * 2, 4096));
+        }
+        ssize_t count = EnsureNot(pread(fd, buffer.data() + length, buffer.size() - length, length), (ssize_t)-1,
+                                  format("Reading {}", directory / property));
+        if (count == 0)
+            break;
+        length += count;
+        if (length < buffer.size())
+            break;
+    }
+    return std::string_view(buffer.data(), length);
+}
+
+static int64_t ParseValue(std::string_view content, const fs::path &directory, const string &property)
+{
+    const char *position = content.data();
     int64_t val;
-    ifs >> val;
+    if (!ParseInt64(position, content.data() + content.size(), val))
+    {
+        throw std::runtime_error(format("{} is not an integer.", directory / property));
+    }
     return val;
 }
 
-void CreateGroup(const CgroupInfo &info)
+static int64_t ParseKey(std::string_view content, const string &key, const fs::path &directory, const string &property)
 {
-    auto groupDirectory = GetPath(info.Controller) / info.Group;
-    if (!fs::exists(groupDirectory))
+    const char *position = content.data(), *end = content.data() + content.size();
+    while (position < end)
     {
-        fs::create_directories(groupDirectory);
+        const char *lineEnd = static_cast<const char *>(memchr(position, '\n', end - position));
+        if (lineEnd == nullptr)
+            lineEnd = end;
+        if ((size_t)(lineEnd - position) > key.size() && position[key.size()] == ' ' &&
+            memcmp(position, key.data(), key.size()) == 0)
+        {
+            position += key.size();
+            int64_t val;
+            if (ParseInt64(position, lineEnd, val))
+                return val;
+            break;
+        }
+        position = lineEnd + 1;
     }
-    else if (!fs::is_directory(groupDirectory))
+    throw std::runtime_error(format("No {} in {}.", key, directory / property));
+}
+
+static void ParseKeys(std::string_view content, const vector<string> &keys, int64_t *values,
+                      const fs::path &directory, const string &property)
+{
+    const char *position = content.data(), *end = content.data() + content.size();
+    size_t found = 0;
+    vector<bool> seen(keys.size(), false);
+    while (position < end && found < keys.size())
     {
-        throw std::runtime_error((format("Path {} has already been used and is not a directory.", groupDirectory)));
+        const char *lineEnd = static_cast<const char *>(memchr(position, '\n', end - position));
+        if (lineEnd == nullptr)
+            lineEnd = end;
+        for (size_t i = 0; i < keys.size(); i++)
+        {
+            const string &key = keys[i];
+            if (!seen[i] && (size_t)(lineEnd - position) > key.size() && position[key.size()] == ' ' &&
+                memcmp(position, key.data(), key.size()) == 0)
+            {
+                const char *valuePosition = position + key.size();
+                if (ParseInt64(valuePosition, lineEnd, values[i]))
+                {
+                    seen[i] = true;
+                    found++;
+                }
+                break;
+            }
+        }
+        position = lineEnd + 1;
+    }
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        if (!seen[i])
+            throw std::runtime_error(format("No {} in {}.", keys[i], directory / property));
+    }
+}
+
+static list<int64_t> ParseArray(std::string_view content)
+{
+    const char *position = content.data(), *end = content.data() + content.size();
+    list<int64_t> result;
+    int64_t val;
+    while (ParseInt64(position, end, val))
+    {
+        result.push_back(val);
+    }
+    return result;
+}
+
+static map<string, int64_t> ParseMap(std::string_view content)
+{
+    const char *position = content.data(), *end = content.data() + content.size();
+    map<string, int64_t> result;
+    while (position < end)
+    {
+        const char *lineEnd = static_cast<const char *>(memchr(position, '\n', end - position));
+        if (lineEnd == nullptr)
+            lineEnd = end;
+        const char *space = static_cast<const char *>(memchr(position, ' ', lineEnd - position));
+        int64_t val;
+        if (space != nullptr)
+        {
+            string name(position, space);
+            if (ParseInt64(space, lineEnd, val))
+                result.emplace(std::move(name), val);
+        }
+        position = lineEnd + 1;
+    }
+    return result;
+}
+
+int64_t CgroupHandle::Read(const string &property)
+{
+    return ParseValue(ReadContent(GetFile(property, false), m_buffer, m_path, property), m_path, property);
+}
+
+int64_t CgroupHandle::ReadKey(const string &property, const string &key)
+{
+    return ParseKey(ReadContent(GetFile(property, false), m_buffer, m_path, property), key, m_path, property);
+}
+
+void CgroupHandle::ReadKeys(const string &property, const vector<string> &keys, int64_t *values)
+{
+    ParseKeys(ReadContent(GetFile(property, false), m_buffer, m_path, property), keys, values, m_path, property);
+}
+
+list<int64_t> CgroupHandle::ReadArray(const string &property)
+{
+    return ParseArray(ReadContent(GetFile(property, false), m_buffer, m_path, property));
+}
+
+map<string, int64_t> CgroupHandle::ReadMap(const string &property)
+{
+    return ParseMap(ReadContent(GetFile(property, false), m_buffer, m_path, property));
+}
+
+void CgroupHandle::Write(const string &property, int64_t val)
+{
+    char buffer[24];
+    int length = snprintf(buffer, sizeof(buffer), "%" PRId64, val);
+    WriteValue(GetFile(property, true), buffer, length, m_path, property);
+}
+
+void CgroupHandle::Write(const string &property, const string &val)
+{
+    WriteValue(GetFile(property, true), val.data(), val.size(), m_path, property);
+}
+
+int CgroupHandle::GetDirectory() const
+{
+    return m_directory;
+}
+
+bool CgroupHandle::Has(const string &property) const
+{
+    return faccessat(m_directory, property.c_str(), F_OK, 0) == 0;
+}
+
+// Enable the controllers not yet enabled in `cgroup.subtree_control` of the directory.
+static void EnableSubtreeControllers(const fs::path &directory, const vector<string> &controllers)
+{
+    ifstream ifs;
+    ifs.exceptions(std::ios::badbit);
+    ifs.open(directory / "cgroup.subtree_control");
+    vector<string> enabled;
+    string item;
+    while (ifs >> item)
+    {
+        enabled.push_back(item);
+    }
+
+    string toEnable;
+    for (auto &controller : controllers)
+    {
+        if (std::find(enabled.begin(), enabled.end(), controller) == enabled.end())
+        {
+            toEnable += "+" + controller + " ";
+        }
+    }
+    if (!toEnable.empty())
+    {
+        auto path = directory / "cgroup.subtree_control";
+        int fd = EnsureNot(open(path.c_str(), O_WRONLY | O_CLOEXEC), -1, format("Opening {}", path));
+        try
+        {
+            WriteValue(fd, toEnable.data(), toEnable.size(), directory, "cgroup.subtree_control");
+        }
+        catch (...)
+        {
+            (void)close(fd);
+            throw;
+        }
+        (void)close(fd);
+    }
+}
+
+void EnableControllers(const CgroupInfo &info, const vector<string> &controllers)
+{
+    if (!IsCgroupV2())
+    {
+        throw std::logic_error("Controllers need to be enabled only with cgroup v2.");
+    }
+
+    // Walk down from the root, since a controller must be enabled in the parent before in the child.
+    fs::path directory = cgroup2_mnt;
+    EnableSubtreeControllers(directory, controllers);
+    for (auto &component : fs::path(info.Group).parent_path().relative_path())
+    {
+        directory /= component;
+        if (!fs::exists(directory))
+        {
+            fs::create_directory(directory);
+        }
+        EnableSubtreeControllers(directory, controllers);
+    }
+}
+
+// Open a property file directly, which is cheaper than a CgroupHandle for a single access.
+static int OpenProperty(const CgroupInfo &info, const string &property, int flags, fs::path &directory)
+{
+    directory = GetPath(info.Controller) / info.Group;
+    int fd = open((directory / property).c_str(), flags | O_CLOEXEC);
+    if (fd == -1)
+    {
+        int errcode = errno;
+        EnsureGroup(info);
+        throw std::system_error(errcode, std::system_category(), format("Opening {}", directory / property));
+    }
+    return fd;
+}
+
+template <typename T>
+static T ReadProperty(const CgroupInfo &info, const string &property,
+                      T (*parse)(std::string_view, const fs::path &, const string &))
+{
+    fs::path directory;
+    int fd = OpenProperty(info, property, O_RDONLY, directory);
+    try
+    {
+        vector<char> buffer;
+        T result = parse(ReadContent(fd, buffer, directory, property), directory, property);
+        (void)close(fd);
+        return result;
+    }
+    catch (...)
+    {
+        (void)close(fd);
+        throw;
     }
 }
 
 int64_t ReadGroupProperty(const CgroupInfo &info, const string &property)
 {
-    auto groupDir = EnsureGroup(info);
-    return ReadInt64(groupDir / property);
+    return ReadProperty<int64_t>(info, property, ParseValue);
 }
 
 list<int64_t> ReadGroupPropertyArray(const CgroupInfo &info, const string &property)
 {
-    auto groupDir = EnsureGroup(info);
-    list<int64_t> val;
-    ReadArray64(groupDir / property, val);
-    return val;
+    return ReadProperty<list<int64_t>>(info, property, [](std::string_view content, const fs::path &, const string &) { return ParseArray(content); });
 }
 
 map<string, int64_t> ReadGroupPropertyMap(const CgroupInfo &info, const string &property)
 {
-    auto groupDir = EnsureGroup(info);
-    map<string, int64_t> result;
-    ifstream ifs;
-    ifs.exceptions(std::ios::badbit);
-    ifs.open(groupDir / property);
-    while (ifs)
+    return ReadProperty<map<string, int64_t>>(info, property, [](std::string_view content, const fs::path &, const string &) { return ParseMap(content); });
+}
+
+void KillGroupMembers(CgroupHandle &group)
+{
+    if (IsCgroupV2())
     {
-        string name;
-        ifs >> name;
-        int64_t val;
-        ifs >> val;
-        result.insert(std::pair<string, int64_t>(name, val));
+        group.Write("cgroup.kill", 1);
+        return;
+    }
+
+    auto v = group.ReadArray("tasks");
+    for (auto &item : v)
+    {
+        ENSURE(kill((int)(item), SIGKILL));
     }
-    return result;
 }
 
 void KillGroupMembers(const CgroupInfo &info)
 {
+    if (IsCgroupV2())
+    {
+        WriteGroupProperty(info, "cgroup.kill", 1);
+        return;
+    }
+
     auto v = ReadGroupPropertyArray(info, "tasks");
     for (auto &item : v)
     {
@@ -208,14 +626,30 @@ void RemoveCgroup(const CgroupInfo &info)
     rmdir(groupDir.c_str());
 }
 
-void WriteGroupProperty(const CgroupInfo &info, const string &property, int64_t val, bool overwrite)
+static void WriteProperty(const CgroupInfo &info, const string &property, const char *value, size_t length)
 {
-    auto groupDir = EnsureGroup(info);
-    return WriteFile(groupDir / property, val, overwrite);
+    fs::path directory;
+    int fd = OpenProperty(info, property, O_WRONLY, directory);
+    try
+    {
+        WriteValue(fd, value, length, directory, property);
+    }
+    catch (...)
+    {
+        (void)close(fd);
+        throw;
+    }
+    (void)close(fd);
 }
 
-void WriteGroupProperty(const CgroupInfo &info, const string &property, const string &val, bool overwrite)
+void WriteGroupProperty(const CgroupInfo &info, const string &property, int64_t val)
 {
-    auto groupDir = EnsureGroup(info);
-    return WriteFile(groupDir / property, val, overwrite);
+    char buffer[24];
+    int length = snprintf(buffer, sizeof(buffer), "%" PRId64, val);
+    WriteProperty(info, property, buffer, length);
+}
+
+void WriteGroupProperty(const CgroupInfo &info, const string &property, const string &val)
+{
+    WriteProperty(info, property, val.data(), val.size());
 }
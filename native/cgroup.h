@@ -6,6 +6,8 @@
 #include <string>
 #include <list>
 #include <map>
+#include <vector>
+#include <filesystem>
 
 struct CgroupInfo
 {
@@ -16,16 +18,77 @@ struct CgroupInfo
 
 // Look for controllers and their mount paths.
 std::map<std::string, std::vector<std::filesystem::path>> InitializeCgroup();
+// Look for the mount path of the unified hierarchy.
+std::filesystem::path InitializeCgroup2();
 
-void CreateGroup(const CgroupInfo &info);
+// cgroup v2 (the unified hierarchy) is used if the v1 memory controller is not mounted.
+// All controllers share the same group in cgroup v2, so `Controller` in CgroupInfo is ignored.
+bool IsCgroupV2();
+
+// Returns whether the group is newly created.
+bool CreateGroup(const CgroupInfo &info);
+// cgroup v1 only. The same as CreateGroup, in the cpuset hierarchy, where a new group has no CPUs and memory nodes,
+// and can't have tasks then; so `cpuset.cpus` and `cpuset.mems` of each directory created are copied from its parent.
+bool CreateCpusetGroup(const CgroupInfo &info);
+// Whether the group exists; false if the controller is not mounted (cgroup v1).
+bool GroupExists(const CgroupInfo &info);
+
+// The NUMA nodes of `cpus`, for placing the memory of a sandbox confined to them; empty if unknown.
+std::vector<int> GetLocalMemoryNodes(const std::vector<int> &cpus);
+
+// A group opened once, which keeps the property files it has accessed open,
+// so that reading a property again is a single `pread`, without resolving any path.
+// A handle is not thread-safe; use one per thread.
+class CgroupHandle
+{
+  public:
+    // Throws if the group does not exist.
+    CgroupHandle(const CgroupInfo &info);
+    ~CgroupHandle();
+    CgroupHandle(const CgroupHandle &) = delete;
+    CgroupHandle &operator=(const CgroupHandle &) = delete;
+
+    // "max" is read as -1.
+    int64_t Read(const std::string &property);
+    // Read one key of a flat keyed file (`key value` per line), e.g. `usage_usec` in `cpu.stat`.
+    int64_t ReadKey(const std::string &property, const std::string &key);
+    // Read several keys of a flat keyed file in a single pass, into `values` in the order of `keys`.
+    void ReadKeys(const std::string &property, const std::vector<std::string> &keys, int64_t *values);
+    std::list<int64_t> ReadArray(const std::string &property);
+    std::map<std::string, int64_t> ReadMap(const std::string &property);
+
+    void Write(const std::string &property, int64_t val);
+    void Write(const std::string &property, const std::string &val);
+
+    // The close-on-exec file descriptor of the group directory, e.g. for CLONE_INTO_CGROUP.
+    int GetDirectory() const;
+
+    // Whether the property file exists, e.g. those depending on the kernel version or configuration.
+    bool Has(const std::string &property) const;
+
+  private:
+    int GetFile(const std::string &property, bool write);
+
+    std::filesystem::path m_path;
+    int m_directory;
+    std::map<std::string, int> m_readFiles, m_writeFiles;
+    std::vector<char> m_buffer;
+};
+
+// cgroup v2 only. Make the controllers available in the group,
+// i.e. enable them in `cgroup.subtree_control` of all its ancestors.
+void EnableControllers(const CgroupInfo &info, const std::vector<std::string> &controllers);
 
 int64_t ReadGroupProperty(const CgroupInfo &info, const std::string &property);
 std::list<int64_t> ReadGroupPropertyArray(const CgroupInfo &info, const std::string &property);
 std::map<std::string, int64_t> ReadGroupPropertyMap(const CgroupInfo &info, const std::string &property);
 
-void WriteGroupProperty(const CgroupInfo &info, const std::string &property, int64_t val, bool overwrite = true);
-void WriteGroupProperty(const CgroupInfo &info, const std::string &property, const std::string& val, bool overwrite = true);
+// These open the property file every time. Use a CgroupHandle to access a group repeatedly.
+void WriteGroupProperty(const CgroupInfo &info, const std::string &property, int64_t val);
+void WriteGroupProperty(const CgroupInfo &info, const std::string &property, const std::string &val);
 void RemoveCgroup(const CgroupInfo &info);
 
 // Kill all existing tasks in a group.
+// With cgroup v2, this is done by `cgroup.kill`, which is free of the race with PID reusing.
 void KillGroupMembers(const CgroupInfo &info);
+void KillGroupMembers(CgroupHandle &group);
@@ -0,0 +1,331 @@
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fmt/format.h>
+#include <fmt/std.h>
+
+#include "compare.h"
+#include "utils.h"
+
+namespace fs = std::filesystem;
+using fmt::format;
+
+// Whitespace within a line.
+static inline bool IsBlank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static inline bool IsSpace(char c)
+{
+    return c == '\n' || IsBlank(c);
+}
+
+// The length of the common prefix of `a` and `b`, both of `length` bytes.
+// Mostly compared by `memcmp` (vectorized by libc) a block at a time, which is all it takes if they are the same.
+static size_t CommonPrefix(const char *a, const char *b, size_t length)
+{
+    const size_t block = 64;
+    size_t position = 0;
+    while (length - position >= block && memcmp(a + position, b + position, block) == 0)
+        position += block;
+    while (position < length && a[position] == b[position])
+        position++;
+    return position;
+}
+
+OutputComparator::OutputComparator(const fs::path &expected, CompareMode mode, double epsilon)
+    : m_mode(mode), m_epsilon(epsilon)
+{
+    if (mode == COMPARE_NONE)
+    {
+        throw std::invalid_argument("No comparison mode is given.");
+    }
+    int fd = EnsureNot(open(expected.c_str(), O_RDONLY | O_CLOEXEC), -1, format("Opening {}", expected));
+    try
+    {
+        struct stat status;
+        ENSURE(fstat(fd, &status));
+        m_expectedSize = status.st_size;
+        if (m_expectedSize > 0)
+        {
+            void *mapped = mmap(nullptr, m_expectedSize, PROT_READ, MAP_PRIVATE, fd, 0);
+            EnsureNot(mapped, MAP_FAILED, format("Mapping {}", expected));
+            m_expected = static_cast<const char *>(mapped);
+            (void)madvise(mapped, m_expectedSize, MADV_SEQUENTIAL);
+        }
+    }
+    catch (...)
+    {
+        (void)close(fd);
+        throw;
+    }
+    // The mapping stays without the file descriptor.
+    (void)close(fd);
+}
+
+OutputComparator::~OutputComparator()
+{
+    if (m_expected != nullptr)
+    {
+        (void)munmap(const_cast<char *>(m_expected), m_expectedSize);
+    }
+}
+
+bool OutputComparator::Feed(const char *data, size_t length)
+{
+    if (m_mismatch == -1)
+    {
+        switch (m_mode)
+        {
+        case COMPARE_EXACT:
+            FeedExact(data, length);
+            break;
+        case COMPARE_LINES:
+            FeedLines(data, length);
+            break;
+        default:
+            FeedTokens(data, length);
+            break;
+        }
+    }
+    m_offset += length;
+    return m_mismatch == -1;
+}
+
+void OutputComparator::FeedExact(const char *data, size_t length)
+{
+    size_t comparable = std::min(length, m_expectedSize - m_position);
+    size_t common = CommonPrefix(data, m_expected + m_position, comparable);
+    m_position += common;
+    if (common < length)
+    {
+        // A different byte, or more than expected.
+        m_mismatch = m_offset + common;
+    }
+}
+
+size_t OutputComparator::SkipBlanks(size_t position) const
+{
+    while (position < m_expectedSize && IsBlank(m_expected[position]))
+        position++;
+    return position;
+}
+
+void OutputComparator::FeedLines(const char *data, size_t length)
+{
+    size_t i = 0;
+    while (i < length && m_mismatch == -1)
+    {
+        // The same bytes compare the same after the whitespace at the end of the lines is removed from both,
+        // as long as nothing is held back.
+        if (m_blankLength == 0 && !m_expectedEnded)
+        {
+            size_t common = CommonPrefix(data + i, m_expected + m_position,
+                                         std::min(length - i, m_expectedSize - m_position));
+            i += common;
+            m_position += common;
+            if (i == length)
+                break;
+        }
+
+        char c = data[i];
+        int64_t offset = m_offset + i;
+        i++;
+        if (m_expectedEnded)
+        {
+            // Only the empty lines at the end may be left.
+            if (!IsSpace(c))
+                m_mismatch = offset;
+        }
+        else if (IsBlank(c))
+        {
+            // Held back until we know whether it's at the end of the line; compared in the meantime.
+            if (m_blankLength == 0)
+            {
+                m_blankStart = offset;
+                m_blankMatches = true;
+            }
+            size_t expected = m_position + m_blankLength;
+            m_blankMatches = m_blankMatches && expected < m_expectedSize && m_expected[expected] == c;
+            m_blankLength++;
+        }
+        else if (c == '\n')
+        {
+            // The end of the line is expected as well, after any whitespace.
+            size_t position = SkipBlanks(m_position);
+            if (position == m_expectedSize)
+            {
+                m_position = position;
+                m_expectedEnded = true;
+            }
+            else if (m_expected[position] == '\n')
+            {
+                m_position = position + 1;
+            }
+            else
+            {
+                m_mismatch = m_blankLength > 0 ? m_blankStart : offset;
+            }
+            m_blankLength = 0;
+        }
+        else
+        {
+            // The whitespace held back is within the line, so it must be the same.
+            if (m_blankLength > 0)
+            {
+                if (!m_blankMatches)
+                {
+                    m_mismatch = m_blankStart;
+                    break;
+                }
+                m_position += m_blankLength;
+                m_blankLength = 0;
+            }
+            if (m_position < m_expectedSize && m_expected[m_position] == c)
+                m_position++;
+            else
+                m_mismatch = offset;
+        }
+    }
+}
+
+void OutputComparator::FeedTokens(const char *data, size_t length)
+{
+    for (size_t i = 0; i < length && m_mismatch == -1; i++)
+    {
+        char c = data[i];
+        int64_t offset = m_offset + i;
+        if (IsSpace(c))
+        {
+            if (m_inToken)
+            {
+                EndToken();
+                if (m_mismatch != -1)
+                    break;
+            }
+            if (c == '\n' && !m_expectedEnded)
+            {
+                // No more tokens on the expected line either.
+                size_t position = SkipBlanks(m_position);
+                if (position == m_expectedSize)
+                {
+                    m_position = position;
+                    m_expectedEnded = true;
+                }
+                else if (m_expected[position] == '\n')
+                {
+                    m_position = position + 1;
+                }
+                else
+                {
+                    m_mismatch = offset;
+                }
+            }
+            continue;
+        }
+
+        if (!m_inToken)
+        {
+            size_t position = m_expectedEnded ? m_expectedSize : SkipBlanks(m_position);
+            if (position == m_expectedSize || m_expected[position] == '\n')
+            {
+                // One more token than expected on the line.
+                m_mismatch = offset;
+                break;
+            }
+            m_inToken = true;
+            m_tokenMatches = true;
+            m_outputTokenStart = offset;
+            m_tokenLength = 0;
+            m_tokenStart = m_tokenEnd = position;
+            while (m_tokenEnd < m_expectedSize && !IsSpace(m_expected[m_tokenEnd]))
+                m_tokenEnd++;
+        }
+        m_tokenMatches = m_tokenMatches && m_tokenStart + m_tokenLength < m_tokenEnd &&
+                         m_expected[m_tokenStart + m_tokenLength] == c;
+        if (m_tokenLength < maxNumberLength)
+            m_token[m_tokenLength] = c;
+        m_tokenLength++;
+    }
+}
+
+void OutputComparator::EndToken()
+{
+    m_inToken = false;
+    bool equal = m_tokenMatches && m_tokenLength == m_tokenEnd - m_tokenStart;
+    if (!equal && m_mode == COMPARE_FLOATING_POINT)
+    {
+        equal = NumbersEqual(m_tokenStart, m_tokenEnd);
+    }
+    if (!equal)
+    {
+        m_mismatch = m_outputTokenStart;
+    }
+    m_position = m_tokenEnd;
+}
+
+static bool ParseNumber(const char *token, double &value)
+{
+    char *end;
+    value = strtod(token, &end);
+    return *token != '\0' && *end == '\0' && !std::isnan(value);
+}
+
+bool OutputComparator::NumbersEqual(size_t expectedStart, size_t expectedEnd) const
+{
+    if (m_tokenLength > maxNumberLength || expectedEnd - expectedStart > maxNumberLength)
+        return false;
+
+    char output[maxNumberLength + 1], expected[maxNumberLength + 1];
+    memcpy(output, m_token, m_tokenLength);
+    output[m_tokenLength] = '\0';
+    memcpy(expected, m_expected + expectedStart, expectedEnd - expectedStart);
+    expected[expectedEnd - expectedStart] = '\0';
+
+    double outputValue, expectedValue;
+    if (!ParseNumber(output, outputValue) || !ParseNumber(expected, expectedValue))
+        return false;
+    if (outputValue == expectedValue)
+        return true;
+    double error = std::fabs(outputValue - expectedValue);
+    return error <= m_epsilon || error <= m_epsilon * std::fabs(expectedValue);
+}
+
+int64_t OutputComparator::Finish()
+{
+    if (m_mismatch != -1)
+        return m_mismatch;
+
+    if (m_mode == COMPARE_EXACT)
+    {
+        if (m_position < m_expectedSize)
+            m_mismatch = m_offset;
+        return m_mismatch;
+    }
+
+    if (m_inToken)
+    {
+        EndToken();
+        if (m_mismatch != -1)
+            return m_mismatch;
+    }
+    // Any whitespace held back is at the end of the last line; only whitespace may be left of the expected output.
+    for (size_t position = m_position; position < m_expectedSize; position++)
+    {
+        if (!IsSpace(m_expected[position]))
+        {
+            m_mismatch = m_offset;
+            break;
+        }
+    }
+    return m_mismatch;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <filesystem>
+
+#include "sandbox.h"
+
+// Compares the output of a sandbox with the expected output as it's written, part by part (see OutputRelay),
+// so that it never has to be read back as a whole. The expected output is mapped into memory.
+// The modes (see CompareMode) are:
+// - COMPARE_EXACT: byte by byte.
+// - COMPARE_LINES: line by line, ignoring the whitespace (spaces, tabs and CRs) at the end of each line,
+//   and the empty lines at the end.
+// - COMPARE_TOKENS: line by line, each as a sequence of tokens separated by any whitespace; empty lines at the end are ignored.
+// - COMPARE_FLOATING_POINT: as COMPARE_TOKENS, and two numbers are also equal if their absolute or relative error
+//   (relative to the expected one) is at most `epsilon`.
+class OutputComparator
+{
+  public:
+    OutputComparator(const std::filesystem::path &expected, CompareMode mode, double epsilon);
+    ~OutputComparator();
+    OutputComparator(const OutputComparator &) = delete;
+    OutputComparator &operator=(const OutputComparator &) = delete;
+
+    // Compare the next part of the output. Returns false once the output is known to differ,
+    // after which the rest of it is ignored.
+    bool Feed(const char *data, size_t length);
+    // At the end of the output. Returns the offset where the output first differs, or -1 if it matches.
+    int64_t Finish();
+
+  private:
+    void FeedExact(const char *data, size_t length);
+    void FeedLines(const char *data, size_t length);
+    void FeedTokens(const char *data, size_t length);
+    void EndToken();
+    bool NumbersEqual(size_t expectedStart, size_t expectedEnd) const;
+    size_t SkipBlanks(size_t position) const;
+
+    CompareMode m_mode;
+    double m_epsilon;
+    const char *m_expected = nullptr;
+    size_t m_expectedSize = 0;
+    // Where the rest of the output is compared from, in the expected output.
+    size_t m_position = 0;
+    // The length of the output compared so far.
+    int64_t m_offset = 0;
+    int64_t m_mismatch = -1;
+    // COMPARE_LINES and the token modes: the expected output is exhausted, and only whitespace may follow.
+    bool m_expectedEnded = false;
+
+    // COMPARE_LINES: the whitespace in the output not yet known to be at the end of its line,
+    // and whether it's the same as that at `m_position` so far.
+    int64_t m_blankStart = 0;
+    size_t m_blankLength = 0;
+    bool m_blankMatches = false;
+
+    // The token modes: the output token being compared, against the expected one in [m_tokenStart, m_tokenEnd).
+    bool m_inToken = false;
+    bool m_tokenMatches = false;
+    int64_t m_outputTokenStart = 0;
+    size_t m_tokenLength = 0;
+    size_t m_tokenStart = 0, m_tokenEnd = 0;
+    // The beginning of the output token, which is enough for any number.
+    static const size_t maxNumberLength = 128;
+    char m_token[maxNumberLength + 1];
+};
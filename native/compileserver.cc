@@ -0,0 +1,286 @@
+#include <string>
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <fmt/format.h>
+
+#include "compileserver.h"
+#include "timelimit.h"
+#include "pipe.h"
+#include "utils.h"
+
+using std::string;
+using fmt::format;
+
+// Shared by all servers so that the cgroup names never collide.
+static std::atomic<unsigned long> serialNumber(0);
+
+static void RemoveCgroups(const string &cgroupName)
+{
+    try
+    {
+        RemoveSandboxCgroups(cgroupName);
+    }
+    catch (...)
+    {
+        // The cgroups may not have been created.
+    }
+}
+
+// In nanoseconds, as TimeLimitWatcher reads it.
+static int64_t ReadCpuUsage(CgroupHandle &group)
+{
+    if (IsCgroupV2())
+    {
+        return group.ReadKey("cpu.stat", "usage_usec") * 1000;
+    }
+    return group.Read("cpuacct.usage");
+}
+
+static bool WriteAll(int fd, const string &data)
+{
+    size_t written = 0;
+    while (written < data.size())
+    {
+        ssize_t count = write(fd, data.data() + written, data.size() - written);
+        if (count == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        written += count;
+    }
+    return true;
+}
+
+CompileServer::CompileServer(const SandboxParameter &parameter)
+    : m_parameter(parameter)
+{
+    if (parameter.outputLimit >= 0 || parameter.compareMode != COMPARE_NONE)
+    {
+        throw std::invalid_argument("The output of a compile server can't be limited or compared.");
+    }
+    // Limited per job instead.
+    m_parameter.timeLimit = -1;
+    m_thread = std::thread(&CompileServer::Run, this);
+}
+
+CompileServer::~CompileServer()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+        // Cut the job in progress short.
+        if (m_pid != -1)
+            (void)kill(m_pid, SIGKILL);
+    }
+    m_jobAdded.notify_all();
+    m_thread.join();
+}
+
+void CompileServer::Submit(const string &line, int64_t timeLimit, CompileCallback callback)
+{
+    if (line.find('\n') != string::npos)
+    {
+        throw std::invalid_argument("A compile job must be a single line.");
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_jobs.push_back(Job{line, timeLimit, std::move(callback)});
+    }
+    m_jobAdded.notify_one();
+}
+
+void CompileServer::Run()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        m_jobAdded.wait(lock, [this] { return m_stopping || !m_jobs.empty(); });
+        if (m_stopping)
+            break;
+        Job job = std::move(m_jobs.front());
+        m_jobs.pop_front();
+        lock.unlock();
+
+        CompileResult result = {};
+        string error;
+        try
+        {
+            result = Execute(job);
+        }
+        catch (std::exception &ex)
+        {
+            error = ex.what();
+        }
+        catch (...)
+        {
+            error = "Something unexpected happened while compiling.";
+        }
+        if (!error.empty() && m_pid != -1)
+        {
+            // Don't leave the helper in an unknown state.
+            try
+            {
+                (void)StopHelper();
+            }
+            catch (...)
+            {
+            }
+        }
+        job.callback(result, error);
+        lock.lock();
+    }
+
+    std::deque<Job> left;
+    left.swap(m_jobs);
+    lock.unlock();
+    for (auto &job : left)
+    {
+        job.callback(CompileResult(), "The compile server has been destroyed.");
+    }
+    if (m_pid != -1)
+    {
+        try
+        {
+            (void)StopHelper();
+        }
+        catch (...)
+        {
+        }
+    }
+}
+
+void CompileServer::StartHelper()
+{
+    SandboxParameter parameter = m_parameter;
+    parameter.cgroupName = format("{}/compile-{}-{}", m_parameter.cgroupName, getpid(), ++serialNumber);
+    // Closed here once the helper is started, so it's the only one holding its ends.
+    PosixPipe input(O_CLOEXEC), output(O_CLOEXEC);
+    parameter.stdinRedirectionFileDescriptor = input[0];
+    parameter.stdoutRedirectionFileDescriptor = output[1];
+
+    pid_t pid;
+    void *execParam;
+    try
+    {
+        execParam = StartSandbox(parameter, pid);
+    }
+    catch (...)
+    {
+        RemoveCgroups(parameter.cgroupName);
+        throw;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pid = pid;
+        // Destroyed meanwhile; the job fails as soon as it's written.
+        if (m_stopping)
+            (void)kill(m_pid, SIGKILL);
+    }
+    m_execParam = execParam;
+    m_cgroupName = parameter.cgroupName;
+    m_input = input.Release(1);
+    m_output = output.Release(0);
+    m_buffer.clear();
+    m_cpu = std::make_unique<CgroupHandle>(CgroupInfo(IsCgroupV2() ? "unified" : "cpuacct", m_cgroupName));
+}
+
+ExecutionResult CompileServer::StopHelper()
+{
+    pid_t pid;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        pid = m_pid;
+        m_pid = -1;
+    }
+    (void)kill(pid, SIGKILL);
+    (void)close(m_input);
+    (void)close(m_output);
+    m_input = m_output = -1;
+    m_cpu.reset();
+
+    void *execParam = m_execParam;
+    m_execParam = nullptr;
+    ExecutionResult result;
+    try
+    {
+        result = WaitForProcess(pid, execParam);
+    }
+    catch (...)
+    {
+        RemoveCgroups(m_cgroupName);
+        throw;
+    }
+    RemoveCgroups(m_cgroupName);
+    return result;
+}
+
+bool CompileServer::HelperExited()
+{
+    siginfo_t info = {};
+    return waitid(P_PID, m_pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid != 0;
+}
+
+bool CompileServer::ReadReply(string &line)
+{
+    size_t end;
+    while ((end = m_buffer.find('\n')) == string::npos)
+    {
+        char buffer[4096];
+        ssize_t count = read(m_output, buffer, sizeof(buffer));
+        if (count == -1 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return false;
+        m_buffer.append(buffer, count);
+    }
+    line = m_buffer.substr(0, end);
+    m_buffer.erase(0, end + 1);
+    return true;
+}
+
+CompileResult CompileServer::Execute(const Job &job)
+{
+    // It may have exited since the last job, e.g. killed by the OOM killer.
+    if (m_pid != -1 && HelperExited())
+    {
+        (void)StopHelper();
+    }
+    if (m_pid == -1)
+    {
+        StartHelper();
+    }
+
+    CompileResult result = {};
+    int64_t usage = ReadCpuUsage(*m_cpu);
+    std::unique_ptr<TimeLimitWatcher> watcher;
+    if (job.timeLimit >= 0)
+    {
+        watcher = std::make_unique<TimeLimitWatcher>(m_pid, -1, m_cgroupName, job.timeLimit);
+    }
+    // The helper exiting closes the pipes, which ends either of them.
+    bool answered = WriteAll(m_input, job.line + "\n") && ReadReply(result.reply);
+    result.time = ReadCpuUsage(*m_cpu) - usage;
+    if (watcher)
+    {
+        result.timeLimitExceeded = watcher->Exceeded();
+        watcher.reset();
+    }
+
+    // Killed for the time limit, even if it has just answered.
+    if (!answered || result.timeLimitExceeded)
+    {
+        result.helperExited = true;
+        result.helperResult = StopHelper();
+    }
+    return result;
+}
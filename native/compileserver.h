@@ -0,0 +1,91 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <thread>
+#include <cstdint>
+#include <functional>
+#include <condition_variable>
+
+#include "sandbox.h"
+#include "cgroup.h"
+
+struct CompileResult
+{
+    // The line the helper has answered the job with, without the newline.
+    std::string reply;
+    // The CPU time of the helper and everything it has run during the job, in nanoseconds.
+    int64_t time;
+    // Whether the helper has been killed for exceeding the time limit of the job.
+    bool timeLimitExceeded;
+    // Whether the helper has exited (or been killed) during the job, in which case the result of the helper
+    // is in `helperResult`, and `reply` is empty unless it has answered right before. It's started again for the next job.
+    bool helperExited;
+    ExecutionResult helperResult;
+};
+
+// `error` is empty if the job has been run; otherwise `result` is not valid.
+typedef std::function<void(const CompileResult &result, const std::string &error)> CompileCallback;
+
+// Keeps a compiler helper running in a sandbox, and feeds it the compile jobs one at a time on a thread of its own,
+// so that compiling doesn't start a fresh sandbox (and compiler driver, if the helper keeps one) for every submission,
+// and can go on while the runs of the last submission are running.
+// Each job is written to the stdin of the helper as a line, and the helper answers it with a line on its stdout once done, e.g.
+//   while read source binary; do g++ -O2 -o "$binary" "$source" >/dev/null 2>&1; echo $?; done
+// The binaries are meant to be written to a mount shared with the sandboxes that run them (e.g. those of a SandboxPool),
+// where they are used in place.
+class CompileServer
+{
+  public:
+    // The helper is started with `parameter`, in a new cgroup under `parameter.cgroupName` every time it's (re)started,
+    // whose limits apply to the helper and all the compilers it runs together.
+    // Its stdin and stdout are the pipes to us; the time limit is per job, and the output can't be limited or compared.
+    explicit CompileServer(const SandboxParameter &parameter);
+    // Kills the helper. The jobs not yet done fail.
+    ~CompileServer();
+    CompileServer(const CompileServer &) = delete;
+    CompileServer &operator=(const CompileServer &) = delete;
+
+    // Queue a job: `line` (without newlines) is written to the helper. `timeLimit` is the CPU time limit of the job
+    // in nanoseconds, enforced as with TimeLimitWatcher, or -1 for none.
+    // `callback` is called on the thread of the server once the job is done.
+    void Submit(const std::string &line, int64_t timeLimit, CompileCallback callback);
+
+  private:
+    struct Job
+    {
+        std::string line;
+        int64_t timeLimit;
+        CompileCallback callback;
+    };
+
+    // The body of the thread.
+    void Run();
+    CompileResult Execute(const Job &job);
+    void StartHelper();
+    // Kill and reap the helper, and remove its cgroups.
+    ExecutionResult StopHelper();
+    bool HelperExited();
+    bool ReadReply(std::string &line);
+
+    SandboxParameter m_parameter;
+
+    std::mutex m_mutex;
+    std::condition_variable m_jobAdded;
+    std::deque<Job> m_jobs;
+    bool m_stopping = false;
+    std::thread m_thread;
+
+    // The running helper, only touched by the thread of the server,
+    // except that `m_pid` is written under `m_mutex`, with which the destructor kills it.
+    pid_t m_pid = -1;
+    void *m_execParam = nullptr;
+    std::string m_cgroupName;
+    // The write end of its stdin and the read end of its stdout.
+    int m_input = -1, m_output = -1;
+    std::unique_ptr<CgroupHandle> m_cpu;
+    // What's been read from its stdout but not answered a job yet.
+    std::string m_buffer;
+};
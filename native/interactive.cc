@@ -0,0 +1,274 @@
+#include <mutex>
+#include <memory>
+#include <string>
+#include <stdexcept>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+
+#include "interactive.h"
+#include "monitor.h"
+#include "pipe.h"
+#include "utils.h"
+
+using std::string;
+
+TrafficCounter::TrafficCounter(int source, int destination)
+    : m_source(source), m_destination(destination)
+{
+    try
+    {
+        ENSURE(fcntl(m_source, F_SETFL, O_NONBLOCK));
+        ENSURE(fcntl(m_destination, F_SETFL, O_NONBLOCK));
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Watch(m_source, EPOLLIN);
+    }
+    catch (...)
+    {
+        (void)close(m_source);
+        (void)close(m_destination);
+        throw;
+    }
+}
+
+TrafficCounter::~TrafficCounter()
+{
+    Stop();
+    if (m_source != -1)
+    {
+        (void)close(m_source);
+        (void)close(m_destination);
+    }
+}
+
+void TrafficCounter::Stop()
+{
+    int watched;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopped = true;
+        watched = m_watched;
+        m_watched = -1;
+    }
+    // Waits for the handler, which does nothing once stopped.
+    if (watched != -1)
+        SandboxMonitor::Instance().Remove(watched);
+}
+
+int64_t TrafficCounter::Bytes() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_bytes;
+}
+
+void TrafficCounter::Watch(int fd, uint32_t events)
+{
+    if (m_watched == fd)
+        return;
+    // Only switched on the monitor thread, where Remove doesn't wait.
+    if (m_watched != -1)
+        SandboxMonitor::Instance().Remove(m_watched);
+    m_watched = -1;
+    SandboxMonitor::Instance().Add(fd, events, [this](uint32_t) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_stopped)
+            Relay();
+    });
+    m_watched = fd;
+}
+
+void TrafficCounter::Relay()
+{
+    while (m_source != -1)
+    {
+        ssize_t count = splice(m_source, nullptr, m_destination, nullptr, 1 << 16, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (count > 0)
+        {
+            m_bytes += count;
+            continue;
+        }
+        if (count == -1 && errno == EINTR)
+            continue;
+        if (count == -1 && errno == EAGAIN)
+        {
+            // Either nothing is left to move, or the destination is full.
+            int pending = 0;
+            bool full = ioctl(m_source, FIONREAD, &pending) == 0 && pending > 0;
+            Watch(full ? m_destination : m_source, full ? EPOLLOUT : EPOLLIN);
+            return;
+        }
+        // The writer has closed its end (with nothing left), or the reader has closed its.
+        Close();
+    }
+}
+
+void TrafficCounter::Close()
+{
+    if (m_watched != -1)
+        SandboxMonitor::Instance().Remove(m_watched);
+    m_watched = -1;
+    (void)close(m_source);
+    (void)close(m_destination);
+    m_source = m_destination = -1;
+}
+
+enum InteractiveSide
+{
+    CONTESTANT = 0,
+    INTERACTOR = 1,
+};
+
+struct InteractiveSession
+{
+    // Indexed by InteractiveSide.
+    pid_t pids[2];
+    void *execParams[2] = {nullptr, nullptr};
+    // What each side has written to the other, if counted.
+    std::unique_ptr<TrafficCounter> counters[2];
+
+    std::mutex mutex;
+    ExecutionResult results[2];
+    int reaped = 0;
+    int first = -1;
+    string error;
+    InteractiveCallback callback;
+};
+
+static void CheckInteractive(const SandboxParameter &parameter)
+{
+    if (parameter.outputLimit >= 0 || parameter.compareMode != COMPARE_NONE)
+    {
+        throw std::invalid_argument("The output of an interactive sandbox can't be limited or compared.");
+    }
+}
+
+// Kill and reap a started sandbox that is not going to be waited for, and remove its cgroups.
+static void Abandon(pid_t pid, void *execParam, const string &cgroupName)
+{
+    (void)kill(pid, SIGKILL);
+    try
+    {
+        (void)WaitForProcess(pid, execParam);
+        RemoveSandboxCgroups(cgroupName);
+    }
+    catch (...)
+    {
+    }
+}
+
+void *StartInteractive(const SandboxParameter &contestant, const SandboxParameter &interactor, bool countTraffic,
+                       pid_t &contestantPid, pid_t &interactorPid)
+{
+    CheckInteractive(contestant);
+    CheckInteractive(interactor);
+
+    auto session = std::make_unique<InteractiveSession>();
+    SandboxParameter parameters[2] = {contestant, interactor};
+    // What each side reads.
+    PosixPipe toContestant(O_CLOEXEC), toInteractor(O_CLOEXEC);
+    parameters[CONTESTANT].stdinRedirectionFileDescriptor = toContestant[0];
+    parameters[INTERACTOR].stdinRedirectionFileDescriptor = toInteractor[0];
+
+    // What each side writes, if it's counted on the way.
+    std::unique_ptr<PosixPipe> fromContestant, fromInteractor;
+    if (countTraffic)
+    {
+        fromContestant = std::make_unique<PosixPipe>(O_CLOEXEC);
+        fromInteractor = std::make_unique<PosixPipe>(O_CLOEXEC);
+        parameters[CONTESTANT].stdoutRedirectionFileDescriptor = (*fromContestant)[1];
+        parameters[INTERACTOR].stdoutRedirectionFileDescriptor = (*fromInteractor)[1];
+        int source = fromContestant->Release(0), destination = toInteractor.Release(1);
+        session->counters[CONTESTANT] = std::make_unique<TrafficCounter>(source, destination);
+        source = fromInteractor->Release(0);
+        destination = toContestant.Release(1);
+        session->counters[INTERACTOR] = std::make_unique<TrafficCounter>(source, destination);
+    }
+    else
+    {
+        parameters[CONTESTANT].stdoutRedirectionFileDescriptor = toInteractor[1];
+        parameters[INTERACTOR].stdoutRedirectionFileDescriptor = toContestant[1];
+    }
+
+    session->execParams[CONTESTANT] = StartSandbox(parameters[CONTESTANT], session->pids[CONTESTANT]);
+    try
+    {
+        session->execParams[INTERACTOR] = StartSandbox(parameters[INTERACTOR], session->pids[INTERACTOR]);
+    }
+    catch (...)
+    {
+        Abandon(session->pids[CONTESTANT], session->execParams[CONTESTANT], contestant.cgroupName);
+        throw;
+    }
+
+    // The ends given to the sandboxes are closed here on return, so each side gets EOF (or EPIPE)
+    // as soon as the other has exited.
+    contestantPid = session->pids[CONTESTANT];
+    interactorPid = session->pids[INTERACTOR];
+    return session.release();
+}
+
+static void OnReaped(InteractiveSession *session, int side, const ExecutionResult &result, const string &error)
+{
+    {
+        std::lock_guard<std::mutex> lock(session->mutex);
+        session->results[side] = result;
+        if (session->error.empty())
+            session->error = error;
+        if (session->first == -1)
+            session->first = side;
+        if (++session->reaped < 2)
+            return;
+    }
+
+    std::unique_ptr<InteractiveSession> owner(session);
+    InteractiveResult interactive = {};
+    interactive.contestant = session->results[CONTESTANT];
+    interactive.interactor = session->results[INTERACTOR];
+    interactive.interactorFirst = session->first == INTERACTOR;
+    interactive.contestantBytes = interactive.interactorBytes = -1;
+    if (session->counters[CONTESTANT])
+    {
+        // Both sides have exited, so nothing more is written.
+        session->counters[CONTESTANT]->Stop();
+        session->counters[INTERACTOR]->Stop();
+        interactive.contestantBytes = session->counters[CONTESTANT]->Bytes();
+        interactive.interactorBytes = session->counters[INTERACTOR]->Bytes();
+    }
+    session->callback(interactive, session->error);
+}
+
+void WaitForInteractiveAsync(void *interactive, InteractiveCallback callback)
+{
+    InteractiveSession *session = reinterpret_cast<InteractiveSession *>(interactive);
+    session->callback = std::move(callback);
+    // The session may be gone as soon as the second one is reaped.
+    pid_t pids[2] = {session->pids[CONTESTANT], session->pids[INTERACTOR]};
+    void *execParams[2] = {session->execParams[CONTESTANT], session->execParams[INTERACTOR]};
+    for (int side : {CONTESTANT, INTERACTOR})
+    {
+        try
+        {
+            WaitForProcessAsync(pids[side], execParams[side], [session, side](const ExecutionResult &result, const string &error) {
+                OnReaped(session, side, result, error);
+            });
+        }
+        catch (std::exception &ex)
+        {
+            // Can't be watched; reap it here, and let the other side finish.
+            (void)kill(pids[side], SIGKILL);
+            string error = ex.what();
+            try
+            {
+                (void)WaitForProcess(pids[side], execParams[side]);
+            }
+            catch (...)
+            {
+            }
+            OnReaped(session, side, ExecutionResult(), error);
+        }
+    }
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <cstdint>
+#include <functional>
+
+#include <sys/types.h>
+
+#include "sandbox.h"
+
+// Moves what one side of an interactive pair writes to the other on the monitor thread (see monitor.h),
+// with `splice`, counting the bytes on the way.
+// Both ends are non-blocking, so a side that doesn't read never blocks the monitor thread:
+// while the destination is full, it's watched instead of the source.
+// Once the writer has closed its end (or the reader has closed its), so is the other end, as with a single pipe.
+class TrafficCounter
+{
+  public:
+    // Takes the ownership of `source`, the read end of the pipe the writer writes to,
+    // and `destination`, the write end of the pipe the reader reads from.
+    TrafficCounter(int source, int destination);
+    ~TrafficCounter();
+    TrafficCounter(const TrafficCounter &) = delete;
+    TrafficCounter &operator=(const TrafficCounter &) = delete;
+
+    // Stop relaying, after which the count doesn't change.
+    void Stop();
+    int64_t Bytes() const;
+
+  private:
+    void Relay();
+    void Watch(int fd, uint32_t events);
+    void Close();
+
+    // Held by the handler, so that Stop doesn't miss the fd it's switching to.
+    mutable std::mutex m_mutex;
+    int m_source, m_destination;
+    // Either of the ends, or -1 if neither is watched.
+    int m_watched = -1;
+    bool m_stopped = false;
+    int64_t m_bytes = 0;
+};
+
+struct InteractiveResult
+{
+    ExecutionResult contestant;
+    ExecutionResult interactor;
+    // Whether the interactor is reaped before the contestant, e.g. it has exited with its verdict first,
+    // in which case the contestant may have failed only because its input is gone.
+    bool interactorFirst;
+    // The bytes each side has written to the other, if counted; -1 otherwise.
+    int64_t contestantBytes;
+    int64_t interactorBytes;
+};
+
+// `error` is empty if both sandboxes have been run; otherwise `result` is not valid.
+typedef std::function<void(const InteractiveResult &result, const std::string &error)> InteractiveCallback;
+
+// Start the contestant and the interactor of an interactive problem, with the stdout of each connected
+// to the stdin of the other by pipes created here (with O_CLOEXEC, so no other sandbox inherits them),
+// which are closed in this process once both are started.
+// Each sandbox is in its own cgroup (`cgroupName` of its parameter), so the CPU time and memory of
+// the interactor are accounted and limited separately; the stdin and stdout of the parameters are ignored.
+// The stdout of either can't be relayed (limited or compared; see OutputRelay), since it goes to the other.
+// With `countTraffic`, the pipes are connected through a TrafficCounter each, which costs a hop through
+// the monitor thread for every message.
+// Not started from the zygote. Returns the handle for WaitForInteractiveAsync.
+void *StartInteractive(const SandboxParameter &contestant, const SandboxParameter &interactor, bool countTraffic,
+                       pid_t &contestantPid, pid_t &interactorPid);
+
+// Reap both sandboxes (see WaitForProcessAsync), and call `callback` once both are reaped,
+// on whichever thread the later one is reaped on; it shall not block. The handle is freed then.
+void WaitForInteractiveAsync(void *interactive, InteractiveCallback callback);
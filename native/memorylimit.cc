@@ -0,0 +1,123 @@
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstring>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <syscall.h>
+#include <sys/epoll.h>
+
+#include "memorylimit.h"
+#include "monitor.h"
+#include "cgroup.h"
+#include "utils.h"
+
+using std::string;
+
+// 100ms of stall (of some of the tasks) in a window of 1s, in microseconds.
+const char pressureTrigger[] = "some 100000 1000000";
+static const std::vector<string> residentKeys = {"anon", "shmem"};
+
+MemoryLimitWatcher::MemoryLimitWatcher(pid_t pid, int pidfd, const string &cgroupName, int64_t limit)
+    : m_pid(pid), m_pidfd(pidfd), m_limit(limit), m_exceeded(false)
+{
+    if (!IsCgroupV2())
+    {
+        throw std::logic_error("memory.high is only available with cgroup v2.");
+    }
+    try
+    {
+        m_group = std::make_unique<CgroupHandle>(CgroupInfo("unified", cgroupName));
+        m_eventsfd = ENSURE(openat(m_group->GetDirectory(), "memory.events", O_RDONLY | O_NONBLOCK | O_CLOEXEC));
+        // A trigger lives as long as the file is open. Without PSI (e.g. psi=0), `memory.events` is enough.
+        m_pressurefd = openat(m_group->GetDirectory(), "memory.pressure", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (m_pressurefd != -1 && write(m_pressurefd, pressureTrigger, strlen(pressureTrigger) + 1) == -1)
+        {
+            (void)close(m_pressurefd);
+            m_pressurefd = -1;
+        }
+
+        // It may have got there already. Anything since `memory.events` is opened is notified once watched.
+        // Not called after watching, since the handle is used by the monitor thread then.
+        Check();
+        if (m_exceeded)
+            return;
+
+        SandboxMonitor::Instance().Add(m_eventsfd, EPOLLPRI, [this](uint32_t) {
+            // Reading it rearms the notification.
+            char buffer[256];
+            (void)pread(m_eventsfd, buffer, sizeof(buffer), 0);
+            Check();
+        });
+        if (m_pressurefd != -1)
+        {
+            SandboxMonitor::Instance().Add(m_pressurefd, EPOLLPRI, [this](uint32_t) { Check(); });
+        }
+    }
+    catch (...)
+    {
+        if (m_pressurefd != -1)
+            (void)close(m_pressurefd);
+        if (m_eventsfd != -1)
+        {
+            SandboxMonitor::Instance().Remove(m_eventsfd);
+            (void)close(m_eventsfd);
+        }
+        throw;
+    }
+}
+
+MemoryLimitWatcher::~MemoryLimitWatcher()
+{
+    // Removing an fd not watched (if exceeded right away) is harmless.
+    if (m_pressurefd != -1)
+    {
+        SandboxMonitor::Instance().Remove(m_pressurefd);
+        (void)close(m_pressurefd);
+    }
+    SandboxMonitor::Instance().Remove(m_eventsfd);
+    (void)close(m_eventsfd);
+}
+
+bool MemoryLimitWatcher::Exceeded() const
+{
+    return m_exceeded;
+}
+
+void MemoryLimitWatcher::Check()
+{
+    if (m_exceeded)
+        return;
+
+    // The group may be gone with the sandbox, as we are racing with the reaping.
+    try
+    {
+        auto events = m_group->ReadMap("memory.events");
+        bool exceeded = events["max"] > 0 || events["oom_kill"] > 0;
+        if (!exceeded)
+        {
+            // As the usage is reported on reaping (see MemoryUsageSampler).
+            int64_t values[2];
+            m_group->ReadKeys("memory.stat", residentKeys, values);
+            exceeded = values[0] + values[1] > m_limit;
+        }
+        if (!exceeded)
+            return;
+    }
+    catch (std::exception &)
+    {
+        return;
+    }
+
+    m_exceeded = true;
+    if (m_pidfd != -1)
+    {
+        (void)syscall(SYS_pidfd_send_signal, m_pidfd, SIGKILL, nullptr, 0);
+    }
+    else
+    {
+        (void)kill(m_pid, SIGKILL);
+    }
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+
+#include <sys/types.h>
+
+#include "cgroup.h"
+
+// Enforces the memory limit of a sandbox throttled by `memory.high` (cgroup v2 only) on the monitor thread (see monitor.h),
+// so that a sandbox over the limit is killed as soon as it gets there, instead of thrashing until it's done or OOM-killed.
+// Woken by `memory.events` changing (e.g. the `high` counter, bumped whenever the group is throttled),
+// and by a PSI trigger on `memory.pressure` (100ms of stall in 1s), if PSI is enabled,
+// the usage of anonymous and shared memory (as reported on reaping) is checked against the limit.
+// Hitting `memory.max` or the OOM killer counts as exceeding it as well.
+class MemoryLimitWatcher
+{
+  public:
+    // `limit` is in bytes. Once exceeded, the sandbox is killed with `pidfd`, or with `pid` if it's -1.
+    MemoryLimitWatcher(pid_t pid, int pidfd, const std::string &cgroupName, int64_t limit);
+    ~MemoryLimitWatcher();
+
+    bool Exceeded() const;
+
+  private:
+    void Check();
+
+    pid_t m_pid;
+    int m_pidfd;
+    int64_t m_limit;
+    std::unique_ptr<CgroupHandle> m_group;
+    // Polled for EPOLLPRI, and read to be rearmed.
+    int m_eventsfd = -1;
+    // -1 if PSI is not available.
+    int m_pressurefd = -1;
+
+    std::atomic<bool> m_exceeded;
+};
@@ -0,0 +1,106 @@
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "memoryusage.h"
+#include "monitor.h"
+#include "cgroup.h"
+#include "utils.h"
+
+using std::string;
+using std::vector;
+
+// The interval starts short, for the short runs, and doubles after every sample up to the longest,
+// as reading `memory.stat` costs the monitor thread some 20us, which is a lot with hundreds of sandboxes.
+const int64_t firstSampleInterval = 5 * 1000 * 1000, maxSampleInterval = 100 * 1000 * 1000;
+
+// In the order of the fields of MemoryPeaks.
+static const vector<string> keysV2 = {"anon", "file", "shmem"}, keysV1 = {"rss", "cache", "shmem"};
+
+MemoryUsageSampler::MemoryUsageSampler(const string &cgroupName)
+{
+    try
+    {
+        m_group = std::make_unique<CgroupHandle>(CgroupInfo(IsCgroupV2() ? "unified" : "memory", cgroupName));
+        Sample();
+
+        m_timerfd = ENSURE(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+        Arm(firstSampleInterval);
+
+        SandboxMonitor::Instance().Add(m_timerfd, EPOLLIN, [this](uint32_t) {
+            uint64_t expirations;
+            if (read(m_timerfd, &expirations, sizeof(expirations)) == sizeof(expirations))
+            {
+                Sample();
+                Arm(std::min(m_interval * 2, maxSampleInterval));
+            }
+        });
+    }
+    catch (...)
+    {
+        if (m_timerfd != -1)
+            (void)close(m_timerfd);
+        throw;
+    }
+}
+
+MemoryUsageSampler::~MemoryUsageSampler()
+{
+    if (m_timerfd != -1)
+    {
+        SandboxMonitor::Instance().Remove(m_timerfd);
+        (void)close(m_timerfd);
+    }
+}
+
+void MemoryUsageSampler::Stop()
+{
+    if (m_timerfd == -1)
+        return;
+    SandboxMonitor::Instance().Remove(m_timerfd);
+    (void)close(m_timerfd);
+    m_timerfd = -1;
+    Sample();
+}
+
+const MemoryPeaks &MemoryUsageSampler::Peaks() const
+{
+    return m_peaks;
+}
+
+int64_t MemoryUsageSampler::ResidentPeak() const
+{
+    return m_residentPeak;
+}
+
+void MemoryUsageSampler::Arm(int64_t interval)
+{
+    m_interval = interval;
+    itimerspec spec = {};
+    spec.it_value.tv_sec = interval / 1000000000;
+    spec.it_value.tv_nsec = interval % 1000000000;
+    ENSURE(timerfd_settime(m_timerfd, 0, &spec, nullptr));
+}
+
+void MemoryUsageSampler::Sample()
+{
+    int64_t values[3];
+    // The group may be gone with the sandbox, as we are racing with the reaping.
+    try
+    {
+        m_group->ReadKeys("memory.stat", IsCgroupV2() ? keysV2 : keysV1, values);
+    }
+    catch (std::exception &)
+    {
+        return;
+    }
+    m_peaks.anon = std::max(m_peaks.anon, values[0]);
+    m_peaks.file = std::max(m_peaks.file, values[1]);
+    m_peaks.shmem = std::max(m_peaks.shmem, values[2]);
+    m_residentPeak = std::max(m_residentPeak, values[0] + values[2]);
+}
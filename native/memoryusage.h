@@ -0,0 +1,39 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <cstdint>
+
+#include "cgroup.h"
+#include "sandbox.h"
+
+// Samples `memory.stat` of a sandbox on the monitor thread (see monitor.h) with a one-shot timerfd, 5ms after it starts,
+// then at twice the last interval, up to every 100ms,
+// keeping the peaks of its anonymous memory, page cache and shared memory, which the cgroups only report as a whole
+// (`memory.peak`, or `memory.memsw.max_usage_in_bytes` with cgroup v1), along with the peak of anonymous plus shared memory.
+// The keys are picked out in a single pass over the file, read with a CgroupHandle opened in advance.
+class MemoryUsageSampler
+{
+  public:
+    MemoryUsageSampler(const std::string &cgroupName);
+    ~MemoryUsageSampler();
+
+    // Stop sampling and take a last sample, if the group is still there.
+    void Stop();
+    // Only once stopped.
+    const MemoryPeaks &Peaks() const;
+    int64_t ResidentPeak() const;
+
+  private:
+    // Set the timer to expire once, in `interval` nanoseconds.
+    void Arm(int64_t interval);
+    void Sample();
+
+    std::unique_ptr<CgroupHandle> m_group;
+    int m_timerfd = -1;
+    int64_t m_interval = 0;
+
+    MemoryPeaks m_peaks = {};
+    // Of anonymous plus shared memory, as they are at the same time.
+    int64_t m_residentPeak = 0;
+};
@@ -0,0 +1,91 @@
+#include <map>
+#include <mutex>
+#include <memory>
+#include <thread>
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "monitor.h"
+#include "utils.h"
+
+SandboxMonitor &SandboxMonitor::Instance()
+{
+    // Never destroyed, since the thread may still be running when the process exits.
+    static SandboxMonitor *instance = new SandboxMonitor();
+    return *instance;
+}
+
+SandboxMonitor::SandboxMonitor()
+{
+    m_epollfd = ENSURE(epoll_create1(EPOLL_CLOEXEC));
+    std::thread thread(&SandboxMonitor::Run, this);
+    m_threadId = thread.get_id();
+    thread.detach();
+}
+
+void SandboxMonitor::Add(int fd, uint32_t events, Handler handler)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    epoll_event event = {};
+    event.events = events;
+    event.data.fd = fd;
+    ENSURE(epoll_ctl(m_epollfd, EPOLL_CTL_ADD, fd, &event));
+    m_handlers[fd] = std::make_shared<Handler>(std::move(handler));
+}
+
+void SandboxMonitor::Remove(int fd)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    (void)epoll_ctl(m_epollfd, EPOLL_CTL_DEL, fd, nullptr);
+    m_handlers.erase(fd);
+    if (std::this_thread::get_id() != m_threadId)
+    {
+        m_handlerDone.wait(lock, [&] { return m_current != fd; });
+    }
+}
+
+void SandboxMonitor::Run()
+{
+    const int maxEvents = 64;
+    epoll_event events[maxEvents];
+    while (true)
+    {
+        int count = epoll_wait(m_epollfd, events, maxEvents, -1);
+        if (count == -1)
+        {
+            // Nothing but EINTR is expected here.
+            continue;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            std::shared_ptr<Handler> handler;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                auto iter = m_handlers.find(events[i].data.fd);
+                // The fd may be removed by a previous handler in this round.
+                if (iter == m_handlers.end())
+                    continue;
+                handler = iter->second;
+                m_current = events[i].data.fd;
+            }
+
+            try
+            {
+                (*handler)(events[i].events);
+            }
+            catch (...)
+            {
+                // A handler shouldn't throw; don't let it kill the monitor.
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_current = -1;
+            }
+            m_handlerDone.notify_all();
+        }
+    }
+}
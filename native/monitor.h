@@ -0,0 +1,40 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+#include <cstdint>
+
+// A single thread watching the file descriptors of all live sandboxes (timers, pipes, etc.) with epoll,
+// so that nothing needs to be polled from the JavaScript side.
+class SandboxMonitor
+{
+  public:
+    // The handler is called on the monitor thread with the epoll events. It shall not block,
+    // and should tolerate spurious events (the fd is non-blocking, typically).
+    typedef std::function<void(uint32_t)> Handler;
+
+    // The monitor thread is started on the first use, and is never stopped.
+    static SandboxMonitor &Instance();
+
+    void Add(int fd, uint32_t events, Handler handler);
+    // Once this returns, the handler is not being called and won't be called again,
+    // unless it's called from the handler itself.
+    void Remove(int fd);
+
+  private:
+    SandboxMonitor();
+    void Run();
+
+    int m_epollfd;
+    std::mutex m_mutex;
+    std::condition_variable m_handlerDone;
+    std::map<int, std::shared_ptr<Handler>> m_handlers;
+    // The fd whose handler is being called, or -1.
+    int m_current = -1;
+    std::thread::id m_threadId;
+};
@@ -0,0 +1,232 @@
+#include <map>
+#include <chrono>
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <stdexcept>
+
+#include <cstring>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <syscall.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mount.h>
+
+#include <fmt/format.h>
+
+#include "mounts.h"
+#include "scratch.h"
+#include "pipe.h"
+#include "utils.h"
+
+namespace fs = std::filesystem;
+using std::string;
+using fmt::format;
+
+void EnsureDirectoryExistance(const fs::path &dir)
+{
+    if (!fs::exists(dir))
+    {
+        throw std::runtime_error((format("The specified path {} does not exist.", dir)));
+    }
+    if (!fs::is_directory(dir))
+    {
+        throw std::runtime_error((format("The specified path {} exists, but is not a directory.", dir)));
+    }
+}
+
+static fs::path MountTarget(const fs::path &root, const MountInfo &info)
+{
+    if (!info.dst.is_absolute())
+    {
+        throw std::invalid_argument(format("The dst path {} in mounts should be absolute.", info.dst));
+    }
+    return root / fs::relative(info.dst, "/");
+}
+
+void MountRoot(const SandboxParameter &parameter)
+{
+    ENSURE(mount("none", "/", NULL, MS_REC | MS_PRIVATE, NULL)); // Make root private
+
+    EnsureDirectoryExistance(parameter.chrootDirectory);
+    ENSURE(mount(parameter.chrootDirectory.string().c_str(),
+                 parameter.chrootDirectory.string().c_str(), "", MS_BIND | MS_RDONLY | MS_REC, ""));
+    ENSURE(mount("", parameter.chrootDirectory.string().c_str(), "", MS_BIND | MS_REMOUNT | MS_RDONLY | MS_REC, ""));
+    if (parameter.chrootLimit != 0)
+    {
+        MountOverlay(parameter.chrootDirectory, parameter.chrootLimit);
+    }
+
+    for (const MountInfo &info : parameter.mounts)
+    {
+        if (info.limit > 0)
+        {
+            continue;
+        }
+        fs::path target = MountTarget(parameter.chrootDirectory, info);
+        EnsureDirectoryExistance(info.src);
+        if (parameter.chrootLimit != 0)
+        {
+            fs::create_directories(target);
+        }
+        EnsureDirectoryExistance(target);
+        ENSURE(mount(info.src.string().c_str(), target.string().c_str(), "", MS_BIND | MS_REC, ""));
+        if (info.limit == 0)
+        {
+            ENSURE(mount("", target.string().c_str(), "", MS_BIND | MS_REMOUNT | MS_RDONLY | MS_REC, ""));
+        }
+    }
+}
+
+void MountScratches(const SandboxParameter &parameter, const fs::path &root)
+{
+    for (const MountInfo &info : parameter.mounts)
+    {
+        if (info.limit <= 0)
+        {
+            continue;
+        }
+        fs::path target = MountTarget(root, info);
+        if (parameter.chrootLimit != 0)
+        {
+            fs::create_directories(target);
+        }
+        EnsureDirectoryExistance(target);
+        MountScratch(target, info.limit, parameter.uid, parameter.gid);
+    }
+}
+
+MountTemplate::~MountTemplate()
+{
+    (void)close(fd);
+}
+
+// Identify `path` by its device and inode as well, so that a replaced directory gets a new template.
+static bool AppendToKey(string &key, const fs::path &path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) == -1)
+    {
+        return false;
+    }
+    key += format("{}:{}:{}", path.string(), st.st_dev, st.st_ino);
+    key.push_back('\0');
+    return true;
+}
+
+// Build the template in a child, which keeps the namespace alive until we have opened it. -1 if it fails.
+static int BuildMountTemplate(const SandboxParameter &parameter)
+{
+    PosixPipe report(O_CLOEXEC), hold(O_CLOEXEC);
+    pid_t pid = ENSURE(fork());
+    if (pid == 0)
+    {
+        report.Close(0);
+        hold.Close(1);
+        try
+        {
+            ENSURE(unshare(CLONE_NEWNS));
+            MountRoot(parameter);
+            // Stack the old root on the new one, and detach it, so that nothing of the host is left.
+            ENSURE(chdir(parameter.chrootDirectory.string().c_str()));
+            ENSURE(syscall(SYS_pivot_root, ".", "."));
+            ENSURE(umount2(".", MNT_DETACH));
+
+            int ready = -1;
+            ENSURE(write(report[1], &ready, sizeof(int)));
+            char buffer;
+            (void)read(hold[0], &buffer, 1);
+            _exit(0);
+        }
+        catch (std::exception &err)
+        {
+            const char *errMessage = err.what();
+            int len = strlen(errMessage);
+            iovec message[2] = {{&len, sizeof(int)}, {const_cast<char *>(errMessage), static_cast<size_t>(len)}};
+            (void)writev(report[1], message, 2);
+            _exit(1);
+        }
+    }
+
+    report.Close(1);
+    hold.Close(0);
+    int status = 0, fd = -1;
+    if (read(report[0], &status, sizeof(int)) == sizeof(int) && status == -1)
+    {
+        fd = open(format("/proc/{}/ns/mnt", pid).c_str(), O_RDONLY | O_CLOEXEC);
+    }
+    // Let the child go.
+    hold.Close(1);
+    (void)waitpid(pid, nullptr, 0);
+    return fd;
+}
+
+const size_t maxMountTemplates = 16;
+// A template that has failed to build is tried again after this.
+const std::chrono::seconds mountTemplateRetryDelay(5);
+
+struct MountTemplateEntry
+{
+    // Null if it has failed to build.
+    std::shared_ptr<const MountTemplate> mountTemplate;
+    std::chrono::steady_clock::time_point builtAt;
+    // For the least recently used one to be evicted.
+    uint64_t lastUse;
+};
+
+std::shared_ptr<const MountTemplate> GetMountTemplate(const SandboxParameter &parameter)
+{
+    static std::mutex mutex;
+    static std::map<string, MountTemplateEntry> templates;
+    static uint64_t uses = 0;
+
+    if (parameter.chrootLimit != 0)
+    {
+        return nullptr;
+    }
+    string key;
+    if (!AppendToKey(key, parameter.chrootDirectory))
+    {
+        return nullptr;
+    }
+    for (const MountInfo &info : parameter.mounts)
+    {
+        if (info.limit > 0)
+        {
+            continue;
+        }
+        if (!AppendToKey(key, info.src))
+        {
+            return nullptr;
+        }
+        key += format("{}:{}", info.dst.string(), info.limit == 0 ? "ro" : "rw");
+        key.push_back('\0');
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto now = std::chrono::steady_clock::now();
+    auto iter = templates.find(key);
+    if (iter != templates.end() && (iter->second.mountTemplate || now - iter->second.builtAt < mountTemplateRetryDelay))
+    {
+        iter->second.lastUse = ++uses;
+        return iter->second.mountTemplate;
+    }
+    if (iter == templates.end() && templates.size() >= maxMountTemplates)
+    {
+        // In use ones are kept alive by the sandboxes.
+        templates.erase(std::min_element(templates.begin(), templates.end(), [](const auto &a, const auto &b) {
+            return a.second.lastUse < b.second.lastUse;
+        }));
+    }
+    int fd = BuildMountTemplate(parameter);
+    // A failure is remembered for a while as well, to not try again on every run.
+    MountTemplateEntry &entry = templates[key];
+    entry.mountTemplate = fd != -1 ? std::make_shared<const MountTemplate>(fd) : nullptr;
+    entry.builtAt = now;
+    entry.lastUse = ++uses;
+    return entry.mountTemplate;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <memory>
+#include <filesystem>
+
+#include "sandbox.h"
+
+void EnsureDirectoryExistance(const std::filesystem::path &dir);
+
+// In a new mount namespace. Make all mounts private, and bind-mount the chroot directory on itself read-only
+// (with an overlay on it if `chrootLimit` is set), then the bind mounts in `mounts` on it, i.e. all but the scratch ones.
+void MountRoot(const SandboxParameter &parameter);
+// Mount the scratch mounts in `mounts` (those with a positive limit), with their targets under `root`.
+void MountScratches(const SandboxParameter &parameter, const std::filesystem::path &root);
+
+// A mount namespace that has only the root of a sandbox, as mounted by MountRoot and then pivoted into.
+// A child joins it (setns) instead of cloning the mount namespace of the host and mounting its root all over again,
+// which takes several mount syscalls, each serialized with those of every other sandbox starting on the machine.
+// If it needs mounts of its own (the scratch mounts, or `/proc`), it copies the template (unshare) first,
+// which is cheap, since the template has nothing else. So does a sandbox run as root, which could mount and unmount
+// in it, so that the sandboxes sharing a template can't change it.
+struct MountTemplate
+{
+    // The namespace file (from /proc/<pid>/ns/mnt), close-on-exec.
+    int fd;
+
+    explicit MountTemplate(int fd) : fd(fd) {}
+    ~MountTemplate();
+    MountTemplate(const MountTemplate &) = delete;
+    MountTemplate &operator=(const MountTemplate &) = delete;
+};
+
+// Get the template for the chroot directory and bind mounts of `parameter`, which is built on first use, then cached
+// for the lifetime of the process (up to the 16 most recently used). Null if a template can't be used, i.e. with
+// `chrootLimit` set, or if it can't be built (e.g. a directory is missing), in which case the child mounts its root
+// itself as usual; it's built again on a later use, once 5 seconds have passed.
+// A template keeps the mounts as they were when it was built: the files under them are live,
+// but anything mounted under the chroot directory afterwards is not seen. Replacing the chroot directory or a source
+// (e.g. renaming a new one into its place) gets a new template.
+std::shared_ptr<const MountTemplate> GetMountTemplate(const SandboxParameter &parameter);
@@ -0,0 +1,315 @@
+#include <vector>
+#include <algorithm>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <syscall.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+
+#include <fmt/format.h>
+
+#include "output.h"
+#include "monitor.h"
+#include "utils.h"
+
+using std::vector;
+
+// Make a destination that may block (anything but a file) non-blocking, and return the fd to write to instead.
+// It's reopened for that where possible (a pipe, a FIFO or a terminal), since it may share its flags with the caller,
+// e.g. the stdout of this process; a socket can't be reopened, so it's made non-blocking itself.
+static int OpenNonBlocking(int fd)
+{
+    struct stat info;
+    if (fstat(fd, &info) == -1 || S_ISREG(info.st_mode) || S_ISBLK(info.st_mode))
+        return fd;
+    int reopened = open(fmt::format("/proc/self/fd/{}", fd).c_str(), O_WRONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    if (reopened != -1)
+    {
+        (void)close(fd);
+        return reopened;
+    }
+    int flags = fcntl(fd, F_GETFL);
+    if (flags != -1)
+        (void)fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    return fd;
+}
+
+OutputRelay::OutputRelay(pid_t pid, int pidfd, int64_t limit, const vector<Stream> &streams,
+                         std::unique_ptr<OutputComparator> comparator, bool stopOnMismatch)
+    : m_pid(pid), m_pidfd(pidfd), m_limit(limit), m_streams(streams), m_states(streams.size()), m_exceeded(false),
+      m_comparator(std::move(comparator)), m_stopOnMismatch(stopOnMismatch)
+{
+    try
+    {
+        // The handlers wait until all the streams are watched.
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (size_t i = 0; i < m_streams.size(); i++)
+        {
+            m_streams[i].destination = OpenNonBlocking(m_streams[i].destination);
+            Watch(i, m_streams[i].pipe, EPOLLIN);
+        }
+    }
+    catch (...)
+    {
+        Detach();
+        for (auto &stream : m_streams)
+        {
+            (void)close(stream.pipe);
+            (void)close(stream.destination);
+        }
+        throw;
+    }
+}
+
+OutputRelay::~OutputRelay()
+{
+    Detach();
+    for (size_t i = 0; i < m_streams.size(); i++)
+    {
+        Stop(i);
+    }
+}
+
+bool OutputRelay::Exceeded() const
+{
+    return m_exceeded;
+}
+
+int64_t OutputRelay::MismatchOffset() const
+{
+    return m_mismatchOffset;
+}
+
+bool OutputRelay::KilledOnMismatch() const
+{
+    return m_killedOnMismatch;
+}
+
+void OutputRelay::Kill()
+{
+    if (m_pidfd != -1)
+    {
+        (void)syscall(SYS_pidfd_send_signal, m_pidfd, SIGKILL, nullptr, 0);
+    }
+    else
+    {
+        (void)kill(m_pid, SIGKILL);
+    }
+    m_killed = true;
+}
+
+void OutputRelay::Watch(size_t index, int fd, uint32_t events)
+{
+    StreamState &state = m_states[index];
+    if (m_detached || state.watched == fd)
+        return;
+    // Only switched on the monitor thread (or before any handler is called), where Remove doesn't wait.
+    if (state.watched != -1)
+        SandboxMonitor::Instance().Remove(state.watched);
+    state.watched = -1;
+    SandboxMonitor::Instance().Add(fd, events, [this, index](uint32_t events) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_detached)
+            return;
+        bool hungUp = m_states[index].watched == m_streams[index].pipe && (events & (EPOLLHUP | EPOLLERR));
+        Relay(index, hungUp);
+    });
+    state.watched = fd;
+}
+
+void OutputRelay::Detach()
+{
+    vector<int> watched;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_detached = true;
+        for (auto &state : m_states)
+        {
+            if (state.watched != -1)
+                watched.push_back(state.watched);
+            state.watched = -1;
+        }
+    }
+    // Waits for the handlers, which do nothing once detached.
+    for (int fd : watched)
+    {
+        SandboxMonitor::Instance().Remove(fd);
+    }
+}
+
+OutputRelay::FlushResult OutputRelay::Flush(size_t index)
+{
+    vector<char> &pending = m_states[index].pending;
+    size_t written = 0;
+    while (written < pending.size())
+    {
+        ssize_t count = write(m_streams[index].destination, pending.data() + written, pending.size() - written);
+        if (count == -1 && errno == EINTR)
+            continue;
+        if (count == -1 && errno == EAGAIN)
+        {
+            pending.erase(pending.begin(), pending.begin() + written);
+            return BLOCKED;
+        }
+        if (count <= 0)
+            return BROKEN;
+        written += count;
+    }
+    pending.clear();
+    return FLUSHED;
+}
+
+bool OutputRelay::ReadPending(size_t index, size_t length)
+{
+    // Only read once the last is written.
+    vector<char> &pending = m_states[index].pending;
+    pending.resize(std::min<size_t>(length, 65536));
+    ssize_t count;
+    do
+    {
+        count = read(m_streams[index].pipe, pending.data(), pending.size());
+    } while (count == -1 && errno == EINTR);
+    if (count <= 0)
+    {
+        pending.clear();
+        return false;
+    }
+    pending.resize(count);
+    m_written += count;
+
+    if (m_comparator && index == 0)
+    {
+        bool matches = m_comparator->Feed(pending.data(), count);
+        if (!matches && m_stopOnMismatch && !m_killedOnMismatch)
+        {
+            m_killedOnMismatch = true;
+            Kill();
+        }
+    }
+    return true;
+}
+
+void OutputRelay::Relay(size_t index, bool hungUp)
+{
+    Stream &stream = m_streams[index];
+    StreamState &state = m_states[index];
+    while (stream.pipe != -1)
+    {
+        FlushResult flushed = Flush(index);
+        if (flushed == BROKEN)
+        {
+            // The destination is broken. Close the pipe, so the sandbox gets EPIPE as if it were writing there itself.
+            Stop(index);
+            return;
+        }
+        if (flushed == BLOCKED)
+        {
+            // The rest is left in the pipe meanwhile, so the sandbox blocks once it's full.
+            Watch(index, stream.destination, EPOLLOUT);
+            return;
+        }
+        if (m_killed)
+        {
+            // The rest of its output is discarded.
+            Stop(index);
+            return;
+        }
+
+        int available = 0;
+        if (ioctl(stream.pipe, FIONREAD, &available) == -1 || available == 0)
+        {
+            // All the write ends are closed, and nothing is left.
+            if (hungUp)
+                Stop(index);
+            else
+                Watch(index, stream.pipe, EPOLLIN);
+            return;
+        }
+        size_t length = available;
+        if (m_limit >= 0 && m_written + available > m_limit)
+        {
+            length = m_limit - m_written;
+            if (length == 0)
+            {
+                m_exceeded = true;
+                Kill();
+                continue;
+            }
+        }
+
+        if ((m_comparator && index == 0) || state.readWrite)
+        {
+            if (!ReadPending(index, length))
+            {
+                Stop(index);
+                return;
+            }
+            continue;
+        }
+        ssize_t count = splice(stream.pipe, nullptr, stream.destination, nullptr, length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (count > 0)
+        {
+            m_written += count;
+            continue;
+        }
+        if (count == -1 && errno == EINTR)
+            continue;
+        if (count == -1 && errno == EINVAL)
+        {
+            // The destination doesn't support splicing (e.g. it's opened with O_APPEND).
+            state.readWrite = true;
+            continue;
+        }
+        if (count == -1 && errno == EAGAIN)
+        {
+            // The pipe isn't empty, so the destination is full.
+            Watch(index, stream.destination, EPOLLOUT);
+            return;
+        }
+        Stop(index);
+        return;
+    }
+}
+
+void OutputRelay::Stop(size_t index)
+{
+    Stream &stream = m_streams[index];
+    StreamState &state = m_states[index];
+    if (stream.pipe == -1)
+        return;
+    if (state.watched != -1)
+        SandboxMonitor::Instance().Remove(state.watched);
+    state.watched = -1;
+    (void)close(stream.pipe);
+    (void)close(stream.destination);
+    stream.pipe = stream.destination = -1;
+    state.pending.clear();
+}
+
+void OutputRelay::Finish()
+{
+    // Stop the handlers first, so the rest is relayed here only.
+    Detach();
+    for (size_t i = 0; i < m_streams.size(); i++)
+    {
+        while (true)
+        {
+            Relay(i, true);
+            if (m_streams[i].pipe == -1)
+                break;
+            // Only left unfinished while the destination is full.
+            pollfd fd = {m_streams[i].destination, POLLOUT, 0};
+            (void)poll(&fd, 1, -1);
+        }
+    }
+    if (m_comparator)
+    {
+        m_mismatchOffset = m_comparator->Finish();
+        m_comparator.reset();
+    }
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+
+#include <sys/types.h>
+
+#include "compare.h"
+
+// Relays the output of a sandbox from pipes to the real destinations on the monitor thread (see monitor.h),
+// with `splice`, so that the size of the output can be limited without trusting the file system.
+// Once the sandbox has written more than the limit (in all streams in total), exactly the limit is relayed,
+// the sandbox is killed and the rest of its output is discarded.
+// With a comparator, the first stream is compared with the expected output as it's relayed,
+// and the sandbox may be killed as soon as it differs.
+// A destination that may block (a pipe, a terminal, ...) is written to without blocking: while it's full,
+// the rest is left in the pipe (so the sandbox blocks instead) and the destination is watched until it's writable.
+class OutputRelay
+{
+  public:
+    struct Stream
+    {
+        // The non-blocking read end of the pipe the sandbox writes to.
+        int pipe;
+        // Where the output goes, e.g. the file the sandbox would write to itself.
+        int destination;
+    };
+
+    // `limit` is in bytes, or -1 for no limit. The relay takes the ownership of the file descriptors in `streams`.
+    // Once exceeded, the sandbox is killed with `pidfd`, or with `pid` if it's -1.
+    OutputRelay(pid_t pid, int pidfd, int64_t limit, const std::vector<Stream> &streams,
+                std::unique_ptr<OutputComparator> comparator = nullptr, bool stopOnMismatch = false);
+    ~OutputRelay();
+
+    // Relay what's left in the pipes once the sandbox has exited, and stop.
+    // The write ends may still be open elsewhere (inherited by a sandbox being cloned meanwhile, until it execs),
+    // so this doesn't wait for EOF; nothing more can be written by the sandbox anyway.
+    // Blocks until the destinations have taken the rest, so it's not to be called on the monitor thread.
+    void Finish();
+    bool Exceeded() const;
+    // Once finished. The offset in the first stream where it differs from the expected output, or -1.
+    int64_t MismatchOffset() const;
+    bool KilledOnMismatch() const;
+
+  private:
+    // What the relay keeps of each stream, besides the Stream itself.
+    struct StreamState
+    {
+        // The fd of the stream being watched (the pipe, or the destination while it's full), or -1.
+        int watched = -1;
+        // What's been read from the pipe but not written yet.
+        std::vector<char> pending;
+        // Whether the destination doesn't support splicing (e.g. it's opened with O_APPEND).
+        bool readWrite = false;
+    };
+
+    enum FlushResult
+    {
+        FLUSHED,
+        BLOCKED,
+        BROKEN,
+    };
+
+    // Relay as much as can be relayed without blocking, then watch what to wait for.
+    // `hungUp` is whether the pipe has no writers left, in which case the stream is stopped once it's empty.
+    void Relay(size_t index, bool hungUp);
+    FlushResult Flush(size_t index);
+    // Read up to `length` bytes from the pipe into the pending buffer, comparing them on the way.
+    bool ReadPending(size_t index, size_t length);
+    void Watch(size_t index, int fd, uint32_t events);
+    // Stop watching all the streams, for good.
+    void Detach();
+    void Kill();
+    void Stop(size_t index);
+
+    pid_t m_pid;
+    int m_pidfd;
+    int64_t m_limit;
+    std::vector<Stream> m_streams;
+    // Held by the handlers, so that the streams can be detached from another thread.
+    std::mutex m_mutex;
+    bool m_detached = false;
+    // The rest is only accessed by the handlers, or once detached.
+    std::vector<StreamState> m_states;
+    int64_t m_written = 0;
+    // Once the sandbox is killed, nothing more is read; what's pending is still written.
+    bool m_killed = false;
+    std::atomic<bool> m_exceeded;
+
+    std::unique_ptr<OutputComparator> m_comparator;
+    bool m_stopOnMismatch;
+    int64_t m_mismatchOffset = -1;
+    bool m_killedOnMismatch = false;
+};
@@ -18,8 +18,10 @@ PosixPipe::PosixPipe(int flags)
 
 PosixPipe::~PosixPipe()
 {
-    (void)close(fd[0]);
-    (void)close(fd[1]);
+    if (fd[0] != -1)
+        (void)close(fd[0]);
+    if (fd[1] != -1)
+        (void)close(fd[1]);
 }
 
 int PosixPipe::operator[](int x)
@@ -29,3 +31,17 @@ int PosixPipe::operator[](int x)
     else
         throw std::invalid_argument("Pipe file descriptor index number can't be greater than 1.");
 }
+
+void PosixPipe::Close(int x)
+{
+    int end = Release(x);
+    if (end != -1)
+        (void)close(end);
+}
+
+int PosixPipe::Release(int x)
+{
+    int end = (*this)[x];
+    fd[x] = -1;
+    return end;
+}
@@ -7,6 +7,10 @@ class PosixPipe
     PosixPipe(int flags = 0);
     ~PosixPipe();
     int operator[](int);
+    // Close one end early, e.g. the write end once it's passed to a child.
+    void Close(int);
+    // Give up one end, which is not closed by us then.
+    int Release(int);
 
   private:
     int fd[2];
@@ -0,0 +1,144 @@
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+
+#include <unistd.h>
+
+#include <fmt/format.h>
+
+#include "pool.h"
+
+using std::string;
+using fmt::format;
+
+// Shared by all pools so that the cgroup names never collide.
+static std::atomic<unsigned long> serialNumber(0);
+
+static void RemoveCgroups(const string &cgroupName)
+{
+    try
+    {
+        RemoveSandboxCgroups(cgroupName);
+    }
+    catch (...)
+    {
+        // The cgroups may not have been created.
+    }
+}
+
+SandboxPool::SandboxPool(const SandboxParameter &parameter, int size)
+    : m_parameter(parameter), m_size(size)
+{
+    if (size < 0)
+    {
+        throw std::invalid_argument("Pool size can't be negative.");
+    }
+    m_thread = std::thread(&SandboxPool::Refill, this);
+}
+
+SandboxPool::~SandboxPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_refill.notify_all();
+    m_thread.join();
+
+    for (auto &sandbox : m_parked)
+    {
+        Discard(sandbox);
+    }
+}
+
+SandboxPool::ParkedSandbox SandboxPool::Prepare()
+{
+    ParkedSandbox sandbox;
+    SandboxParameter parameter = m_parameter;
+    parameter.cgroupName = sandbox.cgroupName = format("{}/pool-{}-{}", m_parameter.cgroupName, getpid(), ++serialNumber);
+    try
+    {
+        sandbox.execParam = PrepareSandbox(parameter, sandbox.pid, true);
+    }
+    catch (...)
+    {
+        RemoveCgroups(sandbox.cgroupName);
+        throw;
+    }
+    return sandbox;
+}
+
+void SandboxPool::Discard(const ParkedSandbox &sandbox)
+{
+    DestroySandbox(sandbox.pid, sandbox.execParam);
+    RemoveCgroups(sandbox.cgroupName);
+}
+
+void *SandboxPool::Start(const SandboxRunParameter &run, pid_t &pid, string &cgroupName)
+{
+    ParkedSandbox sandbox;
+    bool parked = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_parked.empty())
+        {
+            sandbox = m_parked.front();
+            m_parked.pop_front();
+            parked = true;
+        }
+    }
+
+    if (parked)
+    {
+        m_refill.notify_one();
+    }
+    else
+    {
+        // The pool is drained (or its size is zero); don't make the caller wait for the refilling thread.
+        sandbox = Prepare();
+    }
+
+    try
+    {
+        ReleaseSandbox(sandbox.execParam, &run);
+    }
+    catch (...)
+    {
+        Discard(sandbox);
+        throw;
+    }
+
+    pid = sandbox.pid;
+    cgroupName = sandbox.cgroupName;
+    return sandbox.execParam;
+}
+
+void SandboxPool::Refill()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stopping)
+    {
+        if (m_parked.size() >= m_size)
+        {
+            m_refill.wait(lock);
+            continue;
+        }
+
+        lock.unlock();
+        try
+        {
+            ParkedSandbox sandbox = Prepare();
+            lock.lock();
+            m_parked.push_back(sandbox);
+        }
+        catch (...)
+        {
+            // The failure will be reported when the pool is drained and Start prepares one itself.
+            // Don't retry in a busy loop.
+            lock.lock();
+            m_refill.wait_for(lock, std::chrono::milliseconds(100));
+        }
+    }
+}
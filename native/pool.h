@@ -0,0 +1,48 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "sandbox.h"
+
+// Keeps a number of sandboxes prepared from the same template parked right before running,
+// so that starting a sandbox only costs sending the run parameter to a parked child.
+// The chroot, mounts, limits and user are fixed by the template;
+// the executable, its parameters and IO are specified per run (see SandboxRunParameter).
+// Every sandbox gets its own cgroup, named `<template cgroup>/pool-<pid>-<serial number>`.
+class SandboxPool
+{
+  public:
+    SandboxPool(const SandboxParameter &parameter, int size);
+    // Kills the parked sandboxes and removes their cgroups. Sandboxes already started are not affected.
+    ~SandboxPool();
+
+    // Start a sandbox from the pool. If no sandbox is parked, one is prepared on the spot.
+    // The returned execution parameter is to be passed to WaitForProcess, as the one from StartSandbox.
+    void *Start(const SandboxRunParameter &run, pid_t &pid, std::string &cgroupName);
+
+  private:
+    struct ParkedSandbox
+    {
+        pid_t pid;
+        void *execParam;
+        std::string cgroupName;
+    };
+
+    ParkedSandbox Prepare();
+    void Discard(const ParkedSandbox &sandbox);
+    // The body of the refilling thread.
+    void Refill();
+
+    SandboxParameter m_parameter;
+    size_t m_size;
+
+    std::mutex m_mutex;
+    std::condition_variable m_refill;
+    std::deque<ParkedSandbox> m_parked;
+    bool m_stopping = false;
+    std::thread m_thread;
+};
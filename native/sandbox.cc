@@ -6,6 +6,10 @@
 #include <stdexcept>
 #include <memory>
 #include <mutex>
+#include <optional>
+#include <thread>
+#include <algorithm>
+#include <limits>
 
 #include <cstring>
 #include <cassert>
@@ -23,7 +27,14 @@
 #include <sys/resource.h>
 #include <sys/mount.h>
 #include <sys/wait.h>
-#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/prctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <time.h>
+#include <linux/sched.h>
 
 #include <fmt/format.h>
 #include <fmt/ostream.h>
@@ -32,8 +43,19 @@
 #include "sandbox.h"
 #include "utils.h"
 #include "cgroup.h"
-#include "semaphore.h"
+#include "scratch.h"
+#include "seccomp.h"
 #include "pipe.h"
+#include "socket.h"
+#include "timelimit.h"
+#include "memorylimit.h"
+#include "memoryusage.h"
+#include "sandboxtemplate.h"
+#include "monitor.h"
+#include "output.h"
+#include "spawn.h"
+#include "mounts.h"
+#include "telemetry.h"
 
 namespace fs = std::filesystem;
 using std::string;
@@ -112,28 +134,372 @@ static void RedirectIO(const SandboxParameter &param, int nullfd)
 struct ExecutionParameter
 {
     const SandboxParameter &parameter;
+    // `parameter` may be gone after the sandbox is prepared, so keep what we still need.
+    string cgroupName;
+    int64_t timeLimit;
+    int64_t outputLimit;
+    // Whether the output goes through pipes to `outputRelay`, since it's limited or compared.
+    bool relaysOutput;
+    // The comparison of the output; the expected output of a deferred sandbox may be overridden by the run.
+    CompareMode compareMode;
+    double compareEpsilon;
+    bool stopOnMismatch;
+    fs::path expectedOutput;
+    // Opened in advance, and handed over to `outputRelay`.
+    std::unique_ptr<OutputComparator> comparator;
+    int64_t memoryHigh;
+    bool redirectBeforeChroot;
+    bool deferRun;
+    // Whether the child is cloned in our memory (see SharedMemoryChild), which is the case unless it's deferred,
+    // or cgroup v1 is used (where the child is moved into its groups after being cloned, while we aren't blocked).
+    bool sharesMemory;
+    // The arguments and environment variables for `execvpe`, if built in advance: those of an ExecArena,
+    // or those of `parameter` for a child in our memory, which can't allocate them itself.
+    // Otherwise, the child builds them from its own copy.
+    char *const *execArguments = nullptr, *const *execEnvironment = nullptr;
+    vector<char *> ownArguments, ownEnvironment;
 
-    PosixSemaphore semaphore1, semaphore2;
-    // This pipe is used to forward error message from the child process to the parent.
+    // The child reports on this pipe that it's set up (an int of -1), or its error (the length and the message),
+    // which may also be a failure of `execvpe` after it has been let go.
     PosixPipe pipefd;
+    // Once set up, the child waits on this eventfd until the parent lets it go.
+    int continueEvent = -1;
+    // This socket is used to pass the SandboxRunParameter to a deferred child,
+    // and the stdout and stderr opened by the child back to the parent if the output is limited,
+    // as well as the listener of its seccomp filter.
+    std::unique_ptr<UnixSocketPair> runChannel;
+    // If the output is limited or compared, the child writes its stdout and stderr to these pipes,
+    // and `outputRelay` relays them to the real destinations.
+    std::unique_ptr<PosixPipe> stdoutPipe, stderrPipe;
+    std::unique_ptr<OutputRelay> outputRelay;
+    std::unique_ptr<SharedMemoryChild> sharedMemoryChild;
+    pid_t pid = -1;
+    // The pidfd of the child, if supported by the kernel (Linux 5.3+).
+    int pidfd = -1;
+    std::unique_ptr<TimeLimitWatcher> timeLimitWatcher;
+    std::unique_ptr<MemoryLimitWatcher> memoryLimitWatcher;
+    std::unique_ptr<MemoryUsageSampler> memoryUsageSampler;
+    // Cached for the lifetime of the process; null for none.
+    const SeccompProfile *seccompProfile = nullptr;
+    std::unique_ptr<SeccompWatcher> seccompWatcher;
+    // The root the child joins instead of mounting its own, if one can be used; see MountTemplate.
+    std::shared_ptr<const MountTemplate> mountTemplate;
+    // cgroup v1 only; the groups whose stats are cleared on release, and read when reaping.
+    std::unique_ptr<CgroupHandle> memoryGroup, cpuGroup;
+    // cgroup v2 only; the single group of the sandbox.
+    std::unique_ptr<CgroupHandle> group;
+    // In nanoseconds. cgroup v2 can't reset the CPU usage, so it's counted from the release.
+    int64_t cpuBaseline = 0;
+    // The scratch mounts to copy out after the sandbox has exited, opened while the child is still trusted,
+    // which keeps them alive after the mount namespace is gone; and where to copy them.
+    vector<std::pair<int, fs::path>> copyOuts;
+
+    ExecutionParameter(const SandboxParameter &param, int pipeOptions, bool deferRun, const ExecArena *arena) : parameter(param),
+                                                                                        cgroupName(param.cgroupName),
+                                                                                        timeLimit(param.timeLimit),
+                                                                                        outputLimit(param.outputLimit),
+                                                                                        relaysOutput(param.outputLimit >= 0 || param.compareMode != COMPARE_NONE),
+                                                                                        compareMode(param.compareMode),
+                                                                                        compareEpsilon(param.compareEpsilon),
+                                                                                        stopOnMismatch(param.stopOnMismatch),
+                                                                                        expectedOutput(param.expectedOutput),
+                                                                                        memoryHigh(IsCgroupV2() ? param.memoryHigh : -1),
+                                                                                        redirectBeforeChroot(param.redirectBeforeChroot),
+                                                                                        deferRun(deferRun),
+                                                                                        sharesMemory(!deferRun && IsCgroupV2() && SharedMemoryChild::IsSupported()),
+                                                                                        pipefd(pipeOptions)
+    {
+        if (arena != nullptr)
+        {
+            execArguments = arena->Arguments();
+            execEnvironment = arena->Environment();
+        }
+        else if (sharesMemory)
+        {
+            ownArguments = StringToPtr(param.executableParameters);
+            ownEnvironment = StringToPtr(param.environmentVariables);
+            execArguments = ownArguments.data();
+            execEnvironment = ownEnvironment.data();
+        }
+        if (!param.seccompProfile.empty())
+        {
+            // Compiled here, before cloning, if not yet.
+            seccompProfile = &GetSeccompProfile(param.seccompProfile);
+        }
+        // Likewise built here on first use.
+        int64_t mountStart = TelemetryNow();
+        mountTemplate = GetMountTemplate(param);
+        RecordPhase(PHASE_MOUNT, mountStart);
+        if (compareMode != COMPARE_NONE && !deferRun)
+        {
+            comparator = std::make_unique<OutputComparator>(expectedOutput, compareMode, compareEpsilon);
+        }
+        if (deferRun || relaysOutput || HasSeccompListener())
+        {
+            runChannel = std::make_unique<UnixSocketPair>(SOCK_CLOEXEC);
+        }
+        if (relaysOutput)
+        {
+            // Not non-blocking, since the write ends become the stdout and stderr of the sandbox.
+            stdoutPipe = std::make_unique<PosixPipe>(O_CLOEXEC);
+            stderrPipe = std::make_unique<PosixPipe>(O_CLOEXEC);
+            ENSURE(fcntl((*stdoutPipe)[0], F_SETFL, O_NONBLOCK));
+            ENSURE(fcntl((*stderrPipe)[0], F_SETFL, O_NONBLOCK));
+        }
+        continueEvent = ENSURE(eventfd(0, EFD_CLOEXEC));
+    }
+
+    bool HasSeccompListener() const
+    {
+        return seccompProfile != nullptr && seccompProfile->notifies;
+    }
 
-    ExecutionParameter(const SandboxParameter &param, int pipeOptions) : parameter(param),
-                                                                         semaphore1(true, 0),
-                                                                         semaphore2(true, 0),
-                                                                         pipefd(pipeOptions)
+    ~ExecutionParameter()
     {
+        // The child may be still using our memory, including this.
+        sharedMemoryChild.reset();
+        // The watchers and the relay may be using the pidfd.
+        timeLimitWatcher.reset();
+        memoryLimitWatcher.reset();
+        memoryUsageSampler.reset();
+        seccompWatcher.reset();
+        outputRelay.reset();
+        if (pidfd != -1)
+        {
+            (void)close(pidfd);
+        }
+        if (continueEvent != -1)
+        {
+            (void)close(continueEvent);
+        }
+        for (auto &item : copyOuts)
+        {
+            (void)close(item.first);
+        }
     }
 };
 
-static void EnsureDirectoryExistance(fs::path dir) {
-    if (!fs::exists(dir))
+// Runs in the parent. Each redirection is sent either as a path to be opened by the child,
+// or as a file descriptor passed along with the message.
+static void SendRunParameter(ExecutionParameter &execParam, const SandboxRunParameter &run)
+{
+    vector<char> data;
+    vector<int> fds, openedFds;
+
+    PutString(data, run.executable);
+    PutStringArray(data, run.executableParameters);
+    PutStringArray(data, run.environmentVariables);
+
+    auto putRedirection = [&](const string &path, int fd, int flags) {
+        if (fd == -1 && path != "" && execParam.redirectBeforeChroot)
+        {
+            fd = ENSURE(open(path.c_str(), flags | O_CLOEXEC, S_IWUSR | S_IRUSR | S_IRGRP | S_IWGRP));
+            openedFds.push_back(fd);
+        }
+        if (fd != -1)
+        {
+            PutString(data, "fd");
+            fds.push_back(fd);
+        }
+        else
+        {
+            PutString(data, "path");
+            PutString(data, path);
+        }
+        return fd;
+    };
+
+    try
+    {
+        putRedirection(run.stdinRedirection, run.stdinRedirectionFileDescriptor, O_RDONLY);
+        int outputfd = putRedirection(run.stdoutRedirection, run.stdoutRedirectionFileDescriptor, O_WRONLY | O_TRUNC | O_CREAT);
+        if (run.stderrRedirectionFileDescriptor == -1 && run.stderrRedirection != "" &&
+            run.stderrRedirection == run.stdoutRedirection && outputfd != -1)
+        {
+            // Don't truncate the file opened for stdout again.
+            putRedirection("", outputfd, 0);
+        }
+        else
+        {
+            putRedirection(run.stderrRedirection, run.stderrRedirectionFileDescriptor, O_WRONLY | O_TRUNC | O_CREAT);
+        }
+
+        SendMessage((*execParam.runChannel)[0], data, fds);
+    }
+    catch (...)
+    {
+        for (int fd : openedFds)
+            (void)close(fd);
+        throw;
+    }
+    for (int fd : openedFds)
+        (void)close(fd);
+}
+
+// Runs in the child.
+static void ReceiveRunParameter(ExecutionParameter &execParam, SandboxParameter &parameter)
+{
+    vector<char> data;
+    vector<int> fds;
+    ReceiveMessage((*execParam.runChannel)[1], data, fds);
+
+    size_t position = 0, fdIndex = 0;
+    parameter.executable = GetString(data, position);
+    parameter.executableParameters = GetStringArray(data, position);
+    parameter.environmentVariables = GetStringArray(data, position);
+
+    auto getRedirection = [&](string &path, int &fd) {
+        path = "";
+        fd = -1;
+        if (GetString(data, position) == "fd")
+        {
+            if (fdIndex >= fds.size())
+            {
+                throw std::runtime_error("Malformed run parameter.");
+            }
+            fd = fds[fdIndex++];
+        }
+        else
+        {
+            path = GetString(data, position);
+        }
+    };
+    getRedirection(parameter.stdinRedirection, parameter.stdinRedirectionFileDescriptor);
+    getRedirection(parameter.stdoutRedirection, parameter.stdoutRedirectionFileDescriptor);
+    getRedirection(parameter.stderrRedirection, parameter.stderrRedirectionFileDescriptor);
+}
+
+// In the child, right after redirecting IO. Hand our stdout and stderr, as opened by RedirectIO, over to the parent,
+// which relays the output there (see OutputRelay), and write to the pipes instead.
+static void HandOverOutput(ExecutionParameter &execParam)
+{
+    SendMessage((*execParam.runChannel)[1], {}, {STDOUT_FILENO, STDERR_FILENO});
+    ENSURE(dup2((*execParam.stdoutPipe)[1], STDOUT_FILENO));
+    ENSURE(dup2((*execParam.stderrPipe)[1], STDERR_FILENO));
+}
+
+// In the parent. Take the stdout and stderr handed over by the child, and start relaying its output there.
+static void ReceiveOutput(ExecutionParameter &execParam)
+{
+    vector<char> data;
+    vector<int> fds;
+    ReceiveMessage((*execParam.runChannel)[0], data, fds);
+    if (fds.size() != 2)
+    {
+        for (int fd : fds)
+            (void)close(fd);
+        throw std::runtime_error("The child process has handed over a malformed output.");
+    }
+
+    int stdoutPipe = execParam.stdoutPipe->Release(0), stderrPipe = execParam.stderrPipe->Release(0);
+    execParam.outputRelay = std::make_unique<OutputRelay>(execParam.pid, execParam.pidfd, execParam.outputLimit,
+                                                          vector<OutputRelay::Stream>{{stdoutPipe, fds[0]}, {stderrPipe, fds[1]}},
+                                                          std::move(execParam.comparator), execParam.stopOnMismatch);
+}
+
+// In the parent. Take the listener of the seccomp filter installed by the child, and watch it.
+static void ReceiveSeccompListener(ExecutionParameter &execParam)
+{
+    vector<char> data;
+    vector<int> fds;
+    ReceiveMessage((*execParam.runChannel)[0], data, fds);
+    if (fds.size() != 1)
+    {
+        for (int fd : fds)
+            (void)close(fd);
+        throw std::runtime_error("The child process has handed over a malformed seccomp listener.");
+    }
+    execParam.seccompWatcher = std::make_unique<SeccompWatcher>(execParam.pid, execParam.pidfd, fds[0], *execParam.seccompProfile);
+}
+
+// How long the child may take to set up, or to respond once let go, in milliseconds.
+// It's only a safeguard against a hung child: with a pidfd, its exit is noticed right away.
+const int childTimeout = 5000;
+
+// CLOCK_MONOTONIC, in milliseconds.
+static int64_t MonotonicMilliseconds()
+{
+    timespec now;
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Poll `fds` until any of them is ready, or `timeout` milliseconds have passed on the monotonic clock,
+// so that neither signals nor changes to the system time cut the wait short. Returns false on timeout.
+// It may be waiting for a child running in our memory (see SharedMemoryChild), which shares our malloc cache and `errno`,
+// so it allocates nothing and doesn't read `errno`: a failed `poll` (EINTR, as the `fds` are valid) is retried until the deadline.
+static bool PollWithDeadline(pollfd *fds, nfds_t count, int timeout)
+{
+    int64_t deadline = MonotonicMilliseconds() + timeout;
+    while (true)
+    {
+        int64_t remaining = deadline - MonotonicMilliseconds();
+        if (remaining <= 0)
+            return false;
+        if (poll(fds, count, remaining) > 0)
+            return true;
+    }
+}
+
+// In the parent. Read the error message of `length` bytes reported by the child, after the length itself.
+static string ReadChildError(ExecutionParameter &execParam, int length)
+{
+    vector<char> buf(length);
+    ENSURE(read(execParam.pipefd[0], &*buf.begin(), length));
+    string errstr(buf.begin(), buf.end());
+    return format("The child process has reported the following error: {}", errstr);
+}
+
+// In the parent. Wait until the child has reported that it's set up, or, if `channel` is given, sent a message on it.
+// Throws the error reported by the child instead, or if it has exited without any (seen with its pidfd), or doesn't respond.
+static void WaitForChild(ExecutionParameter &execParam, int channel = -1)
+{
+    // Nothing is allocated (nor `errno` read) until the child has reported, or is out of our memory; see PollWithDeadline.
+    pollfd fds[3] = {{execParam.pipefd[0], POLLIN, 0}, {channel, POLLIN, 0}, {execParam.pidfd, POLLIN, 0}};
+    bool responded = PollWithDeadline(fds, 3, childTimeout);
+    if (responded && (fds[1].revents & POLLIN))
+    {
+        return;
+    }
+    // Either the pipe is readable, or the child has exited, so this doesn't fail while it's running.
+    int errLen = 0;
+    bool reported = responded && read(execParam.pipefd[0], &errLen, sizeof(int)) == sizeof(int);
+    if (reported && errLen == -1) // -1 indicates OK.
+    {
+        return;
+    }
+
+    if (execParam.sharedMemoryChild)
     {
-        throw std::runtime_error((format("The specified path {} does not exist.", dir)));
+        // Unless it has parked, the child may be still running in our memory, so it must be gone before we go on.
+        execParam.sharedMemoryChild.reset();
     }
-    if (!fs::is_directory(dir))
+    if (!responded)
     {
-        throw std::runtime_error((format("The specified path {} exists, but is not a directory.", dir)));
+        throw std::runtime_error("The child process is not responding.");
     }
+    if (!reported)
+    {
+        throw std::runtime_error("The child process has exited unexpectedly.");
+    }
+    // The message may not be written completely yet; the child exits right after it is.
+    siginfo_t info;
+    (void)waitid(P_PID, execParam.pid, &info, WEXITED | WNOWAIT);
+    throw std::runtime_error(ReadChildError(execParam, errLen));
+}
+
+// In the child. Report that we are set up, and wait until the parent lets us go.
+static void ReportReady(ExecutionParameter &execParam)
+{
+    int ready = -1;
+    ENSURE(write(execParam.pipefd[1], &ready, sizeof(int)));
+    uint64_t value;
+    ssize_t result;
+    do
+    {
+        result = read(execParam.continueEvent, &value, sizeof(value));
+    } while (result == -1 && errno == EINTR);
+    ENSURE(result);
 }
 
 void GetUserEntryInSandbox(const fs::path &rootfs, const std::string username, std::vector<char> &dataBuffer, passwd &entry) {
@@ -161,13 +527,27 @@ void GetUserEntryInSandbox(const fs::path &rootfs, const std::string username, s
 static int ChildProcess(void *param_ptr)
 {
     ExecutionParameter &execParam = *reinterpret_cast<ExecutionParameter *>(param_ptr);
-    // We obtain a full copy of parameters here. The arguments may be destoryed after some time.
-    SandboxParameter parameter = execParam.parameter;
+    // Only a deferred child needs a copy of the parameters, which it updates with those of the run.
+    // Otherwise they are used in place: a child of its own has its own copy of our memory already,
+    // and for a child in our memory, they are kept until it has exec'd, and not modified either.
+    std::optional<SandboxParameter> copy;
+    if (execParam.deferRun)
+    {
+        copy.emplace(execParam.parameter);
+    }
+    const SandboxParameter &parameter = copy ? *copy : execParam.parameter;
 
     try
     {
         ENSURE(close(execParam.pipefd[0]));
 
+        if (execParam.deferRun)
+        {
+            // Don't stay parked forever if our parent dies.
+            // This is reset once we drop privileges, so the released sandbox is not affected.
+            ENSURE(prctl(PR_SET_PDEATHSIG, SIGKILL));
+        }
+
         if (!execParam.parameter.cpuAffinity.empty()) {
             cpu_set_t mask;
             CPU_ZERO(&mask);
@@ -177,49 +557,61 @@ static int ChildProcess(void *param_ptr)
         }
 
         int nullfd = ENSURE(open("/dev/null", O_RDWR));
-        if (parameter.redirectBeforeChroot)
+        // A deferred child doesn't know its IO yet.
+        if (parameter.redirectBeforeChroot && !execParam.deferRun)
         {
             RedirectIO(parameter, nullfd);
+            if (execParam.relaysOutput)
+                HandOverOutput(execParam);
         }
 
-        ENSURE(mount("none", "/", NULL, MS_REC | MS_PRIVATE, NULL)); // Make root private
-
-        EnsureDirectoryExistance(parameter.chrootDirectory);
-        ENSURE(mount(parameter.chrootDirectory.string().c_str(),
-                     parameter.chrootDirectory.string().c_str(), "", MS_BIND | MS_RDONLY | MS_REC, ""));
-        ENSURE(mount("", parameter.chrootDirectory.string().c_str(), "", MS_BIND | MS_REMOUNT | MS_RDONLY | MS_REC, ""));
-
-        for (MountInfo &info : parameter.mounts)
+        if (execParam.mountTemplate)
         {
-            if (!info.dst.is_absolute()) {
-                throw std::invalid_argument(format("The dst path {} in mounts should be absolute.", info.dst));
-            }
-
-            fs::path target = parameter.chrootDirectory / std::filesystem::relative(info.dst, "/");
-	    
-            EnsureDirectoryExistance(info.src);
-            EnsureDirectoryExistance(target);
-            ENSURE(mount(info.src.string().c_str(), target.string().c_str(), "", MS_BIND | MS_REC, ""));
-            if (info.limit == 0)
+            // The scratch mounts are copied out to their sources, which can't be seen from the template.
+            for (const MountInfo &info : parameter.mounts)
             {
-                ENSURE(mount("", target.string().c_str(), "", MS_BIND | MS_REMOUNT | MS_RDONLY | MS_REC, ""));
+                if (info.limit > 0)
+                {
+                    EnsureDirectoryExistance(info.src);
+                }
             }
-            else if (info.limit != -1)
+            // This puts us at its root as well.
+            ENSURE(setns(execParam.mountTemplate->fd, CLONE_NEWNS));
+            bool mountsAny = parameter.mountProc || std::any_of(parameter.mounts.begin(), parameter.mounts.end(),
+                                                                [](const MountInfo &info) { return info.limit > 0; });
+            // Root may mount after exec as well.
+            if (mountsAny || parameter.uid == 0)
             {
-                // TODO: implement.
+                // Of our own, since the template is shared.
+                ENSURE(unshare(CLONE_NEWNS));
+                MountScratches(parameter, "/");
             }
         }
-
-        ENSURE(chroot(parameter.chrootDirectory.string().c_str()));
+        else
+        {
+            MountRoot(parameter);
+            MountScratches(parameter, parameter.chrootDirectory);
+            ENSURE(chroot(parameter.chrootDirectory.string().c_str()));
+        }
         ENSURE(chdir(parameter.workingDirectory.string().c_str()));
 
         if (parameter.mountProc)
         {
             ENSURE(mount("proc", "/proc", "proc", 0, NULL));
         }
-        if (!parameter.redirectBeforeChroot)
+
+        if (execParam.deferRun)
+        {
+            // Park here until we are taken from the pool.
+            ReportReady(execParam);
+            ReceiveRunParameter(execParam, *copy);
+        }
+
+        if (!parameter.redirectBeforeChroot || execParam.deferRun)
         {
             RedirectIO(parameter, nullfd);
+            if (execParam.relaysOutput)
+                HandOverOutput(execParam);
         }
 
         if (!parameter.hostname.empty()) {
@@ -245,19 +637,32 @@ static int ChildProcess(void *param_ptr)
         ENSURE(syscall(SYS_setgroups, 1, groupList));
         ENSURE(syscall(SYS_setuid, parameter.uid));
 
-        vector<char *> params = StringToPtr(parameter.executableParameters),
-                       envi = StringToPtr(parameter.environmentVariables);
+        vector<char *> params, envi;
+        if (execParam.execArguments == nullptr)
+        {
+            params = StringToPtr(parameter.executableParameters);
+            envi = StringToPtr(parameter.environmentVariables);
+        }
+        char *const *arguments = execParam.execArguments != nullptr ? execParam.execArguments : params.data(),
+             *const *environment = execParam.execEnvironment != nullptr ? execParam.execEnvironment : envi.data();
 
-        int temp = -1;
-        // Inform the parent that no exception occurred.
-        ENSURE(write(execParam.pipefd[1], &temp, sizeof(int)));
+        if (execParam.seccompProfile != nullptr)
+        {
+            // The filter allows everything left to do before `execvpe`.
+            int listener = InstallSeccompProfile(*execParam.seccompProfile);
+            if (listener != -1)
+            {
+                SendMessage((*execParam.runChannel)[1], {}, {listener});
+                ENSURE(close(listener));
+            }
+        }
 
-        // Inform our parent that we are ready to go.
-        execParam.semaphore1.Post();
-        // Wait for parent's reply.
-        execParam.semaphore2.Wait();
+        if (!execParam.deferRun)
+        {
+            ReportReady(execParam);
+        }
 
-        ENSURE(execvpe(parameter.executable.c_str(), &params[0], &envi[0]));
+        ENSURE(execvpe(parameter.executable.c_str(), arguments, environment));
 
         // If execvpe returns, then we meet an error.
         return 1;
@@ -268,10 +673,10 @@ static int ChildProcess(void *param_ptr)
         int len = strlen(errMessage);
         try
         {
-            ENSURE(write(execParam.pipefd[1], &len, sizeof(int)));
-            ENSURE(write(execParam.pipefd[1], errMessage, len));
+            // In a single write, so the parent doesn't see the length without the message, unless it's very long.
+            iovec message[2] = {{&len, sizeof(int)}, {const_cast<char *>(errMessage), static_cast<size_t>(len)}};
+            ENSURE(writev(execParam.pipefd[1], message, 2));
             ENSURE(close(execParam.pipefd[1]));
-            execParam.semaphore1.Post();
             return 1;
         }
         catch (...)
@@ -285,85 +690,242 @@ static int ChildProcess(void *param_ptr)
     }
 }
 
-// The child stack is only used before `execvpe`, so it does not need much space.
-const int childStackSize = 1024 * 700;
-void *StartSandbox(const SandboxParameter &parameter,
-                   pid_t &container_pid)
+const int sandboxNamespaces = CLONE_NEWNET | CLONE_NEWUTS | CLONE_NEWPID;
+
+// A child joining a mount template doesn't need a copy of our mount namespace first.
+static int CloneFlags(const ExecutionParameter &execParam)
+{
+    return sandboxNamespaces | (execParam.mountTemplate ? 0 : CLONE_NEWNS);
+}
+
+// Clone the child right into the cgroup (cgroup v2 only), so it is never run outside.
+// If it shares our memory, it runs on a stack of its own; otherwise, like `fork`,
+// the child continues with a copy of our stack, so no stack needs to be allocated.
+static pid_t CloneIntoCgroup(ExecutionParameter &execParam, int cgroupfd)
+{
+    clone_args args = {};
+    args.flags = CloneFlags(execParam) | CLONE_INTO_CGROUP | CLONE_PIDFD;
+    args.pidfd = reinterpret_cast<uint64_t>(&execParam.pidfd);
+    args.exit_signal = SIGCHLD;
+    args.cgroup = cgroupfd;
+
+    if (execParam.sharesMemory)
+    {
+        execParam.sharedMemoryChild = std::make_unique<SharedMemoryChild>(args, ChildProcess, &execParam);
+        return execParam.sharedMemoryChild->Pid();
+    }
+
+    pid_t pid = ENSURE(syscall(SYS_clone3, &args, sizeof(args)));
+    if (pid == 0)
+    {
+        _exit(ChildProcess(&execParam));
+    }
+    return pid;
+}
+
+// Clone the child with its own copy of our memory (cgroup v1), on a stack from the pool,
+// which is free to be reused once we have returned, since the child runs on its copy.
+static pid_t CloneWithStack(ExecutionParameter &execParam)
+{
+    ChildStack stack;
+    void *top = static_cast<char *>(stack.Base()) + ChildStack::size;
+    // Linux 5.2+ returns the pidfd right away.
+    pid_t pid = clone(ChildProcess, top, CloneFlags(execParam) | CLONE_PIDFD | SIGCHLD, &execParam, &execParam.pidfd);
+    if (pid == -1 && errno == EINVAL)
+    {
+        execParam.pidfd = -1;
+        pid = clone(ChildProcess, top, CloneFlags(execParam) | SIGCHLD, &execParam);
+    }
+    return ENSURE(pid);
+}
+static int64_t CpuPeriod(const SandboxParameter &parameter)
+{
+    // The default of the kernel.
+    return parameter.cpuPeriod > 0 ? parameter.cpuPeriod : 100000;
+}
+
+// Confine the group to the CPUs of `parameter.cpuset`, with its memory on the given nodes or those local to the CPUs.
+static void SetCpuset(CgroupHandle &group, const SandboxParameter &parameter)
+{
+    if (!parameter.cpuset.empty())
+    {
+        group.Write("cpuset.cpus", FormatCpuList(parameter.cpuset));
+    }
+    vector<int> memoryNodes = parameter.memoryNodes.empty() && !parameter.cpuset.empty()
+                                  ? GetLocalMemoryNodes(parameter.cpuset)
+                                  : parameter.memoryNodes;
+    if (!memoryNodes.empty())
+    {
+        group.Write("cpuset.mems", FormatCpuList(memoryNodes));
+    }
+}
+
+void *PrepareSandbox(const SandboxParameter &parameter,
+                     pid_t &container_pid,
+                     bool deferRun,
+                     const ExecArena *arena)
 {
     container_pid = -1;
+    if (deferRun && arena != nullptr)
+    {
+        throw std::logic_error("A deferred sandbox takes its arguments from the run parameter.");
+    }
     try
     {
-        // char* childStack = new char[childStackSize];
-        std::vector<char> childStack(childStackSize); // I don't want to call `delete`
+        int64_t start = TelemetryNow();
+        std::unique_ptr<ExecutionParameter> execParam = std::make_unique<ExecutionParameter>(parameter, O_CLOEXEC | O_NONBLOCK, deferRun, arena);
+        RecordPhase(PHASE_SETUP, start);
 
-        std::unique_ptr<ExecutionParameter> execParam = std::make_unique<ExecutionParameter>(parameter, O_CLOEXEC | O_NONBLOCK);
+#define WRITE_WITH_CHECK(__where, __name, __value)          \
+    {                                                       \
+        if ((__value) >= 0)                                 \
+        {                                                   \
+            (__where).Write((__name), (__value));           \
+        }                                                   \
+        else                                                \
+        {                                                   \
+            (__where).Write((__name), string("max"));       \
+        }                                                   \
+    }
 
-        container_pid = ENSURE(clone(ChildProcess, &*childStack.end(),
-                                     CLONE_NEWNET | CLONE_NEWUTS | CLONE_NEWPID | CLONE_NEWNS | SIGCHLD,
-                                     const_cast<void *>(reinterpret_cast<const void *>(execParam.get()))));
+        if (IsCgroupV2())
+        {
+            // There is only one group, which is set up before the child is cloned right into it.
+            start = TelemetryNow();
+            CgroupInfo info("unified", parameter.cgroupName);
+            vector<string> controllers = {"memory", "pids"};
+            if (parameter.cpuQuota > 0)
+                controllers.push_back("cpu");
+            if (!parameter.cpuset.empty() || !parameter.memoryNodes.empty())
+                controllers.push_back("cpuset");
+            EnableControllers(info, controllers);
+            bool created = CreateGroup(info);
+            execParam->group = std::make_unique<CgroupHandle>(info);
+            CgroupHandle &group = *execParam->group;
+            if (!created)
+            {
+                int64_t killStart = TelemetryNow();
+                KillGroupMembers(group);
+                RecordPhase(PHASE_KILL_SCAN, killStart);
+            }
 
-        CgroupInfo memInfo("memory", parameter.cgroupName),
-            cpuInfo("cpuacct", parameter.cgroupName),
-            pidInfo("pids", parameter.cgroupName);
+            WRITE_WITH_CHECK(group, "memory.max", parameter.memoryLimit);
+            WRITE_WITH_CHECK(group, "memory.high", execParam->memoryHigh);
+            // Disallow swapping, so that `memory.max` limits the total usage as `memory.memsw.limit_in_bytes` does.
+            // Without swap accounting (CONFIG_MEMCG_SWAP, or `swapaccount=0`), there's nothing to disallow it with.
+            static const bool swapAccounted = group.Has("memory.swap.max");
+            if (swapAccounted)
+                group.Write("memory.swap.max", 0);
+            WRITE_WITH_CHECK(group, "pids.max", parameter.processLimit);
+            if (parameter.cpuQuota > 0)
+            {
+                group.Write("cpu.max", format("{} {}", parameter.cpuQuota, CpuPeriod(parameter)));
+            }
+            SetCpuset(group, parameter);
+            RecordPhase(PHASE_CGROUP, start);
 
-        vector<CgroupInfo *> infos = {&memInfo, &cpuInfo, &pidInfo};
-        for (auto &item : infos)
-        {
-            CreateGroup(*item);
-            KillGroupMembers(*item);
-            WriteGroupProperty(*item, "tasks", container_pid);
+            start = TelemetryNow();
+            container_pid = CloneIntoCgroup(*execParam, group.GetDirectory());
+            RecordPhase(PHASE_CLONE, start);
         }
+        else
+        {
+            start = TelemetryNow();
+            container_pid = CloneWithStack(*execParam);
+            RecordPhase(PHASE_CLONE, start);
 
-#define WRITE_WITH_CHECK(__where, __name, __value)                  \
-    {                                                               \
-        if ((__value) >= 0)                                         \
-        {                                                           \
-            WriteGroupProperty((__where), (__name), (__value));     \
-        }                                                           \
-        else                                                        \
-        {                                                           \
-            WriteGroupProperty((__where), (__name), string("max")); \
-        }                                                           \
-    }
+            start = TelemetryNow();
 
-        // Forcibly clear any memory usage by cache.
-        // WriteGroupProperty(memInfo, "memory.force_empty", 0); // This is too slow!!!!
-        WriteGroupProperty(memInfo, "memory.memsw.limit_in_bytes", -1);
-        WriteGroupProperty(memInfo, "memory.limit_in_bytes", -1);
-        WRITE_WITH_CHECK(memInfo, "memory.limit_in_bytes", parameter.memoryLimit);
-        WRITE_WITH_CHECK(memInfo, "memory.memsw.limit_in_bytes", parameter.memoryLimit);
-        WRITE_WITH_CHECK(pidInfo, "pids.max", parameter.processLimit);
+            CgroupInfo memInfo("memory", parameter.cgroupName),
+                cpuInfo("cpuacct", parameter.cgroupName),
+                pidInfo("pids", parameter.cgroupName);
 
-        // Wait for at most 500ms. If the child process hasn't posted the semaphore,
-        // We will assume that the child has already dead.
-        bool waitResult = execParam->semaphore1.TimedWait(500);
+            for (auto item : {&memInfo, &cpuInfo, &pidInfo})
+            {
+                CreateGroup(*item);
+            }
+            // Kept to clear the stats on release.
+            execParam->memoryGroup = std::make_unique<CgroupHandle>(memInfo);
+            execParam->cpuGroup = std::make_unique<CgroupHandle>(cpuInfo);
+            CgroupHandle pidGroup(pidInfo);
+            vector<CgroupHandle *> groups = {execParam->memoryGroup.get(), execParam->cpuGroup.get(), &pidGroup};
 
-        int errLen, bytesRead = read(execParam->pipefd[0], &errLen, sizeof(int));
-        // Child will be killed once the error has been thrown.
-        if (!waitResult || bytesRead == 0 || bytesRead == -1)
-        {
-            if (waitpid(container_pid, nullptr, WNOHANG) == 0)
+            // Only joined if needed, since they may not be mounted. Set up before the child is moved in.
+            std::unique_ptr<CgroupHandle> bandwidthGroup, cpusetGroup;
+            if (parameter.cpuQuota > 0)
             {
-                // The child process is still alive.
-                throw std::runtime_error("The child process is not responding.");
+                CgroupInfo bandwidthInfo("cpu", parameter.cgroupName);
+                CreateGroup(bandwidthInfo);
+                bandwidthGroup = std::make_unique<CgroupHandle>(bandwidthInfo);
+                bandwidthGroup->Write("cpu.cfs_period_us", CpuPeriod(parameter));
+                bandwidthGroup->Write("cpu.cfs_quota_us", parameter.cpuQuota);
+                groups.push_back(bandwidthGroup.get());
             }
-            // The child process exited with no information available.
-            throw std::runtime_error("The child process has exited unexpectedly.");
+            if (!parameter.cpuset.empty() || !parameter.memoryNodes.empty())
+            {
+                CgroupInfo cpusetInfo("cpuset", parameter.cgroupName);
+                CreateCpusetGroup(cpusetInfo);
+                cpusetGroup = std::make_unique<CgroupHandle>(cpusetInfo);
+                SetCpuset(*cpusetGroup, parameter);
+                groups.push_back(cpusetGroup.get());
+            }
+
+            int64_t killScan = 0;
+            for (auto group : groups)
+            {
+                int64_t killStart = TelemetryNow();
+                KillGroupMembers(*group);
+                killScan += TelemetryNow() - killStart;
+                group->Write("tasks", container_pid);
+            }
+            // All the groups as one.
+            RecordPhase(PHASE_KILL_SCAN, TelemetryNow() - killScan);
+
+            CgroupHandle &memGroup = *execParam->memoryGroup;
+            // Forcibly clear any memory usage by cache.
+            // memGroup.Write("memory.force_empty", 0); // This is too slow!!!!
+            memGroup.Write("memory.memsw.limit_in_bytes", -1);
+            memGroup.Write("memory.limit_in_bytes", -1);
+            WRITE_WITH_CHECK(memGroup, "memory.limit_in_bytes", parameter.memoryLimit);
+            WRITE_WITH_CHECK(memGroup, "memory.memsw.limit_in_bytes", parameter.memoryLimit);
+            WRITE_WITH_CHECK(pidGroup, "pids.max", parameter.processLimit);
+            RecordPhase(PHASE_CGROUP, start);
         }
-        else if (errLen != -1) // -1 indicates OK.
+        execParam->pid = container_pid;
+
+        // Child will be killed once the error has been thrown.
+        start = TelemetryNow();
+        WaitForChild(*execParam);
+        RecordPhase(PHASE_HANDSHAKE, start);
+
+        if (execParam->relaysOutput)
         {
-            vector<char> buf(errLen);
-            ENSURE(read(execParam->pipefd[0], &*buf.begin(), errLen));
-            string errstr(buf.begin(), buf.end());
-            throw std::runtime_error((format("The child process has reported the following error: {}", errstr)));
+            // Only the sandbox may hold the write ends, so that the pipes are at EOF once it's gone.
+            // Not before the child is set up, since a child in our memory would see them closed as well.
+            execParam->stdoutPipe->Close(1);
+            execParam->stderrPipe->Close(1);
+        }
+        if (execParam->relaysOutput && !deferRun)
+        {
+            // The child has handed the output over before reporting OK.
+            ReceiveOutput(*execParam);
+        }
+        if (execParam->HasSeccompListener() && !deferRun)
+        {
+            // And the listener as well.
+            ReceiveSeccompListener(*execParam);
         }
 
-        // Clear usage stats.
-        WriteGroupProperty(memInfo, "memory.memsw.max_usage_in_bytes", 0);
-        WriteGroupProperty(cpuInfo, "cpuacct.usage", 0);
-
-        // Continue the child.
-        execParam->semaphore2.Post();
+        for (const MountInfo &info : parameter.mounts)
+        {
+            if (info.limit > 0 && info.copyOut)
+            {
+                // The child has chrooted, but not run anything yet.
+                fs::path target = fs::path(format("/proc/{}/root", container_pid)) / fs::relative(info.dst, "/");
+                int fd = ENSURE(open(target.string().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+                execParam->copyOuts.emplace_back(fd, info.src);
+            }
+        }
 
         return execParam.release();
     }
@@ -372,6 +934,7 @@ void *StartSandbox(const SandboxParameter &parameter,
         // Do the cleanups; we don't care whether these operations are successful.
         if (container_pid != -1)
         {
+            // With cgroup v2, the pidfd is gone with the execution parameter, but the PID is not reaped yet.
             (void)kill(container_pid, SIGKILL);
             (void)waitpid(container_pid, NULL, WNOHANG);
         }
@@ -379,23 +942,217 @@ void *StartSandbox(const SandboxParameter &parameter,
     }
 }
 
-ExecutionResult
-WaitForProcess(pid_t pid, void *executionParameter)
+void ReleaseSandbox(void *executionParameter, const SandboxRunParameter *run)
+{
+    int64_t start = TelemetryNow();
+    ExecutionParameter *execParam = reinterpret_cast<ExecutionParameter *>(executionParameter);
+    if (execParam->deferRun != (run != nullptr))
+    {
+        throw std::invalid_argument("A run parameter must be given iff the sandbox is prepared with deferRun.");
+    }
+    if (run != nullptr && !run->expectedOutput.empty() && execParam->compareMode == COMPARE_NONE)
+    {
+        throw std::invalid_argument("An expected output is given without a comparison mode.");
+    }
+    if (run != nullptr && execParam->compareMode != COMPARE_NONE)
+    {
+        execParam->comparator = std::make_unique<OutputComparator>(
+            run->expectedOutput.empty() ? execParam->expectedOutput : run->expectedOutput,
+            execParam->compareMode, execParam->compareEpsilon);
+    }
+
+    // Clear usage stats.
+    // cgroup v2 doesn't allow this, so the CPU usage is counted from here, and the peak memory
+    // includes the setup of the child (a few hundred KB).
+    if (IsCgroupV2())
+    {
+        execParam->cpuBaseline = execParam->group->ReadKey("cpu.stat", "usage_usec") * 1000;
+    }
+    else
+    {
+        execParam->memoryGroup->Write("memory.memsw.max_usage_in_bytes", 0);
+        execParam->cpuGroup->Write("cpuacct.usage", 0);
+    }
+
+    if (execParam->timeLimit >= 0)
+    {
+        execParam->timeLimitWatcher = std::make_unique<TimeLimitWatcher>(execParam->pid, execParam->pidfd,
+                                                                         execParam->cgroupName, execParam->timeLimit);
+    }
+    execParam->memoryUsageSampler = std::make_unique<MemoryUsageSampler>(execParam->cgroupName);
+    if (execParam->memoryHigh >= 0)
+    {
+        execParam->memoryLimitWatcher = std::make_unique<MemoryLimitWatcher>(execParam->pid, execParam->pidfd,
+                                                                             execParam->cgroupName, execParam->memoryHigh);
+    }
+
+    if (run != nullptr && !run->cpuAffinity.empty())
+    {
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        for (auto cpu : run->cpuAffinity)
+            CPU_SET(cpu, &mask);
+        ENSURE(sched_setaffinity(execParam->pid, sizeof(cpu_set_t), &mask));
+    }
+
+    // Continue the child.
+    uint64_t value = 1;
+    ENSURE(write(execParam->continueEvent, &value, sizeof(value)));
+    RecordPhase(PHASE_RELEASE, start);
+    if (execParam->sharedMemoryChild)
+    {
+        // Like vfork, we are blocked until the child has left our memory; the error (if any) is reported on waiting.
+        start = TelemetryNow();
+        execParam->sharedMemoryChild->WaitForExec();
+        execParam->sharedMemoryChild.reset();
+        RecordPhase(PHASE_EXEC, start);
+    }
+
+    if (run != nullptr)
+    {
+        SendRunParameter(*execParam, *run);
+
+        if (execParam->relaysOutput)
+        {
+            // The child is opening its stdout and stderr now. Wait for them, or for the error if it fails.
+            WaitForChild(*execParam, (*execParam->runChannel)[0]);
+            ReceiveOutput(*execParam);
+        }
+        if (execParam->HasSeccompListener())
+        {
+            WaitForChild(*execParam, (*execParam->runChannel)[0]);
+            ReceiveSeccompListener(*execParam);
+        }
+    }
+}
+
+void DestroySandbox(pid_t pid, void *executionParameter)
 {
     std::unique_ptr<ExecutionParameter> execParam(reinterpret_cast<ExecutionParameter *>(executionParameter));
+    if (execParam->pidfd != -1)
+    {
+        (void)syscall(SYS_pidfd_send_signal, execParam->pidfd, SIGKILL, nullptr, 0);
+    }
+    else
+    {
+        (void)kill(pid, SIGKILL);
+    }
+    (void)waitpid(pid, nullptr, 0);
+}
+
+void RemoveSandboxCgroups(const string &cgroupName)
+{
+    if (IsCgroupV2())
+    {
+        RemoveCgroup(CgroupInfo("unified", cgroupName));
+        return;
+    }
+
+    for (auto controller : {"memory", "cpuacct", "pids"})
+    {
+        RemoveCgroup(CgroupInfo(controller, cgroupName));
+    }
+    // Only created if the sandbox is limited by them; `cpu` may also be mounted together with `cpuacct`.
+    for (auto controller : {"cpu", "cpuset"})
+    {
+        CgroupInfo info(controller, cgroupName);
+        if (GroupExists(info))
+        {
+            RemoveCgroup(info);
+        }
+    }
+}
+
+void *StartSandbox(const SandboxParameter &parameter,
+                   pid_t &container_pid,
+                   const ExecArena *arena)
+{
+    void *execParam = PrepareSandbox(parameter, container_pid, false, arena);
+    try
+    {
+        ReleaseSandbox(execParam);
+    }
+    catch (...)
+    {
+        DestroySandbox(container_pid, execParam);
+        container_pid = -1;
+        throw;
+    }
+    return execParam;
+}
+
+// `maxResidentSetSize` is `ru_maxrss` of the reaped sandbox, in bytes.
+static void ReadSandboxUsage(ExecutionParameter &execParam, int64_t maxResidentSetSize, SandboxUsage &usage)
+{
+    int64_t totalPeak;
+    if (IsCgroupV2())
+    {
+        CgroupHandle &group = *execParam.group;
+        usage.time = group.ReadKey("cpu.stat", "usage_usec") * 1000 - execParam.cpuBaseline;
+        // `memory.peak` is there since Linux 5.19; before, the sampled and the reported peaks are taken as they are.
+        static const bool peakTracked = group.Has("memory.peak");
+        totalPeak = peakTracked ? group.Read("memory.peak") : std::numeric_limits<int64_t>::max();
+        usage.oomKilled = group.ReadKey("memory.events", "oom_kill") > 0;
+    }
+    else
+    {
+        usage.time = execParam.cpuGroup->Read("cpuacct.usage");
+        totalPeak = execParam.memoryGroup->Read("memory.memsw.max_usage_in_bytes");
+        usage.oomKilled = false;
+    }
+
+    // The sampler keeps sampling until here, where the sandbox has exited.
+    int64_t residentPeak = 0;
+    usage.memoryPeaks = {};
+    if (execParam.memoryUsageSampler)
+    {
+        execParam.memoryUsageSampler->Stop();
+        usage.memoryPeaks = execParam.memoryUsageSampler->Peaks();
+        residentPeak = execParam.memoryUsageSampler->ResidentPeak();
+    }
+    usage.memory = std::min(totalPeak, std::max(residentPeak, maxResidentSetSize));
+}
 
+// Reap a sandbox that has exited, which doesn't block, and free its execution parameter.
+static ExecutionResult ReapProcess(pid_t pid, std::unique_ptr<ExecutionParameter> execParam)
+{
     ExecutionResult result;
     int status;
-    ENSURE(waitpid(pid, &status, 0));
+    // Stop watching before the PID is reaped and may be reused.
+    result.timeLimitExceeded = execParam->timeLimitWatcher && execParam->timeLimitWatcher->Exceeded();
+    execParam->timeLimitWatcher.reset();
+    result.memoryLimitExceeded = execParam->memoryLimitWatcher && execParam->memoryLimitWatcher->Exceeded();
+    execParam->memoryLimitWatcher.reset();
+    if (execParam->seccompWatcher)
+    {
+        result.killedSyscall = execParam->seccompWatcher->KilledSyscall();
+        execParam->seccompWatcher.reset();
+    }
+    result.outputLimitExceeded = false;
+    result.mismatchOffset = -1;
+    result.killedOnMismatch = false;
+    if (execParam->outputRelay)
+    {
+        execParam->outputRelay->Finish();
+        result.outputLimitExceeded = execParam->outputRelay->Exceeded();
+        result.mismatchOffset = execParam->outputRelay->MismatchOffset();
+        result.killedOnMismatch = execParam->outputRelay->KilledOnMismatch();
+        execParam->outputRelay.reset();
+    }
+    ENSURE(wait4(pid, &status, 0, &result.resourceUsage));
+    // All processes in the PID namespace have exited with its init, so the usage is final.
+    ReadSandboxUsage(*execParam, result.resourceUsage.ru_maxrss * 1024, result.usage);
 
     // Try reading error message first
     int errLen, bytesRead = read(execParam->pipefd[0], &errLen, sizeof(int));
     if (bytesRead > 0)
     {
-        vector<char> buf(errLen);
-        ENSURE(read(execParam->pipefd[0], &*buf.begin(), errLen));
-        string errstr(buf.begin(), buf.end());
-        throw std::runtime_error((format("The child process has reported the following error: {}", errstr)));
+        throw std::runtime_error(ReadChildError(*execParam, errLen));
+    }
+
+    for (auto &item : execParam->copyOuts)
+    {
+        CopyScratch(item.first, item.second);
     }
 
     if (WIFEXITED(status))
@@ -410,3 +1167,67 @@ WaitForProcess(pid_t pid, void *executionParameter)
     }
     return result;
 }
+
+ExecutionResult
+WaitForProcess(pid_t pid, void *executionParameter)
+{
+    std::unique_ptr<ExecutionParameter> execParam(reinterpret_cast<ExecutionParameter *>(executionParameter));
+
+    siginfo_t info;
+    ENSURE(waitid(P_PID, pid, &info, WEXITED | WNOWAIT));
+    return ReapProcess(pid, std::move(execParam));
+}
+
+void WaitForProcessAsync(pid_t pid, void *executionParameter, WaitCallback callback)
+{
+    ExecutionParameter *execParam = reinterpret_cast<ExecutionParameter *>(executionParameter);
+
+    auto reap = [pid, callback](std::unique_ptr<ExecutionParameter> execParam, bool wait) {
+        ExecutionResult result;
+        string error;
+        try
+        {
+            if (wait)
+            {
+                siginfo_t info;
+                ENSURE(waitid(P_PID, pid, &info, WEXITED | WNOWAIT));
+            }
+            result = ReapProcess(pid, std::move(execParam));
+        }
+        catch (std::exception &ex)
+        {
+            error = ex.what();
+        }
+        catch (...)
+        {
+            error = "Something unexpected occurred while waiting for process termiation";
+        }
+        callback(result, error);
+    };
+
+    if (execParam->pidfd == -1)
+    {
+        std::thread(reap, std::unique_ptr<ExecutionParameter>(execParam), true).detach();
+        return;
+    }
+
+    int pidfd = execParam->pidfd;
+    SandboxMonitor::Instance().Add(pidfd, EPOLLIN, [pid, pidfd, execParam, reap](uint32_t) {
+        siginfo_t info = {};
+        if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == 0)
+        {
+            // Not exited yet.
+            return;
+        }
+        // The pidfd is closed with the execution parameter.
+        SandboxMonitor::Instance().Remove(pidfd);
+        if (!execParam->copyOuts.empty() || execParam->outputRelay)
+        {
+            // Copying, or waiting for the destinations to take the rest of the output (see OutputRelay::Finish),
+            // may take a while; don't block the monitor thread.
+            std::thread(reap, std::unique_ptr<ExecutionParameter>(execParam), false).detach();
+            return;
+        }
+        reap(std::unique_ptr<ExecutionParameter>(execParam), false);
+    });
+}
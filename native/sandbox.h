@@ -2,20 +2,74 @@
 
 #include <string>
 #include <vector>
+#include <functional>
 #include <filesystem>
 #include <unistd.h>
 #include <pwd.h>
+#include <sys/resource.h>
 
 enum RunStatus {
     EXITED = 0, // App exited normally.
     SIGNALED = 01, // App is kill by some signal.
 };
 
+// How the stdout of a sandbox is compared with the expected output; see OutputComparator.
+enum CompareMode {
+    COMPARE_NONE = 0,
+    COMPARE_EXACT = 1,
+    COMPARE_LINES = 2, // Ignoring the whitespace at the end of lines.
+    COMPARE_TOKENS = 3,
+    COMPARE_FLOATING_POINT = 4,
+};
+
+// The peaks of each kind of memory charged to a sandbox, in bytes, sampled from `memory.stat` (see memoryusage.h).
+struct MemoryPeaks
+{
+    // Anonymous memory (`anon` with cgroup v2, `rss` with v1).
+    int64_t anon;
+    // The page cache, including `shmem` (`file` with cgroup v2, `cache` with v1).
+    int64_t file;
+    // tmpfs files (e.g. the scratch mounts), shm segments and shared anonymous mappings.
+    int64_t shmem;
+};
+
+// The resource usage of a sandbox, read from its cgroups.
+struct SandboxUsage
+{
+    // CPU time in nanoseconds, since the sandbox is released.
+    int64_t time;
+    // The peak memory usage in bytes, excluding the (reclaimable) page cache: the larger one of
+    // the sampled peak of anonymous plus shared memory, and the maximum RSS reported by `wait4`,
+    // which catches a single process that peaks between the samples; at most the total peak of the cgroup.
+    int64_t memory;
+    MemoryPeaks memoryPeaks;
+    // Whether the OOM killer has been triggered (cgroup v2 only).
+    bool oomKilled;
+};
+
 struct ExecutionResult
 {
     int status;
     // If exited, this is the exit code; if signaled, this is the signal number.
     int code;
+    // Whether the sandbox is killed for exceeding the time limit.
+    bool timeLimitExceeded;
+    // Whether the sandbox is killed for exceeding the output limit.
+    bool outputLimitExceeded;
+    // Whether the sandbox is killed for exceeding `memoryHigh`.
+    bool memoryLimitExceeded;
+    // If the stdout is compared (see `compareMode`), the offset in it where it first differs from the expected output,
+    // or -1 if it matches; always -1 otherwise.
+    int64_t mismatchOffset;
+    // Whether the sandbox is killed on the mismatch (`stopOnMismatch`).
+    bool killedOnMismatch;
+    // Read from the cgroups right after reaping.
+    SandboxUsage usage;
+    // Of the sandbox and all its descendants, as collected by `wait4` when reaping.
+    rusage resourceUsage;
+    // The name of the syscall the sandbox has been killed for by its seccomp profile, or an empty string.
+    // Only reported if the kernel supports SECCOMP_RET_USER_NOTIF (Linux 5.0+); otherwise the sandbox is just killed by SIGSYS.
+    std::string killedSyscall;
 };
 
 struct MountInfo
@@ -27,17 +81,31 @@ struct MountInfo
     std::filesystem::path dst;
     // The maximum length (in bytes) the sandboxed process may write to the mount.
     // 0 for readonly; -1 for no limit.
+    // If limited, an empty tmpfs of that size is mounted instead of `src` (see scratch.h),
+    // which is discarded with the sandbox unless `copyOut` is set.
     int64_t limit;
+    // For a limited mount, copy its content into `src` once the sandbox has exited.
+    bool copyOut;
 };
 
 struct SandboxParameter
 {
-    // Time limit is done by querying cpuacct cgroup every 100ms. This is done in the js code.
+    // CPU time limit in nanoseconds. -1 for no limit.
+    // This is enforced on the monitor thread; see TimeLimitWatcher for details.
+    int64_t timeLimit;
+    // The maximum count of bytes written to stdout and stderr in total. -1 for no limit.
+    // If limited, the sandbox writes to pipes instead, which are relayed to the redirections
+    // by the monitor thread; see OutputRelay for details.
+    int64_t outputLimit;
 
     int64_t stackSize;
     // Memory limit in bytes.
     // -1 for no limit.
     int64_t memoryLimit;
+    // cgroup v2 only; ignored with v1. If not -1, the sandbox is throttled at this usage in bytes (`memory.high`),
+    // which should be below `memoryLimit`, and killed as soon as its usage excluding the page cache exceeds it,
+    // as `memoryLimitExceeded`; see MemoryLimitWatcher.
+    int64_t memoryHigh;
     // The maximum child process count created by the executable. Typically less than 10. -1 for no limit.
     int processLimit;
     // Redirect stdin / stdout before chrooting.
@@ -50,6 +118,12 @@ struct SandboxParameter
     // This directory will be chrooted into (`chroot`) before running our binary.
     // Make sure this is not writable by `nobody` user!
     std::filesystem::path chrootDirectory;
+    // The maximum length (in bytes) the sandboxed process may write to its root filesystem.
+    // 0 for readonly; -1 for no limit.
+    // If not 0, an overlay is mounted on the chroot, with a tmpfs as its upper layer (see MountOverlay),
+    // and the targets of `mounts` are created if missing.
+    // Note that mounts under the chroot directory are not seen through the overlay.
+    int64_t chrootLimit;
     // This directory will be changed into (`chdir`) before running the binary.
     std::filesystem::path workingDirectory;
 
@@ -96,10 +170,88 @@ struct SandboxParameter
 
     // sched_setaffinity
     std::vector<int> cpuAffinity;
+
+    // The CPU bandwidth of the sandbox (all its threads and processes): at most `cpuQuota` microseconds of CPU time
+    // every `cpuPeriod` microseconds, i.e. `cpu.max` (cgroup v2) or `cpu.cfs_quota_us` and `cpu.cfs_period_us` (v1).
+    // E.g. a quota of twice the period allows 2 CPUs. -1 for no limit; a period of 0 for the default (100ms).
+    int64_t cpuQuota;
+    int64_t cpuPeriod;
+    // The CPUs (`cpuset.cpus`) and NUMA memory nodes (`cpuset.mems`) the sandbox is confined to,
+    // which can't be changed from inside, unlike `cpuAffinity`. Empty for no restriction.
+    // If only the CPUs are given, the memory is placed on the nodes local to them.
+    std::vector<int> cpuset;
+    std::vector<int> memoryNodes;
+
+    // The name of the seccomp profile to filter the syscalls of the sandbox with (see seccomp.h), e.g. "c/cpp".
+    // Empty for none.
+    std::string seccompProfile;
+
+    // If not COMPARE_NONE, the stdout of the sandbox is compared with the file `expectedOutput` as it's written,
+    // by the monitor thread, where it goes through a pipe as with `outputLimit`; it's still written to the redirection.
+    CompareMode compareMode;
+    std::filesystem::path expectedOutput;
+    // For COMPARE_FLOATING_POINT, the maximum absolute or relative error of a number.
+    double compareEpsilon;
+    // Kill the sandbox as soon as its output differs.
+    bool stopOnMismatch;
+};
+
+// The parameters that may vary between runs of a sandbox prepared with `deferRun` (see `SandboxPool`).
+// They override the corresponding fields in SandboxParameter; everything else is taken from the template.
+struct SandboxRunParameter
+{
+    std::string executable;
+    std::vector<std::string> executableParameters;
+    std::vector<std::string> environmentVariables;
+
+    // Same as the redirections in SandboxParameter.
+    // If the template has `redirectBeforeChroot` set, the files are opened by the parent
+    // (which is outside the chroot) and passed to the sandbox.
+    std::string stdinRedirection;
+    std::string stdoutRedirection;
+    std::string stderrRedirection;
+
+    int stdinRedirectionFileDescriptor;
+    int stdoutRedirectionFileDescriptor;
+    int stderrRedirectionFileDescriptor;
+
+    // If not empty, overrides the `cpuAffinity` of the template; set on the parked child before it's let go.
+    std::vector<int> cpuAffinity;
+    // If not empty, overrides the `expectedOutput` of the template, which must have a `compareMode`.
+    std::filesystem::path expectedOutput;
 };
 
 void GetUserEntryInSandbox(const std::filesystem::path &rootfs, const std::string username, std::vector<char> &dataBuffer, passwd &entry);
 
-void *StartSandbox(const SandboxParameter &, pid_t &);
+class ExecArena;
+
+// With an `arena` (see SandboxTemplate), its arguments and environment variables are used instead of those of the parameter.
+void *StartSandbox(const SandboxParameter &, pid_t &, const ExecArena *arena = nullptr);
+
+// StartSandbox is split into the following two steps.
+// PrepareSandbox clones the child, sets up its namespaces, mounts and cgroups, and leaves it waiting right before `execvpe`.
+// If `deferRun` is set, the child stops before redirecting IO and dropping privileges instead,
+// and takes the executable and its IO from the SandboxRunParameter passed to ReleaseSandbox.
+// Otherwise, the child may run in our memory (see SharedMemoryChild) and use the SandboxParameter in place,
+// so it must be kept until ReleaseSandbox has returned.
+// The `arena`, which must not be given with `deferRun`, must be kept until ReleaseSandbox has returned as well.
+void *PrepareSandbox(const SandboxParameter &, pid_t &, bool deferRun = false, const ExecArena *arena = nullptr);
+// Let a prepared sandbox go. `run` must be given iff the sandbox was prepared with `deferRun`.
+// Throws if the sandbox can't be started, in which case it should be cleaned with DestroySandbox.
+void ReleaseSandbox(void *executionParameter, const SandboxRunParameter *run = nullptr);
+// Kill and reap a prepared sandbox that is not going to be released. The cgroups are not removed.
+void DestroySandbox(pid_t pid, void *executionParameter);
+
+// Remove the cgroups created for a sandbox, i.e. the memory, cpuacct and pids ones with cgroup v1,
+// or the single one with cgroup v2.
+void RemoveSandboxCgroups(const std::string &cgroupName);
 
 ExecutionResult WaitForProcess(pid_t pid, void *executionParameter);
+
+// `error` is empty if the sandbox has been run; otherwise `result` is not valid.
+typedef std::function<void(const ExecutionResult &result, const std::string &error)> WaitCallback;
+
+// The same as WaitForProcess, but returns immediately. The sandbox is reaped on the monitor thread (see monitor.h)
+// once its pidfd becomes readable, and `callback` is called there; it shall not block.
+// Without pidfd (before Linux 5.3), a thread is started to wait for the sandbox instead.
+void WaitForProcessAsync(pid_t pid, void *executionParameter, WaitCallback callback);
@@ -0,0 +1,72 @@
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include "sandboxtemplate.h"
+
+using std::string;
+using std::vector;
+
+static size_t TotalLength(const vector<string> &strings)
+{
+    size_t length = 0;
+    for (const string &item : strings)
+        length += item.size() + 1;
+    return length;
+}
+
+ExecArena::ExecArena(const vector<string> &arguments, const vector<string> &environment)
+    : m_strings(TotalLength(arguments) + TotalLength(environment))
+{
+    // The block is never resized, so the pointers stay valid.
+    char *position = m_strings.data();
+    auto flatten = [&](const vector<string> &strings, vector<char *> &pointers) {
+        pointers.reserve(strings.size() + 1);
+        for (const string &item : strings)
+        {
+            pointers.push_back(position);
+            position = std::copy(item.begin(), item.end(), position);
+            *position++ = '\0';
+        }
+        pointers.push_back(nullptr);
+    };
+    flatten(arguments, m_arguments);
+    flatten(environment, m_environment);
+}
+
+char *const *ExecArena::Arguments() const
+{
+    return m_arguments.data();
+}
+
+char *const *ExecArena::Environment() const
+{
+    return m_environment.data();
+}
+
+SandboxTemplate::SandboxTemplate(SandboxParameter parameter)
+    : m_parameter(std::move(parameter)),
+      m_arena(m_parameter.executableParameters, m_parameter.environmentVariables),
+      m_expectedOutput(m_parameter.expectedOutput)
+{
+}
+
+const SandboxParameter &SandboxTemplate::Apply(const SandboxTemplateRun &run)
+{
+    // Assigned in place, reusing the storage of the strings of the last run.
+    m_parameter.cgroupName = run.cgroupName;
+    m_parameter.stdinRedirection = run.stdinRedirection;
+    m_parameter.stdoutRedirection = run.stdoutRedirection;
+    m_parameter.stderrRedirection = run.stderrRedirection;
+    m_parameter.stdinRedirectionFileDescriptor = run.stdinRedirectionFileDescriptor;
+    m_parameter.stdoutRedirectionFileDescriptor = run.stdoutRedirectionFileDescriptor;
+    m_parameter.stderrRedirectionFileDescriptor = run.stderrRedirectionFileDescriptor;
+    m_parameter.expectedOutput = run.expectedOutput.empty() ? m_expectedOutput : run.expectedOutput;
+    return m_parameter;
+}
+
+const ExecArena &SandboxTemplate::Arena() const
+{
+    return m_arena;
+}
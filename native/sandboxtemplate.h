@@ -0,0 +1,63 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <filesystem>
+
+#include "sandbox.h"
+
+// The arguments and environment variables of a sandbox, copied once into a single block,
+// with the null-terminated pointer arrays for `execvpe` built in advance.
+class ExecArena
+{
+  public:
+    ExecArena(const std::vector<std::string> &arguments, const std::vector<std::string> &environment);
+    ExecArena(const ExecArena &) = delete;
+    ExecArena &operator=(const ExecArena &) = delete;
+
+    char *const *Arguments() const;
+    char *const *Environment() const;
+
+  private:
+    std::vector<char> m_strings;
+    std::vector<char *> m_arguments, m_environment;
+};
+
+// What may differ between the sandboxes started from a SandboxTemplate.
+// The same as the corresponding fields of SandboxParameter.
+struct SandboxTemplateRun
+{
+    std::string cgroupName;
+
+    std::string stdinRedirection;
+    std::string stdoutRedirection;
+    std::string stderrRedirection;
+
+    int stdinRedirectionFileDescriptor;
+    int stdoutRedirectionFileDescriptor;
+    int stderrRedirectionFileDescriptor;
+
+    // If not empty, overrides the `expectedOutput` of the template.
+    std::filesystem::path expectedOutput;
+};
+
+// A SandboxParameter converted once, to start many sandboxes that differ only in their cgroups and IO,
+// e.g. for the test cases of a submission, without converting (and copying) the whole parameter for each of them.
+// Unlike a SandboxPool, nothing is prepared in advance; every sandbox is started as StartSandbox does.
+class SandboxTemplate
+{
+  public:
+    explicit SandboxTemplate(SandboxParameter parameter);
+    SandboxTemplate(const SandboxTemplate &) = delete;
+    SandboxTemplate &operator=(const SandboxTemplate &) = delete;
+
+    // Set the cgroup and IO of the next sandbox, and return the whole parameter for it.
+    // The parameter is overwritten by the next call; use a template on one thread at a time.
+    const SandboxParameter &Apply(const SandboxTemplateRun &run);
+    const ExecArena &Arena() const;
+
+  private:
+    SandboxParameter m_parameter;
+    ExecArena m_arena;
+    std::filesystem::path m_expectedOutput;
+};
@@ -0,0 +1,152 @@
+#include <set>
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+#include <condition_variable>
+
+#include <sched.h>
+
+#include <fmt/format.h>
+
+#include "scheduler.h"
+#include "utils.h"
+
+using std::string;
+using std::vector;
+using fmt::format;
+
+// The logical CPUs on the same physical core as `cpu`, including itself.
+static vector<int> GetSiblings(int cpu)
+{
+    std::ifstream file(format("/sys/devices/system/cpu/cpu{}/topology/thread_siblings_list", cpu));
+    string list;
+    if (!std::getline(file, list) || list.empty())
+    {
+        // No topology (e.g. in some VMs), so no SMT as far as we know.
+        return {cpu};
+    }
+    return ParseCpuList(list);
+}
+
+CoreScheduler::CoreScheduler(vector<int> cpus, bool isolateSiblings)
+{
+    cpu_set_t mask;
+    ENSURE(sched_getaffinity(0, sizeof(mask), &mask));
+    if (cpus.empty())
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &mask))
+                cpus.push_back(cpu);
+        }
+    }
+    std::sort(cpus.begin(), cpus.end());
+    cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+
+    std::set<int> taken;
+    for (int cpu : cpus)
+    {
+        if (cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &mask))
+        {
+            throw std::invalid_argument(format("CPU {} is not available.", cpu));
+        }
+        if (isolateSiblings)
+        {
+            // The lowest owned CPU of each core stands for it.
+            vector<int> siblings = GetSiblings(cpu);
+            if (std::any_of(siblings.begin(), siblings.end(), [&](int sibling) { return taken.count(sibling) != 0; }))
+                continue;
+        }
+        taken.insert(cpu);
+        m_cores.push_back(cpu);
+    }
+    if (m_cores.empty())
+    {
+        throw std::invalid_argument("No CPU to schedule the sandboxes on.");
+    }
+    m_busy.assign(m_cores.size(), false);
+}
+
+int CoreScheduler::TakeCore(Clock::time_point since)
+{
+    auto free = std::find(m_busy.begin(), m_busy.end(), false);
+    if (free == m_busy.end())
+    {
+        return -1;
+    }
+    *free = true;
+
+    Clock::duration waitTime = Clock::now() - since;
+    m_admitted++;
+    m_totalWaitTime += waitTime;
+    m_maxWaitTime = std::max(m_maxWaitTime, waitTime);
+    return m_cores[free - m_busy.begin()];
+}
+
+void CoreScheduler::Request(GrantCallback callback)
+{
+    int cpu;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        // Not ahead of those already waiting.
+        cpu = m_queue.empty() ? TakeCore(Clock::now()) : -1;
+        if (cpu == -1)
+        {
+            m_queue.push_back({std::move(callback), Clock::now()});
+            return;
+        }
+    }
+    callback(cpu);
+}
+
+int CoreScheduler::Acquire()
+{
+    std::mutex mutex;
+    std::condition_variable granted;
+    int result = -1;
+    Request([&](int cpu) {
+        std::lock_guard<std::mutex> lock(mutex);
+        result = cpu;
+        granted.notify_one();
+    });
+    std::unique_lock<std::mutex> lock(mutex);
+    granted.wait(lock, [&] { return result != -1; });
+    return result;
+}
+
+void CoreScheduler::Release(int cpu)
+{
+    GrantCallback callback;
+    int granted;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto core = std::find(m_cores.begin(), m_cores.end(), cpu);
+        if (core == m_cores.end() || !m_busy[core - m_cores.begin()])
+        {
+            throw std::invalid_argument(format("CPU {} has not been granted.", cpu));
+        }
+        m_busy[core - m_cores.begin()] = false;
+        if (m_queue.empty())
+        {
+            return;
+        }
+        granted = TakeCore(m_queue.front().since);
+        callback = std::move(m_queue.front().callback);
+        m_queue.pop_front();
+    }
+    callback(granted);
+}
+
+CoreSchedulerStats CoreScheduler::GetStats()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    CoreSchedulerStats stats;
+    stats.running = std::count(m_busy.begin(), m_busy.end(), true);
+    stats.cores = m_cores.size();
+    stats.queued = m_queue.size();
+    stats.admitted = m_admitted;
+    stats.totalWaitTime = std::chrono::duration_cast<std::chrono::nanoseconds>(m_totalWaitTime).count();
+    stats.maxWaitTime = std::chrono::duration_cast<std::chrono::nanoseconds>(m_maxWaitTime).count();
+    return stats;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <vector>
+#include <chrono>
+#include <functional>
+
+#include <cstdint>
+
+struct CoreSchedulerStats
+{
+    // The number of cores handed out, i.e. the sandboxes running, and the number of cores owned.
+    size_t running;
+    size_t cores;
+    // The number of requests waiting for a core.
+    size_t queued;
+    // The number of requests granted so far, and the total and maximum time they have waited, in nanoseconds.
+    uint64_t admitted;
+    int64_t totalWaitTime;
+    int64_t maxWaitTime;
+};
+
+// Owns a set of CPUs and hands each of them out to one sandbox at a time, so that no two timed runs share a core.
+// A sandbox is admitted only when a core is free; the other requests are queued, and granted in order
+// as the cores are released (i.e. when the sandboxes are reaped).
+// With `isolateSiblings`, only one logical CPU of each physical core is handed out, and its SMT siblings are kept idle,
+// so that a sandbox doesn't share the execution units (and the L1/L2 caches) of its core either.
+class CoreScheduler
+{
+  public:
+    // Called with the CPU granted; shall not block, since it may be called on the thread releasing a core.
+    typedef std::function<void(int)> GrantCallback;
+
+    // `cpus` are the logical CPUs owned, all those we may run on (sched_getaffinity) if empty.
+    CoreScheduler(std::vector<int> cpus, bool isolateSiblings);
+    CoreScheduler(const CoreScheduler &) = delete;
+    CoreScheduler &operator=(const CoreScheduler &) = delete;
+
+    // Call `callback` once a core is free: right away on this thread if one is, otherwise on the thread releasing it.
+    void Request(GrantCallback callback);
+    // The same as Request, but blocks until the core is granted, and returns it.
+    int Acquire();
+    // Give a granted core back, which goes to the first request in the queue, if any.
+    void Release(int cpu);
+
+    CoreSchedulerStats GetStats();
+
+  private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Waiter
+    {
+        GrantCallback callback;
+        Clock::time_point since;
+    };
+
+    // Called with the mutex held; -1 if no core is free.
+    int TakeCore(Clock::time_point since);
+
+    std::mutex m_mutex;
+    // The CPU handed out for each core, and whether it is.
+    std::vector<int> m_cores;
+    std::vector<bool> m_busy;
+    std::deque<Waiter> m_queue;
+
+    uint64_t m_admitted = 0;
+    Clock::duration m_totalWaitTime{0}, m_maxWaitTime{0};
+};
@@ -0,0 +1,142 @@
+#include <string>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+#include <sys/sendfile.h>
+
+#include <fmt/format.h>
+
+#include "scratch.h"
+#include "utils.h"
+
+using std::string;
+using fmt::format;
+namespace fs = std::filesystem;
+
+// Every file takes a page once it's written to, so this leaves room for a few empty files and directories only.
+const int64_t extraScratchInodes = 64;
+// Each level keeps a few file descriptors open while copying.
+const int maxScratchDepth = 128;
+
+// Closes a file descriptor on leaving the scope.
+class FileDescriptor
+{
+  public:
+    explicit FileDescriptor(int fd) : m_fd(fd) {}
+    ~FileDescriptor()
+    {
+        if (m_fd != -1)
+            (void)close(m_fd);
+    }
+    FileDescriptor(const FileDescriptor &) = delete;
+    FileDescriptor &operator=(const FileDescriptor &) = delete;
+    operator int() const { return m_fd; }
+
+  private:
+    int m_fd;
+};
+
+void MountScratch(const fs::path &target, int64_t size, uid_t uid, gid_t gid)
+{
+    int64_t pageSize = sysconf(_SC_PAGESIZE);
+    // 0 for no limit, for tmpfs.
+    int64_t inodes = size >= 0 ? (size + pageSize - 1) / pageSize + extraScratchInodes : 0;
+    string options = format("size={},nr_inodes={},mode=0755,uid={},gid={}", std::max<int64_t>(size, 0), inodes, uid, gid);
+    ENSURE(mount("tmpfs", target.string().c_str(), "tmpfs", MS_NOSUID | MS_NODEV, options.c_str()));
+}
+
+void MountOverlay(const fs::path &root, int64_t size)
+{
+    // The root is covered by the tmpfs below, so it's referred to with a file descriptor then.
+    FileDescriptor lower(ENSURE(open(root.string().c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC)));
+    struct stat st;
+    ENSURE(fstat(lower, &st));
+
+    MountScratch(root, size, 0, 0);
+    fs::path upper = root / "upper", work = root / "work";
+    ENSURE(mkdir(upper.string().c_str(), st.st_mode & 07777));
+    ENSURE(mkdir(work.string().c_str(), 0700));
+    // The root directory of the overlay is the upper one.
+    ENSURE(chown(upper.string().c_str(), st.st_uid, st.st_gid));
+    ENSURE(chmod(upper.string().c_str(), st.st_mode & 07777));
+
+    string options = format("lowerdir=/proc/self/fd/{},upperdir={},workdir={}", (int)lower, upper.string(), work.string());
+    ENSURE(mount("overlay", root.string().c_str(), "overlay", 0, options.c_str()));
+}
+
+static void CopyFile(int source, int destination, off_t length)
+{
+    while (length > 0)
+    {
+        ssize_t count = sendfile(destination, source, nullptr, length);
+        if (count == -1 && errno == EINTR)
+            continue;
+        ENSURE(count);
+        // The file has been truncated meanwhile, which can't happen after the sandbox is gone.
+        if (count == 0)
+            break;
+        length -= count;
+    }
+}
+
+static void CopyEntries(int source, int destination, int depth)
+{
+    if (depth > maxScratchDepth)
+    {
+        throw std::runtime_error(format("The directories are nested more than {} levels deep.", maxScratchDepth));
+    }
+
+    // `closedir` closes the duplicated descriptor.
+    DIR *dir = CHECKNULL(fdopendir(ENSURE(fcntl(source, F_DUPFD_CLOEXEC, 0))));
+    std::unique_ptr<DIR, int (*)(DIR *)> dirGuard(dir, closedir);
+    dirent *entry;
+    while ((errno = 0, entry = readdir(dir)) != nullptr)
+    {
+        string name = entry->d_name;
+        if (name == "." || name == "..")
+            continue;
+
+        struct stat st;
+        ENSURE(fstatat(source, name.c_str(), &st, AT_SYMLINK_NOFOLLOW));
+        if (S_ISDIR(st.st_mode))
+        {
+            if (mkdirat(destination, name.c_str(), 0700) == -1 && errno != EEXIST)
+                ENSURE(-1);
+            FileDescriptor from(ENSURE(openat(source, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)));
+            FileDescriptor to(ENSURE(openat(destination, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)));
+            CopyEntries(from, to, depth + 1);
+            ENSURE(fchown(to, st.st_uid, st.st_gid));
+            ENSURE(fchmod(to, st.st_mode & 0777));
+        }
+        else if (S_ISREG(st.st_mode))
+        {
+            FileDescriptor from(ENSURE(openat(source, name.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC)));
+            FileDescriptor to(ENSURE(openat(destination, name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600)));
+            CopyFile(from, to, st.st_size);
+            ENSURE(fchown(to, st.st_uid, st.st_gid));
+            ENSURE(fchmod(to, st.st_mode & 0777));
+        }
+    }
+    if (errno != 0)
+        ENSURE(-1);
+}
+
+void CopyScratch(int source, const fs::path &destination)
+{
+    try
+    {
+        FileDescriptor to(ENSURE(open(destination.string().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)));
+        CopyEntries(source, to, 0);
+    }
+    catch (std::exception &ex)
+    {
+        throw std::runtime_error(format("Failed to copy the scratch mount to {}: {}", destination, ex.what()));
+    }
+}
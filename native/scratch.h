@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+
+#include <sys/types.h>
+
+// Scratch mounts implement MountInfo.limit: instead of bind-mounting the source, a fresh tmpfs of `size` bytes
+// is mounted, so the sandbox can't write more than that, nor fill the disk of the host.
+// The data lives in memory (and is charged to the memory cgroup of the sandbox), and is gone with the mount namespace.
+
+// Mount an empty tmpfs at `target`, owned by `uid` and `gid`. Called by the child before chrooting.
+// The count of inodes is limited in proportion to `size` as well, so empty files can't be created without bound.
+// -1 for no limit (other than the memory limit of the sandbox).
+void MountScratch(const std::filesystem::path &target, int64_t size, uid_t uid, gid_t gid);
+
+// Make the (read-only) root filesystem at `root` writable, by mounting an overlay on it,
+// with `root` itself as the lower layer and a scratch tmpfs of `size` bytes as the upper one.
+// Nothing is copied; changes are made to the tmpfs only, and are gone with the mount namespace.
+// An overlay has no submounts, so those under `root` are hidden.
+void MountOverlay(const std::filesystem::path &root, int64_t size);
+
+// Copy the content of a scratch mount, opened as the directory `source`, into the directory `destination`.
+// Only directories and regular files are copied (keeping their owners and permissions, without special bits);
+// anything else, such as symbolic links, is skipped, and no link in `destination` is followed.
+void CopyScratch(int source, const std::filesystem::path &destination);
@@ -0,0 +1,281 @@
+#include <map>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include <cstddef>
+#include <cstring>
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <syscall.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/epoll.h>
+#include <linux/audit.h>
+#include <linux/seccomp.h>
+
+#include <fmt/format.h>
+
+#include "seccomp.h"
+#include "monitor.h"
+#include "utils.h"
+
+using std::string;
+using std::vector;
+using fmt::format;
+
+#if defined(__x86_64__)
+const uint32_t auditArch = AUDIT_ARCH_X86_64;
+#elif defined(__aarch64__)
+const uint32_t auditArch = AUDIT_ARCH_AARCH64;
+#else
+// Not supported.
+const uint32_t auditArch = 0;
+#endif
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+const uint32_t firstArgumentOffset = offsetof(seccomp_data, args[0]);
+#else
+const uint32_t firstArgumentOffset = offsetof(seccomp_data, args[0]) + sizeof(uint32_t);
+#endif
+
+// Stands for killing the sandbox in the rules, which is replaced with the actual action when compiling.
+const uint32_t killAction = SECCOMP_RET_KILL_PROCESS;
+
+struct Rule
+{
+    int syscall;
+    const char *name;
+    // `killAction`, or SECCOMP_RET_ERRNO with an errno.
+    uint32_t action;
+    // If not 0, the rule applies only if any of these bits are set in (the lower half of) the first argument,
+    // or if none of them are, with `unset`.
+    uint32_t mask;
+    bool unset;
+};
+
+#define KILL(name) {SYS_##name, #name, killAction, 0, false}
+#define DENY(name, error) {SYS_##name, #name, SECCOMP_RET_ERRNO | (error), 0, false}
+
+const uint32_t namespaceFlags = CLONE_NEWNS | CLONE_NEWUTS | CLONE_NEWIPC | CLONE_NEWUSER |
+                                CLONE_NEWPID | CLONE_NEWNET | CLONE_NEWCGROUP;
+
+// The syscalls no sandbox should ever make: they would escape or tamper with the sandbox, or the host.
+static vector<Rule> BaseRules()
+{
+    return {
+        KILL(ptrace), KILL(process_vm_readv), KILL(process_vm_writev),
+        KILL(mount), KILL(umount2), KILL(pivot_root), KILL(chroot), KILL(unshare), KILL(setns),
+        KILL(open_by_handle_at), KILL(name_to_handle_at),
+        KILL(kexec_load), KILL(kexec_file_load), KILL(reboot), KILL(swapon), KILL(swapoff),
+        KILL(init_module), KILL(finit_module), KILL(delete_module),
+        KILL(bpf), KILL(perf_event_open), KILL(userfaultfd), KILL(keyctl), KILL(add_key), KILL(request_key),
+        KILL(acct), KILL(quotactl), KILL(syslog), KILL(settimeofday), KILL(clock_settime), KILL(adjtimex),
+#ifdef SYS_iopl
+        KILL(iopl), KILL(ioperm),
+#endif
+        // New namespaces may be created with `clone` as well.
+        {SYS_clone, "clone", killAction, namespaceFlags, false},
+#ifdef SYS_clone3
+        // Its flags can't be checked (they are in memory), so make the libc fall back to `clone`.
+        DENY(clone3, ENOSYS),
+#endif
+    };
+}
+
+// Creating processes (not threads), with the same action as `action` in BaseRules.
+static vector<Rule> ForkRules(uint32_t action)
+{
+    return {
+#ifdef SYS_fork
+        {SYS_fork, "fork", action, 0, false},
+        {SYS_vfork, "vfork", action, 0, false},
+#endif
+        {SYS_clone, "clone", action, CLONE_THREAD, true},
+    };
+}
+
+static vector<Rule> ProfileRules(const string &name)
+{
+    vector<Rule> rules = BaseRules(), extra;
+    if (name == "c/cpp")
+    {
+        // A single process, which has no reason to create another one, or to open a socket.
+        extra = ForkRules(killAction);
+        extra.push_back(DENY(socket, EACCES));
+    }
+    else if (name == "python")
+    {
+        // `os.fork` and `multiprocessing` fail with an exception, instead of killing the sandbox.
+        extra = ForkRules(SECCOMP_RET_ERRNO | EPERM);
+        extra.push_back(DENY(socket, EACCES));
+    }
+    else if (name == "jvm")
+    {
+        // Plenty of threads, and some sockets (e.g. for the attach mechanism), but no processes.
+        extra = ForkRules(SECCOMP_RET_ERRNO | EPERM);
+    }
+    else
+    {
+        throw std::invalid_argument(format("Unknown seccomp profile: {}", name));
+    }
+    rules.insert(rules.end(), extra.begin(), extra.end());
+    return rules;
+}
+
+static bool IsActionAvailable(uint32_t action)
+{
+    return syscall(SYS_seccomp, SECCOMP_GET_ACTION_AVAIL, 0, &action) == 0;
+}
+
+// The rules are checked in order; the first matching one applies, and the syscall is allowed if none does.
+static vector<sock_filter> Compile(const vector<Rule> &rules, uint32_t kill, uint32_t kernelKill)
+{
+    vector<sock_filter> program = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, arch)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, auditArch, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, kernelKill),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, nr)),
+    };
+#ifdef __x86_64__
+    // The x32 ABI, whose syscall numbers differ.
+    program.push_back(BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, __X32_SYSCALL_BIT, 0, 1));
+    program.push_back(BPF_STMT(BPF_RET | BPF_K, kernelKill));
+#endif
+
+    for (const Rule &rule : rules)
+    {
+        uint32_t action = rule.action == killAction ? kill : rule.action;
+        if (rule.mask == 0)
+        {
+            program.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)rule.syscall, 0, 1));
+            program.push_back(BPF_STMT(BPF_RET | BPF_K, action));
+        }
+        else
+        {
+            // Skip to the next rule, with the syscall number still loaded.
+            program.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)rule.syscall, 0, 4));
+            // To the action if any of the bits is set (or, with `unset`, if none is).
+            const __u8 jumpIfSet = rule.unset ? 1 : 0, jumpIfUnset = rule.unset ? 0 : 1;
+            program.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, firstArgumentOffset));
+            program.push_back(BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, rule.mask, jumpIfSet, jumpIfUnset));
+            program.push_back(BPF_STMT(BPF_RET | BPF_K, action));
+            program.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, nr)));
+        }
+    }
+    program.push_back(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW));
+    return program;
+}
+
+const SeccompProfile &GetSeccompProfile(const string &name)
+{
+    static std::mutex mutex;
+    static std::map<string, std::unique_ptr<SeccompProfile>> profiles;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto iter = profiles.find(name);
+    if (iter != profiles.end())
+    {
+        return *iter->second;
+    }
+
+    if (auditArch == 0)
+    {
+        throw std::runtime_error("Seccomp profiles are not supported on this architecture.");
+    }
+    vector<Rule> rules = ProfileRules(name);
+    auto profile = std::make_unique<SeccompProfile>();
+    profile->name = name;
+    // SECCOMP_RET_KILL_PROCESS is available since Linux 4.14; before that, only the thread is killed.
+    uint32_t kernelKill = IsActionAvailable(SECCOMP_RET_KILL_PROCESS) ? SECCOMP_RET_KILL_PROCESS : SECCOMP_RET_KILL_THREAD;
+    profile->notifies = IsActionAvailable(SECCOMP_RET_USER_NOTIF);
+    profile->program = Compile(rules, profile->notifies ? SECCOMP_RET_USER_NOTIF : kernelKill, kernelKill);
+    if (profile->program.size() > BPF_MAXINSNS)
+    {
+        throw std::runtime_error(format("The seccomp profile {} is too long.", name));
+    }
+    for (const Rule &rule : rules)
+    {
+        profile->syscallNames[rule.syscall] = rule.name;
+    }
+    return *(profiles[name] = std::move(profile));
+}
+
+int InstallSeccompProfile(const SeccompProfile &profile)
+{
+    sock_fprog program = {static_cast<unsigned short>(profile.program.size()),
+                          const_cast<sock_filter *>(profile.program.data())};
+    // Required to install a filter without CAP_SYS_ADMIN; also keeps setuid executables in the chroot from gaining privileges.
+    ENSURE(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0));
+    if (profile.notifies)
+    {
+        // The listener is close-on-exec.
+        return ENSURE(static_cast<int>(syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, SECCOMP_FILTER_FLAG_NEW_LISTENER, &program)));
+    }
+    ENSURE(prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &program));
+    return -1;
+}
+
+SeccompWatcher::SeccompWatcher(pid_t pid, int pidfd, int listener, const SeccompProfile &profile)
+    : m_pid(pid), m_pidfd(pidfd), m_listener(listener), m_profile(profile), m_syscall(-1)
+{
+    try
+    {
+        seccomp_notif_sizes sizes = {};
+        ENSURE(static_cast<int>(syscall(SYS_seccomp, SECCOMP_GET_NOTIF_SIZES, 0, &sizes)));
+        // The kernel may know a larger structure than ours.
+        m_buffer.resize(std::max<size_t>(sizes.seccomp_notif, sizeof(seccomp_notif)));
+
+        SandboxMonitor::Instance().Add(m_listener, EPOLLIN, [this](uint32_t events) {
+            if (!(events & EPOLLIN))
+            {
+                // All processes of the sandbox are gone.
+                SandboxMonitor::Instance().Remove(m_listener);
+                return;
+            }
+            std::fill(m_buffer.begin(), m_buffer.end(), 0);
+            seccomp_notif *notification = reinterpret_cast<seccomp_notif *>(m_buffer.data());
+            // Fails if the process has been killed meanwhile.
+            if (ioctl(m_listener, SECCOMP_IOCTL_NOTIF_RECV, notification) == -1)
+                return;
+
+            int expected = -1;
+            m_syscall.compare_exchange_strong(expected, notification->data.nr);
+            // The notification is never responded to, so the syscall doesn't return before the sandbox is killed.
+            if (m_pidfd != -1)
+            {
+                (void)syscall(SYS_pidfd_send_signal, m_pidfd, SIGKILL, nullptr, 0);
+            }
+            else
+            {
+                (void)kill(m_pid, SIGKILL);
+            }
+        });
+    }
+    catch (...)
+    {
+        (void)close(m_listener);
+        throw;
+    }
+}
+
+SeccompWatcher::~SeccompWatcher()
+{
+    SandboxMonitor::Instance().Remove(m_listener);
+    (void)close(m_listener);
+}
+
+string SeccompWatcher::KilledSyscall() const
+{
+    int syscall = m_syscall;
+    if (syscall == -1)
+        return "";
+    auto iter = m_profile.syscallNames.find(syscall);
+    return iter != m_profile.syscallNames.end() ? iter->second : format("#{}", syscall);
+}
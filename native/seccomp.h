@@ -0,0 +1,52 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include <atomic>
+
+#include <sys/types.h>
+#include <linux/filter.h>
+
+// A named set of syscall rules (see seccomp.cc for the profiles), compiled to a BPF program once per process.
+// The filter is installed by the child right before `execvpe`, so allowed syscalls cost nothing but the filter itself,
+// and no tracer is involved. A denied syscall either fails with an errno, or kills the sandbox.
+struct SeccompProfile
+{
+    std::string name;
+    std::vector<sock_filter> program;
+    // Whether the sandbox is killed from the parent for denied syscalls (SECCOMP_RET_USER_NOTIF, Linux 5.0+),
+    // so that the syscall can be reported; see SeccompWatcher. Otherwise it's killed by the kernel.
+    bool notifies;
+    // Of the syscalls in the rules, by their numbers.
+    std::map<int, std::string> syscallNames;
+};
+
+// Get the profile named `name`, e.g. "c/cpp". It's compiled on the first use, and cached for the lifetime of the process,
+// so the reference stays valid (in the child as well). Throws std::invalid_argument for an unknown name.
+const SeccompProfile &GetSeccompProfile(const std::string &name);
+
+// In the child, after dropping privileges. Set `no_new_privs` and install the filter of `profile`.
+// Returns the listener for the notifications if the profile notifies, or -1 otherwise.
+int InstallSeccompProfile(const SeccompProfile &profile);
+
+// Watches the notifications of a sandbox on the monitor thread (see monitor.h), and kills it on the first one.
+// Takes the ownership of `listener`.
+class SeccompWatcher
+{
+  public:
+    // The sandbox is killed with `pidfd`, or with `pid` if it's -1.
+    SeccompWatcher(pid_t pid, int pidfd, int listener, const SeccompProfile &profile);
+    ~SeccompWatcher();
+
+    // The name of the syscall the sandbox has been killed for, or an empty string.
+    std::string KilledSyscall() const;
+
+  private:
+    pid_t m_pid;
+    int m_pidfd;
+    int m_listener;
+    const SeccompProfile &m_profile;
+    std::vector<char> m_buffer;
+    std::atomic<int> m_syscall;
+};
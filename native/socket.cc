@@ -0,0 +1,191 @@
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "socket.h"
+#include "utils.h"
+
+using std::string;
+using std::vector;
+
+// The maximum count of file descriptors that may be passed with one message.
+const int maxPassedFds = 16;
+
+UnixSocketPair::UnixSocketPair(int flags)
+{
+    ENSURE(socketpair(AF_UNIX, SOCK_STREAM | flags, 0, fd));
+}
+
+UnixSocketPair::~UnixSocketPair()
+{
+    (void)close(fd[0]);
+    (void)close(fd[1]);
+}
+
+int UnixSocketPair::operator[](int x)
+{
+    if (x == 0 || x == 1)
+        return fd[x];
+    else
+        throw std::invalid_argument("Socket file descriptor index number can't be greater than 1.");
+}
+
+static void SendAll(int socket, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t sent = ENSURE(send(socket, data, length, MSG_NOSIGNAL));
+        data += sent;
+        length -= sent;
+    }
+}
+
+static void ReceiveAll(int socket, char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t received = ENSURE(recv(socket, data, length, 0));
+        if (received == 0)
+        {
+            throw std::runtime_error("The peer closed the socket unexpectedly.");
+        }
+        data += received;
+        length -= received;
+    }
+}
+
+void SendMessage(int socket, const vector<char> &data, const vector<int> &fds)
+{
+    if (fds.size() > maxPassedFds)
+    {
+        throw std::invalid_argument("Too many file descriptors to pass in one message.");
+    }
+
+    // The file descriptors are attached to the length header.
+    uint32_t length = data.size();
+    iovec iov = {&length, sizeof(length)};
+    char control[CMSG_SPACE(sizeof(int) * maxPassedFds)];
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (!fds.empty())
+    {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+    }
+    ssize_t sent = ENSURE(sendmsg(socket, &msg, MSG_NOSIGNAL));
+    if (sent != sizeof(length))
+    {
+        SendAll(socket, reinterpret_cast<const char *>(&length) + sent, sizeof(length) - sent);
+    }
+    SendAll(socket, data.data(), data.size());
+}
+
+void ReceiveMessage(int socket, vector<char> &data, vector<int> &fds)
+{
+    uint32_t length;
+    iovec iov = {&length, sizeof(length)};
+    char control[CMSG_SPACE(sizeof(int) * maxPassedFds)];
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t received = ENSURE(recvmsg(socket, &msg, MSG_CMSG_CLOEXEC));
+    if (received == 0)
+    {
+        throw std::runtime_error("The peer closed the socket unexpectedly.");
+    }
+
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int *passed = reinterpret_cast<const int *>(CMSG_DATA(cmsg));
+            fds.insert(fds.end(), passed, passed + count);
+        }
+    }
+    if (msg.msg_flags & MSG_CTRUNC)
+    {
+        throw std::runtime_error("Too many file descriptors were passed in one message.");
+    }
+
+    if (received != sizeof(length))
+    {
+        ReceiveAll(socket, reinterpret_cast<char *>(&length) + received, sizeof(length) - received);
+    }
+    data.resize(length);
+    ReceiveAll(socket, data.data(), length);
+}
+
+void PutString(vector<char> &buffer, const string &str)
+{
+    uint32_t length = str.size();
+    const char *lengthBytes = reinterpret_cast<const char *>(&length);
+    buffer.insert(buffer.end(), lengthBytes, lengthBytes + sizeof(length));
+    buffer.insert(buffer.end(), str.begin(), str.end());
+}
+
+string GetString(const vector<char> &buffer, size_t &position)
+{
+    uint32_t length;
+    if (position + sizeof(length) > buffer.size())
+    {
+        throw std::runtime_error("Malformed message.");
+    }
+    memcpy(&length, &buffer[position], sizeof(length));
+    position += sizeof(length);
+    if (position + length > buffer.size())
+    {
+        throw std::runtime_error("Malformed message.");
+    }
+    string result(&buffer[position], length);
+    position += length;
+    return result;
+}
+
+void PutStringArray(vector<char> &buffer, const vector<string> &array)
+{
+    PutString(buffer, std::to_string(array.size()));
+    for (auto &item : array)
+        PutString(buffer, item);
+}
+
+vector<string> GetStringArray(const vector<char> &buffer, size_t &position)
+{
+    size_t count = std::stoul(GetString(buffer, position));
+    vector<string> result;
+    for (size_t i = 0; i < count; i++)
+        result.push_back(GetString(buffer, position));
+    return result;
+}
+
+void PutInt64(vector<char> &buffer, int64_t value)
+{
+    const char *bytes = reinterpret_cast<const char *>(&value);
+    buffer.insert(buffer.end(), bytes, bytes + sizeof(value));
+}
+
+int64_t GetInt64(const vector<char> &buffer, size_t &position)
+{
+    int64_t value;
+    if (position + sizeof(value) > buffer.size())
+    {
+        throw std::runtime_error("Malformed message.");
+    }
+    memcpy(&value, &buffer[position], sizeof(value));
+    position += sizeof(value);
+    return value;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// Handles RAII of a connected pair of unix domain sockets.
+class UnixSocketPair
+{
+  public:
+    UnixSocketPair(int flags = 0);
+    ~UnixSocketPair();
+    int operator[](int);
+
+  private:
+    int fd[2];
+};
+
+// Send a length-prefixed message, passing `fds` along with it (SCM_RIGHTS).
+void SendMessage(int socket, const std::vector<char> &data, const std::vector<int> &fds);
+
+// Receive a message sent by `SendMessage`. The passed file descriptors are appended to `fds`.
+void ReceiveMessage(int socket, std::vector<char> &data, std::vector<int> &fds);
+
+// Encode the content of a message. Each value is appended to `buffer`, and read back in the same order
+// from `position`, which is advanced. The getters throw if the message is malformed.
+void PutString(std::vector<char> &buffer, const std::string &str);
+std::string GetString(const std::vector<char> &buffer, size_t &position);
+void PutStringArray(std::vector<char> &buffer, const std::vector<std::string> &array);
+std::vector<std::string> GetStringArray(const std::vector<char> &buffer, size_t &position);
+void PutInt64(std::vector<char> &buffer, int64_t value);
+int64_t GetInt64(const std::vector<char> &buffer, size_t &position);
@@ -0,0 +1,207 @@
+#include <mutex>
+#include <vector>
+#include <system_error>
+
+#include <signal.h>
+#include <unistd.h>
+#include <syscall.h>
+#include <sys/mman.h>
+#include <linux/futex.h>
+
+#include "spawn.h"
+#include "utils.h"
+
+using std::vector;
+
+// Enough for the sandboxes started concurrently by a batch; any more are unmapped when returned.
+const size_t maxPooledStacks = 8;
+
+static std::mutex stackPoolMutex;
+static vector<void *> stackPool;
+
+ChildStack::ChildStack()
+{
+    {
+        std::lock_guard<std::mutex> lock(stackPoolMutex);
+        if (!stackPool.empty())
+        {
+            m_base = stackPool.back();
+            stackPool.pop_back();
+            return;
+        }
+    }
+
+    size_t guardSize = sysconf(_SC_PAGESIZE);
+    void *mapping = mmap(nullptr, guardSize + size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_POPULATE, -1, 0);
+    EnsureNot(mapping, MAP_FAILED, "Mapping memory for child stack");
+    if (mprotect(mapping, guardSize, PROT_NONE) == -1)
+    {
+        int error = errno;
+        (void)munmap(mapping, guardSize + size);
+        throw std::system_error(error, std::system_category(), "Protecting the guard page of child stack");
+    }
+    m_base = static_cast<char *>(mapping) + guardSize;
+}
+
+ChildStack::~ChildStack()
+{
+    {
+        std::lock_guard<std::mutex> lock(stackPoolMutex);
+        if (stackPool.size() < maxPooledStacks)
+        {
+            stackPool.push_back(m_base);
+            return;
+        }
+    }
+    size_t guardSize = sysconf(_SC_PAGESIZE);
+    (void)munmap(static_cast<char *>(m_base) - guardSize, guardSize + size);
+}
+
+// clone3 with a stack can't be called through syscall(), which would return on the new stack in the child,
+// so the child calls `function(argument)` and exits right in this trampoline (as the libc does for threads).
+// Returns the PID to the parent, or a negated errno.
+extern "C" long SandboxCloneOnStack(clone_args *args, size_t size, int (*function)(void *), void *argument);
+
+#if defined(__x86_64__)
+#define SANDBOX_CLONE_ON_STACK 1
+// The syscall clobbers rcx, so the argument is kept in r8.
+asm(R"(
+    .text
+    .p2align 4
+    .globl SandboxCloneOnStack
+    .hidden SandboxCloneOnStack
+    .type SandboxCloneOnStack, @function
+SandboxCloneOnStack:
+    .cfi_startproc
+    movq %rcx, %r8
+    movl $435, %eax
+    syscall
+    testq %rax, %rax
+    jz 1f
+    ret
+1:
+    .cfi_undefined rip
+    xorl %ebp, %ebp
+    movq %r8, %rdi
+    callq *%rdx
+    movl %eax, %edi
+    movl $231, %eax
+    syscall
+    hlt
+    .cfi_endproc
+    .size SandboxCloneOnStack, .-SandboxCloneOnStack
+)");
+#elif defined(__aarch64__)
+#define SANDBOX_CLONE_ON_STACK 1
+asm(R"(
+    .text
+    .p2align 4
+    .globl SandboxCloneOnStack
+    .hidden SandboxCloneOnStack
+    .type SandboxCloneOnStack, %function
+SandboxCloneOnStack:
+    .cfi_startproc
+    mov x8, #435
+    svc #0
+    cbz x0, 1f
+    ret
+1:
+    .cfi_undefined x30
+    mov x29, #0
+    mov x30, #0
+    mov x0, x3
+    blr x2
+    mov x8, #94
+    svc #0
+    brk #0
+    .cfi_endproc
+    .size SandboxCloneOnStack, .-SandboxCloneOnStack
+)");
+#else
+#define SANDBOX_CLONE_ON_STACK 0
+#endif
+
+// Kept at the top of the child stack, since the frame of the constructor may be gone before the child reads it.
+struct ChildStart
+{
+    int (*function)(void *);
+    void *argument;
+    sigset_t signalMask;
+};
+
+static int StartChild(void *pointer)
+{
+    ChildStart *start = reinterpret_cast<ChildStart *>(pointer);
+    // A handler of ours must not run in the child, so it's started with all signals blocked, until the handlers are reset.
+    for (int signal = 1; signal < NSIG; signal++)
+    {
+        // Those reserved by the libc can't be changed (which would set errno, shared with the cloning thread).
+        if (signal == SIGKILL || signal == SIGSTOP || (signal >= __SIGRTMIN && signal < SIGRTMIN))
+            continue;
+        struct sigaction action;
+        if (sigaction(signal, nullptr, &action) == 0 && action.sa_handler != SIG_IGN && action.sa_handler != SIG_DFL)
+        {
+            action = {};
+            action.sa_handler = SIG_DFL;
+            (void)sigaction(signal, &action, nullptr);
+        }
+    }
+    (void)pthread_sigmask(SIG_SETMASK, &start->signalMask, nullptr);
+    return start->function(start->argument);
+}
+
+bool SharedMemoryChild::IsSupported()
+{
+    return SANDBOX_CLONE_ON_STACK;
+}
+
+SharedMemoryChild::SharedMemoryChild(clone_args args, int (*function)(void *), void *argument) : m_pid(-1), m_inMemory(1)
+{
+    static_assert(sizeof(m_inMemory) == sizeof(int), "The futex must be an int.");
+    if (!IsSupported())
+    {
+        throw std::runtime_error("Cloning a child in our memory is not supported on this architecture.");
+    }
+
+    char *top = static_cast<char *>(m_stack.Base()) + ChildStack::size;
+    ChildStart *start = reinterpret_cast<ChildStart *>(reinterpret_cast<uintptr_t>(top - sizeof(ChildStart)) & ~uintptr_t(15));
+    start->function = function;
+    start->argument = argument;
+
+    args.flags |= CLONE_VM | CLONE_CHILD_CLEARTID;
+    args.child_tid = reinterpret_cast<uint64_t>(&m_inMemory);
+    args.stack = reinterpret_cast<uint64_t>(m_stack.Base());
+    args.stack_size = reinterpret_cast<char *>(start) - static_cast<char *>(m_stack.Base());
+
+    sigset_t all;
+    sigfillset(&all);
+    Ensure0(pthread_sigmask(SIG_SETMASK, &all, &start->signalMask));
+    long result = SandboxCloneOnStack(&args, sizeof(args), StartChild, start);
+    (void)pthread_sigmask(SIG_SETMASK, &start->signalMask, nullptr);
+    if (result < 0)
+    {
+        throw std::system_error(-result, std::system_category(), "clone3");
+    }
+    m_pid = result;
+}
+
+SharedMemoryChild::~SharedMemoryChild()
+{
+    if (m_pid != -1 && m_inMemory != 0)
+    {
+        // Not reaped yet, so the PID is still the child's.
+        (void)kill(m_pid, SIGKILL);
+        WaitForExec();
+    }
+}
+
+void SharedMemoryChild::WaitForExec()
+{
+    int value;
+    while ((value = m_inMemory) != 0)
+    {
+        // The kernel wakes a shared futex, hence not FUTEX_WAIT_PRIVATE.
+        (void)syscall(SYS_futex, reinterpret_cast<int *>(&m_inMemory), FUTEX_WAIT, value, nullptr, nullptr, 0);
+    }
+}
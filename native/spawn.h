@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+#include <sys/types.h>
+#include <linux/sched.h>
+
+// A stack for a child that runs only until it execs, taken from a small pool of stacks that are faulted in
+// once and reused, instead of being allocated (and zeroed) for every child. Returned to the pool on destruction.
+// Below the stack is a guard page, so an overflow kills the child instead of corrupting our memory.
+class ChildStack
+{
+  public:
+    // ChildProcess in sandbox.cc peaks below 8KB, including reporting an error.
+    static const size_t size = 64 * 1024;
+
+    ChildStack();
+    ~ChildStack();
+    ChildStack(const ChildStack &) = delete;
+    ChildStack &operator=(const ChildStack &) = delete;
+
+    // The lowest address of the stack, which is `size` bytes long.
+    void *Base() const { return m_base; }
+
+  private:
+    void *m_base;
+};
+
+// A child cloned with CLONE_VM, i.e. running in our memory until it execs or exits, like vfork, on a ChildStack.
+// No page tables are copied, so cloning it doesn't get slower as our address space grows.
+// Unlike vfork, we aren't suspended meanwhile; however, the child shares the thread-local state
+// (errno, the malloc cache, ...) of the cloning thread, so that thread must stay blocked while the child is running,
+// which is why the child is meant to park (e.g. reading an eventfd) once it's set up, until it's told to exec.
+// The child must not leave any allocation behind in our memory either, as it would never be freed after the exec.
+class SharedMemoryChild
+{
+  public:
+    // Whether the architecture is supported; if not, the constructor throws.
+    static bool IsSupported();
+
+    // Clone the child with `args` (whose stack is set here) plus CLONE_VM, running `function(argument)`
+    // with the signal handlers reset to the default, and exiting with its result.
+    SharedMemoryChild(clone_args args, int (*function)(void *), void *argument);
+    // If the child is still running in our memory, it's killed and waited for.
+    ~SharedMemoryChild();
+    SharedMemoryChild(const SharedMemoryChild &) = delete;
+    SharedMemoryChild &operator=(const SharedMemoryChild &) = delete;
+
+    pid_t Pid() const { return m_pid; }
+    // Block until the child has exec'd or exited, i.e. left our memory. The child is not reaped.
+    void WaitForExec();
+
+  private:
+    ChildStack m_stack;
+    pid_t m_pid;
+    // Cleared (and woken) by the kernel once the child leaves our memory (CLONE_CHILD_CLEARTID).
+    std::atomic<int> m_inMemory;
+};
@@ -0,0 +1,134 @@
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+#include <time.h>
+
+#include "telemetry.h"
+
+using std::vector;
+
+const char *const sandboxPhaseNames[PHASE_COUNT] = {
+    "setup", "mount", "cgroup", "killScan", "clone", "handshake", "release", "exec",
+};
+
+const size_t ringSize = 4096;
+// A sample is the phase in the top 8 bits, and the duration in the rest.
+const int phaseShift = 56;
+const uint64_t durationMask = (uint64_t(1) << phaseShift) - 1;
+
+// The samples of a thread, written by that thread only, and read by any.
+// Each sample is a single atomic word, so a reader never sees one torn.
+struct TelemetryRing
+{
+    std::atomic<uint64_t> samples[ringSize];
+    // The number of samples ever written; the latest is at (written - 1) % ringSize.
+    std::atomic<uint64_t> written{0};
+};
+
+struct TelemetryRegistry
+{
+    std::mutex mutex;
+    vector<TelemetryRing *> rings;
+    // Of the threads that have exited, to be reused (with their samples) by new ones.
+    vector<TelemetryRing *> free;
+};
+
+static TelemetryRegistry &Registry()
+{
+    // Never destroyed, since threads may exit after the static destructors have run.
+    static TelemetryRegistry *registry = new TelemetryRegistry();
+    return *registry;
+}
+
+// Holds a ring for a thread as long as it's running, so the short-lived threads (e.g. of a batch) don't add up.
+struct RingLease
+{
+    TelemetryRing *ring;
+
+    RingLease()
+    {
+        TelemetryRegistry &registry = Registry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        if (!registry.free.empty())
+        {
+            ring = registry.free.back();
+            registry.free.pop_back();
+        }
+        else
+        {
+            ring = new TelemetryRing();
+            registry.rings.push_back(ring);
+        }
+    }
+
+    ~RingLease()
+    {
+        TelemetryRegistry &registry = Registry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.free.push_back(ring);
+    }
+};
+
+static thread_local RingLease lease;
+
+int64_t TelemetryNow()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void RecordPhase(SandboxPhase phase, int64_t start)
+{
+    uint64_t duration = std::max<int64_t>(TelemetryNow() - start, 0);
+    TelemetryRing &ring = *lease.ring;
+    uint64_t index = ring.written.load(std::memory_order_relaxed);
+    ring.samples[index % ringSize].store((uint64_t(phase) << phaseShift) | (duration & durationMask), std::memory_order_relaxed);
+    ring.written.store(index + 1, std::memory_order_release);
+}
+
+// The nearest-rank percentile of the sorted `values`.
+static int64_t Percentile(const vector<int64_t> &values, int percent)
+{
+    size_t rank = (values.size() * percent + 99) / 100;
+    return values[std::max<size_t>(rank, 1) - 1];
+}
+
+vector<PhaseHistogram> CollectTelemetry()
+{
+    vector<vector<int64_t>> durations(PHASE_COUNT);
+    {
+        TelemetryRegistry &registry = Registry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        for (TelemetryRing *ring : registry.rings)
+        {
+            // The oldest of these may be overwritten meanwhile, by newer samples.
+            uint64_t written = ring->written.load(std::memory_order_acquire);
+            for (uint64_t i = written - std::min<uint64_t>(written, ringSize); i < written; i++)
+            {
+                uint64_t sample = ring->samples[i % ringSize].load(std::memory_order_relaxed);
+                size_t phase = sample >> phaseShift;
+                if (phase < PHASE_COUNT)
+                    durations[phase].push_back(sample & durationMask);
+            }
+        }
+    }
+
+    vector<PhaseHistogram> histograms(PHASE_COUNT);
+    for (size_t phase = 0; phase < PHASE_COUNT; phase++)
+    {
+        vector<int64_t> &values = durations[phase];
+        PhaseHistogram &histogram = histograms[phase];
+        histogram = {};
+        histogram.count = values.size();
+        if (values.empty())
+            continue;
+        std::sort(values.begin(), values.end());
+        histogram.p50 = Percentile(values, 50);
+        histogram.p99 = Percentile(values, 99);
+        histogram.max = values.back();
+    }
+    return histograms;
+}
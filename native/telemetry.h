@@ -0,0 +1,46 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+// The phases of starting a sandbox (see PrepareSandbox and ReleaseSandbox), timed on every start.
+enum SandboxPhase
+{
+    // Constructing the execution parameter: the pipes, the seccomp profile and the comparator, and PHASE_MOUNT.
+    PHASE_SETUP = 0,
+    // Getting the mount template (see MountTemplate), which is mounted here the first time.
+    PHASE_MOUNT,
+    // Creating and setting up the cgroups, including PHASE_KILL_SCAN.
+    PHASE_CGROUP,
+    // Killing whatever is left in the cgroups (KillGroupMembers).
+    PHASE_KILL_SCAN,
+    PHASE_CLONE,
+    // Until the child has set itself up (its mounts, chroot and IO) and reported ready.
+    PHASE_HANDSHAKE,
+    // From ReleaseSandbox until the child is let go, mostly starting the watchers.
+    PHASE_RELEASE,
+    // Until a child in our memory (see SharedMemoryChild) has exec'd; not seen for the other children.
+    PHASE_EXEC,
+    PHASE_COUNT
+};
+
+extern const char *const sandboxPhaseNames[PHASE_COUNT];
+
+// CLOCK_MONOTONIC, in nanoseconds.
+int64_t TelemetryNow();
+
+// Record that `phase` has taken from `start` (as returned by TelemetryNow) until now,
+// into the ring of the calling thread. Lock-free, and only a few nanoseconds more than reading the clock.
+void RecordPhase(SandboxPhase phase, int64_t start);
+
+struct PhaseHistogram
+{
+    // The number of samples, and their percentiles and maximum, in nanoseconds.
+    uint64_t count;
+    int64_t p50;
+    int64_t p99;
+    int64_t max;
+};
+
+// Of the samples still in the rings of all threads (the latest 4096 of each), indexed by SandboxPhase.
+std::vector<PhaseHistogram> CollectTelemetry();
@@ -0,0 +1,115 @@
+#include <string>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+
+#include <signal.h>
+#include <unistd.h>
+#include <syscall.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "timelimit.h"
+#include "monitor.h"
+#include "cgroup.h"
+#include "utils.h"
+
+using std::string;
+
+// Check at least every 50ms, and at most every 1ms, however little is left.
+const int64_t maxCheckInterval = 50 * 1000 * 1000, minCheckInterval = 1000 * 1000;
+
+static int64_t Elapsed(const timespec &from, const timespec &to)
+{
+    return (to.tv_sec - from.tv_sec) * 1000000000LL + (to.tv_nsec - from.tv_nsec);
+}
+
+TimeLimitWatcher::TimeLimitWatcher(pid_t pid, int pidfd, const string &cgroupName, int64_t limit)
+    : m_pid(pid), m_pidfd(pidfd), m_limit(limit), m_exceeded(false)
+{
+    try
+    {
+        m_group = std::make_unique<CgroupHandle>(CgroupInfo(IsCgroupV2() ? "unified" : "cpuacct", cgroupName));
+        // cgroup v2 can't reset the usage, so count from here.
+        m_lastUsage = ReadUsage();
+        ENSURE(clock_gettime(CLOCK_MONOTONIC, &m_lastCheck));
+
+        m_timerfd = ENSURE(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+        Arm();
+
+        SandboxMonitor::Instance().Add(m_timerfd, EPOLLIN, [this](uint32_t) {
+            uint64_t expirations;
+            if (read(m_timerfd, &expirations, sizeof(expirations)) == sizeof(expirations))
+            {
+                Check();
+            }
+        });
+    }
+    catch (...)
+    {
+        if (m_timerfd != -1)
+            (void)close(m_timerfd);
+        throw;
+    }
+}
+
+TimeLimitWatcher::~TimeLimitWatcher()
+{
+    SandboxMonitor::Instance().Remove(m_timerfd);
+    (void)close(m_timerfd);
+}
+
+bool TimeLimitWatcher::Exceeded() const
+{
+    return m_exceeded;
+}
+
+int64_t TimeLimitWatcher::ReadUsage()
+{
+    if (IsCgroupV2())
+    {
+        return m_group->ReadKey("cpu.stat", "usage_usec") * 1000;
+    }
+    return m_group->Read("cpuacct.usage");
+}
+
+void TimeLimitWatcher::Arm()
+{
+    int64_t interval = std::max(std::min(m_limit - m_counted, maxCheckInterval), minCheckInterval);
+    itimerspec spec = {};
+    spec.it_value.tv_sec = interval / 1000000000;
+    spec.it_value.tv_nsec = interval % 1000000000;
+    ENSURE(timerfd_settime(m_timerfd, 0, &spec, nullptr));
+}
+
+void TimeLimitWatcher::Check()
+{
+    if (m_exceeded)
+        return;
+
+    timespec now;
+    ENSURE(clock_gettime(CLOCK_MONOTONIC, &now));
+    int64_t usage = ReadUsage();
+
+    m_counted += std::max<int64_t>(usage - m_lastUsage,                // The real time, or if less than 40%,
+                                   Elapsed(m_lastCheck, now) * 2 / 5); // 40% of actually elapsed time
+    m_lastUsage = usage;
+    m_lastCheck = now;
+
+    if (m_counted > m_limit)
+    {
+        m_exceeded = true;
+        if (m_pidfd != -1)
+        {
+            (void)syscall(SYS_pidfd_send_signal, m_pidfd, SIGKILL, nullptr, 0);
+        }
+        else
+        {
+            (void)kill(m_pid, SIGKILL);
+        }
+    }
+    else
+    {
+        Arm();
+    }
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+
+#include <time.h>
+#include <sys/types.h>
+
+#include "cgroup.h"
+
+// Enforces the time limit of a sandbox on the monitor thread (see monitor.h), instead of polling from JavaScript.
+// The CPU usage of the cgroup is read with a one-shot timerfd, with a CgroupHandle opened in advance, and the timer is
+// then set again for what is left of the limit, but no longer than 50ms, so that it takes only a few reads to reach it.
+// Every interval counts as at least 40% of the elapsed wall time,
+// so that a sandbox sleeping or blocked forever is also stopped, after 2.5 times the limit.
+class TimeLimitWatcher
+{
+  public:
+    // `limit` is in nanoseconds. Once exceeded, the sandbox is killed with `pidfd`, or with `pid` if it's -1.
+    TimeLimitWatcher(pid_t pid, int pidfd, const std::string &cgroupName, int64_t limit);
+    ~TimeLimitWatcher();
+
+    bool Exceeded() const;
+
+  private:
+    // In nanoseconds.
+    int64_t ReadUsage();
+    // Set the timer to expire once, after min(what is left of the limit, 50ms).
+    void Arm();
+    void Check();
+
+    pid_t m_pid;
+    int m_pidfd;
+    int64_t m_limit;
+    std::unique_ptr<CgroupHandle> m_group;
+    int m_timerfd = -1;
+
+    int64_t m_lastUsage;
+    int64_t m_counted = 0;
+    timespec m_lastCheck;
+    std::atomic<bool> m_exceeded;
+};
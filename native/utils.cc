@@ -45,3 +45,35 @@ vector<char *> StringToPtr(const vector<string> &original)
     result.push_back(nullptr);
     return result;
 }
+
+vector<int> ParseCpuList(const string &list)
+{
+    vector<int> cpus;
+    size_t position = 0;
+    while (position < list.size() && list[position] != '\n')
+    {
+        size_t end = list.find_first_of(",\n", position);
+        if (end == string::npos)
+            end = list.size();
+        string range = list.substr(position, end - position);
+        size_t dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last = dash == string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+        position = end + 1;
+    }
+    return cpus;
+}
+
+string FormatCpuList(const vector<int> &cpus)
+{
+    string list;
+    for (int cpu : cpus)
+    {
+        if (!list.empty())
+            list += ',';
+        list += std::to_string(cpu);
+    }
+    return list;
+}
@@ -63,5 +63,10 @@ T CheckNull_Custom(T val, const char *operation)
 
 std::vector<char *> StringToPtr(const std::vector<std::string> &original);
 
+// Parse a CPU (or memory node) list as in sysfs and cgroup files, e.g. "0-3,8,10-11".
+std::vector<int> ParseCpuList(const std::string &list);
+// The other way round, e.g. "0,1,2,3,8".
+std::string FormatCpuList(const std::vector<int> &cpus);
+
 #define CHECKNULL(value) CheckNull_Custom(value, #value)
 #define ENSURE(value) (__Ensure((value), __FILE__, __LINE__, #value))
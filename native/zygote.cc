@@ -0,0 +1,418 @@
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <thread>
+#include <functional>
+#include <stdexcept>
+#include <condition_variable>
+
+#include <cstring>
+
+#include <spawn.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "zygote.h"
+#include "socket.h"
+#include "monitor.h"
+#include "utils.h"
+
+using std::string;
+using std::vector;
+namespace fs = std::filesystem;
+
+// The zygote serves requests on this file descriptor.
+const int zygoteSocket = 3;
+
+// A sandbox started from a zygote, whose result is going to be received on `socket`.
+struct ZygoteSandbox
+{
+    int socket;
+    ~ZygoteSandbox()
+    {
+        (void)close(socket);
+    }
+};
+
+// The file descriptors are passed along; their indexes in `fds` are put instead.
+static void PutRedirection(vector<char> &buffer, const string &path, int fd, vector<int> &fds)
+{
+    PutString(buffer, path);
+    PutInt64(buffer, fd != -1 ? (int64_t)fds.size() : -1);
+    if (fd != -1)
+        fds.push_back(fd);
+}
+
+static void GetRedirection(const vector<char> &buffer, size_t &position, const vector<int> &fds, string &path, int &fd)
+{
+    path = GetString(buffer, position);
+    int64_t index = GetInt64(buffer, position);
+    if (index >= (int64_t)fds.size())
+    {
+        throw std::runtime_error("Malformed message.");
+    }
+    fd = index >= 0 ? fds[index] : -1;
+}
+
+static void PutSandboxParameter(vector<char> &buffer, const SandboxParameter &parameter, vector<int> &fds)
+{
+    for (int64_t value : {parameter.timeLimit, parameter.outputLimit, parameter.stackSize, parameter.memoryLimit, parameter.memoryHigh,
+                          (int64_t)parameter.processLimit, (int64_t)parameter.redirectBeforeChroot, (int64_t)parameter.mountProc,
+                          parameter.chrootLimit, (int64_t)parameter.uid, (int64_t)parameter.gid})
+    {
+        PutInt64(buffer, value);
+    }
+    PutString(buffer, parameter.chrootDirectory);
+    PutString(buffer, parameter.workingDirectory);
+    PutInt64(buffer, parameter.mounts.size());
+    for (auto &mount : parameter.mounts)
+    {
+        PutString(buffer, mount.src);
+        PutString(buffer, mount.dst);
+        PutInt64(buffer, mount.limit);
+        PutInt64(buffer, mount.copyOut);
+    }
+    PutString(buffer, parameter.executable);
+    PutStringArray(buffer, parameter.executableParameters);
+    PutStringArray(buffer, parameter.environmentVariables);
+    PutRedirection(buffer, parameter.stdinRedirection, parameter.stdinRedirectionFileDescriptor, fds);
+    PutRedirection(buffer, parameter.stdoutRedirection, parameter.stdoutRedirectionFileDescriptor, fds);
+    PutRedirection(buffer, parameter.stderrRedirection, parameter.stderrRedirectionFileDescriptor, fds);
+    PutString(buffer, parameter.cgroupName);
+    PutString(buffer, parameter.hostname);
+    PutInt64(buffer, parameter.cpuAffinity.size());
+    for (int cpu : parameter.cpuAffinity)
+        PutInt64(buffer, cpu);
+    PutInt64(buffer, parameter.cpuQuota);
+    PutInt64(buffer, parameter.cpuPeriod);
+    for (auto list : {&parameter.cpuset, &parameter.memoryNodes})
+    {
+        PutInt64(buffer, list->size());
+        for (int item : *list)
+            PutInt64(buffer, item);
+    }
+    PutString(buffer, parameter.seccompProfile);
+    PutInt64(buffer, parameter.compareMode);
+    PutString(buffer, parameter.expectedOutput);
+    // Both sides are on the same machine.
+    PutString(buffer, string(reinterpret_cast<const char *>(&parameter.compareEpsilon), sizeof(parameter.compareEpsilon)));
+    PutInt64(buffer, parameter.stopOnMismatch);
+}
+
+static SandboxParameter GetSandboxParameter(const vector<char> &buffer, size_t &position, const vector<int> &fds)
+{
+    SandboxParameter parameter;
+    parameter.timeLimit = GetInt64(buffer, position);
+    parameter.outputLimit = GetInt64(buffer, position);
+    parameter.stackSize = GetInt64(buffer, position);
+    parameter.memoryLimit = GetInt64(buffer, position);
+    parameter.memoryHigh = GetInt64(buffer, position);
+    parameter.processLimit = GetInt64(buffer, position);
+    parameter.redirectBeforeChroot = GetInt64(buffer, position);
+    parameter.mountProc = GetInt64(buffer, position);
+    parameter.chrootLimit = GetInt64(buffer, position);
+    parameter.uid = GetInt64(buffer, position);
+    parameter.gid = GetInt64(buffer, position);
+    parameter.chrootDirectory = GetString(buffer, position);
+    parameter.workingDirectory = GetString(buffer, position);
+    for (int64_t i = GetInt64(buffer, position); i > 0; i--)
+    {
+        MountInfo mount;
+        mount.src = GetString(buffer, position);
+        mount.dst = GetString(buffer, position);
+        mount.limit = GetInt64(buffer, position);
+        mount.copyOut = GetInt64(buffer, position);
+        parameter.mounts.push_back(mount);
+    }
+    parameter.executable = GetString(buffer, position);
+    parameter.executableParameters = GetStringArray(buffer, position);
+    parameter.environmentVariables = GetStringArray(buffer, position);
+    GetRedirection(buffer, position, fds, parameter.stdinRedirection, parameter.stdinRedirectionFileDescriptor);
+    GetRedirection(buffer, position, fds, parameter.stdoutRedirection, parameter.stdoutRedirectionFileDescriptor);
+    GetRedirection(buffer, position, fds, parameter.stderrRedirection, parameter.stderrRedirectionFileDescriptor);
+    parameter.cgroupName = GetString(buffer, position);
+    parameter.hostname = GetString(buffer, position);
+    for (int64_t i = GetInt64(buffer, position); i > 0; i--)
+        parameter.cpuAffinity.push_back(GetInt64(buffer, position));
+    parameter.cpuQuota = GetInt64(buffer, position);
+    parameter.cpuPeriod = GetInt64(buffer, position);
+    for (auto list : {&parameter.cpuset, &parameter.memoryNodes})
+    {
+        for (int64_t i = GetInt64(buffer, position); i > 0; i--)
+            list->push_back(GetInt64(buffer, position));
+    }
+    parameter.seccompProfile = GetString(buffer, position);
+    parameter.compareMode = static_cast<CompareMode>(GetInt64(buffer, position));
+    parameter.expectedOutput = GetString(buffer, position);
+    string compareEpsilon = GetString(buffer, position);
+    if (compareEpsilon.size() != sizeof(parameter.compareEpsilon))
+    {
+        throw std::runtime_error("Malformed message.");
+    }
+    memcpy(&parameter.compareEpsilon, compareEpsilon.data(), sizeof(parameter.compareEpsilon));
+    parameter.stopOnMismatch = GetInt64(buffer, position);
+    return parameter;
+}
+
+static void PutExecutionResult(vector<char> &buffer, const ExecutionResult &result)
+{
+    for (int64_t value : {(int64_t)result.status, (int64_t)result.code, (int64_t)result.timeLimitExceeded,
+                          (int64_t)result.outputLimitExceeded, (int64_t)result.memoryLimitExceeded,
+                          result.mismatchOffset, (int64_t)result.killedOnMismatch, result.usage.time, result.usage.memory,
+                          result.usage.memoryPeaks.anon, result.usage.memoryPeaks.file, result.usage.memoryPeaks.shmem, (int64_t)result.usage.oomKilled})
+    {
+        PutInt64(buffer, value);
+    }
+    // Both sides are on the same machine.
+    PutString(buffer, string(reinterpret_cast<const char *>(&result.resourceUsage), sizeof(result.resourceUsage)));
+    PutString(buffer, result.killedSyscall);
+}
+
+static ExecutionResult GetExecutionResult(const vector<char> &buffer, size_t &position)
+{
+    ExecutionResult result;
+    result.status = static_cast<RunStatus>(GetInt64(buffer, position));
+    result.code = GetInt64(buffer, position);
+    result.timeLimitExceeded = GetInt64(buffer, position);
+    result.outputLimitExceeded = GetInt64(buffer, position);
+    result.memoryLimitExceeded = GetInt64(buffer, position);
+    result.mismatchOffset = GetInt64(buffer, position);
+    result.killedOnMismatch = GetInt64(buffer, position);
+    result.usage.time = GetInt64(buffer, position);
+    result.usage.memory = GetInt64(buffer, position);
+    result.usage.memoryPeaks.anon = GetInt64(buffer, position);
+    result.usage.memoryPeaks.file = GetInt64(buffer, position);
+    result.usage.memoryPeaks.shmem = GetInt64(buffer, position);
+    result.usage.oomKilled = GetInt64(buffer, position);
+    string resourceUsage = GetString(buffer, position);
+    if (resourceUsage.size() != sizeof(result.resourceUsage))
+    {
+        throw std::runtime_error("Malformed message.");
+    }
+    memcpy(&result.resourceUsage, resourceUsage.data(), sizeof(result.resourceUsage));
+    result.killedSyscall = GetString(buffer, position);
+    return result;
+}
+
+// Replies are either "ok" followed by the content, or "error" followed by the message, which is thrown.
+static void SendReply(int socket, const string &error, const std::function<void(vector<char> &)> &putContent)
+{
+    vector<char> data;
+    if (error.empty())
+    {
+        PutString(data, "ok");
+        putContent(data);
+    }
+    else
+    {
+        PutString(data, "error");
+        PutString(data, error);
+    }
+    SendMessage(socket, data, {});
+}
+
+static vector<char> ReceiveReply(int socket, size_t &position)
+{
+    vector<char> data;
+    vector<int> fds;
+    ReceiveMessage(socket, data, fds);
+    for (int fd : fds)
+        (void)close(fd);
+    position = 0;
+    if (GetString(data, position) == "error")
+    {
+        throw std::runtime_error(GetString(data, position));
+    }
+    return data;
+}
+
+Zygote::Zygote(const fs::path &executable)
+{
+    int sockets[2];
+    ENSURE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets));
+    m_socket = sockets[0];
+    int theirs = sockets[1];
+    try
+    {
+        if (theirs == zygoteSocket)
+        {
+            // `dup2` to itself would leave it close-on-exec.
+            theirs = ENSURE(fcntl(sockets[1], F_DUPFD_CLOEXEC, zygoteSocket + 1));
+            (void)close(sockets[1]);
+        }
+
+        posix_spawn_file_actions_t actions;
+        Ensure0(posix_spawn_file_actions_init(&actions));
+        posix_spawn_file_actions_adddup2(&actions, theirs, zygoteSocket);
+        string path = executable.string();
+        char *argv[] = {const_cast<char *>(path.c_str()), nullptr};
+        char *envp[] = {nullptr};
+        int error = posix_spawn(&m_pid, path.c_str(), &actions, nullptr, argv, envp);
+        posix_spawn_file_actions_destroy(&actions);
+        if (error != 0)
+        {
+            throw std::system_error(error, std::system_category(), "Starting the zygote " + path);
+        }
+    }
+    catch (...)
+    {
+        (void)close(m_socket);
+        (void)close(theirs);
+        throw;
+    }
+    (void)close(theirs);
+}
+
+Zygote::~Zygote()
+{
+    (void)close(m_socket);
+    // Don't wait for the sandboxes still running.
+    pid_t pid = m_pid;
+    std::thread([pid]() { (void)waitpid(pid, nullptr, 0); }).detach();
+}
+
+void *Zygote::Start(const SandboxParameter &parameter, pid_t &pid)
+{
+    int sockets[2];
+    ENSURE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets));
+    std::unique_ptr<ZygoteSandbox> sandbox(new ZygoteSandbox{sockets[0]});
+
+    vector<char> data;
+    vector<int> fds;
+    try
+    {
+        PutSandboxParameter(data, parameter, fds);
+        // The reply socket goes first.
+        fds.insert(fds.begin(), sockets[1]);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        SendMessage(m_socket, data, fds);
+    }
+    catch (...)
+    {
+        (void)close(sockets[1]);
+        throw;
+    }
+    (void)close(sockets[1]);
+
+    size_t position;
+    data = ReceiveReply(sandbox->socket, position);
+    pid = GetInt64(data, position);
+    return sandbox.release();
+}
+
+ExecutionResult WaitForZygoteProcess(void *handle)
+{
+    std::unique_ptr<ZygoteSandbox> sandbox(reinterpret_cast<ZygoteSandbox *>(handle));
+    size_t position;
+    vector<char> data = ReceiveReply(sandbox->socket, position);
+    return GetExecutionResult(data, position);
+}
+
+void WaitForZygoteProcessAsync(void *handle, WaitCallback callback)
+{
+    ZygoteSandbox *sandbox = reinterpret_cast<ZygoteSandbox *>(handle);
+    int socket = sandbox->socket;
+    // Readable once the result is sent, or the zygote is gone.
+    SandboxMonitor::Instance().Add(socket, EPOLLIN, [sandbox, socket, callback](uint32_t) {
+        SandboxMonitor::Instance().Remove(socket);
+        ExecutionResult result;
+        string error;
+        try
+        {
+            result = WaitForZygoteProcess(sandbox);
+        }
+        catch (std::exception &ex)
+        {
+            error = ex.what();
+        }
+        callback(result, error);
+    });
+}
+
+void RunZygote(int socket)
+{
+    // A client may be gone before its reply is sent.
+    signal(SIGPIPE, SIG_IGN);
+
+    std::mutex mutex;
+    std::condition_variable finished;
+    int running = 0;
+
+    while (true)
+    {
+        vector<char> data;
+        vector<int> fds;
+        try
+        {
+            ReceiveMessage(socket, data, fds);
+        }
+        catch (std::exception &)
+        {
+            // The client has closed the socket.
+            break;
+        }
+        if (fds.empty())
+            continue;
+
+        int reply = fds[0];
+        vector<int> redirections(fds.begin() + 1, fds.end());
+        try
+        {
+            size_t position = 0;
+            SandboxParameter parameter = GetSandboxParameter(data, position, redirections);
+            pid_t pid;
+            void *execParam = StartSandbox(parameter, pid);
+            // The sandbox has its own copies.
+            for (int fd : redirections)
+                (void)close(fd);
+            redirections.clear();
+
+            try
+            {
+                SendReply(reply, "", [pid](vector<char> &data) { PutInt64(data, pid); });
+            }
+            catch (std::exception &)
+            {
+                // Still reap it below.
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                running++;
+            }
+            WaitForProcessAsync(pid, execParam, [reply, &mutex, &finished, &running](const ExecutionResult &result, const string &error) {
+                try
+                {
+                    SendReply(reply, error, [&result](vector<char> &data) { PutExecutionResult(data, result); });
+                }
+                catch (std::exception &)
+                {
+                }
+                (void)close(reply);
+                std::lock_guard<std::mutex> lock(mutex);
+                running--;
+                finished.notify_all();
+            });
+        }
+        catch (std::exception &ex)
+        {
+            for (int fd : redirections)
+                (void)close(fd);
+            try
+            {
+                SendReply(reply, ex.what(), nullptr);
+            }
+            catch (std::exception &)
+            {
+            }
+            (void)close(reply);
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [&running] { return running == 0; });
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <mutex>
+#include <filesystem>
+
+#include <sys/types.h>
+
+#include "sandbox.h"
+
+// A zygote is a small helper process (native/zygote/main.cc), started once, that starts sandboxes on our behalf.
+// Cloning a sandbox from a process with a large address space (such as Node.js) copies all its page tables,
+// though the sandbox is going to exec right away; the zygote's are tiny, so the latency of starting a sandbox
+// doesn't depend on the size of our heap, and no sandbox ever inherits our mappings.
+//
+// Each request carries the SandboxParameter, the redirected file descriptors (SCM_RIGHTS),
+// and a socket of its own, on which the zygote replies with the PID of the sandbox (or the error),
+// and later with its ExecutionResult. The time limit, output relay, etc. are run in the zygote.
+class Zygote
+{
+  public:
+    // Start the zygote from `executable`.
+    explicit Zygote(const std::filesystem::path &executable);
+    // The zygote exits once all the sandboxes started from it have finished.
+    ~Zygote();
+
+    // The same as StartSandbox, except that the handle returned must be waited with WaitForZygoteProcess(Async).
+    // Thread-safe.
+    void *Start(const SandboxParameter &parameter, pid_t &pid);
+
+  private:
+    pid_t m_pid;
+    int m_socket;
+    std::mutex m_mutex;
+};
+
+ExecutionResult WaitForZygoteProcess(void *handle);
+// The same as WaitForProcessAsync; the result is received on the monitor thread.
+void WaitForZygoteProcessAsync(void *handle, WaitCallback callback);
+
+// The main loop of the zygote, serving the requests on `socket` until it's closed.
+void RunZygote(int socket);
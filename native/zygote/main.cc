@@ -0,0 +1,10 @@
+// The zygote executable (see zygote.h), which is started by the addon with the socket to serve as fd 3.
+// It's linked with the sandbox sources only, so its address space stays small.
+
+#include "../zygote.h"
+
+int main()
+{
+    RunZygote(3);
+    return 0;
+}
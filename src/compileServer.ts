@@ -0,0 +1,44 @@
+import { SandboxParameter, CompileResult } from './interfaces';
+import sandboxAddon from './nativeAddon';
+import { toSandboxResult } from './sandboxProcess';
+
+// Keeps a compiler helper (`parameter.executable`) running in a sandbox, and feeds it the compile jobs one at a time
+// natively, so that compiling doesn't start a fresh sandbox for every submission.
+// Each job is written to the stdin of the helper as a line, and the helper answers it with a line on its stdout once done.
+// The helper is put in a new cgroup under `parameter.cgroup` (whose limits apply to everything it runs),
+// and started again if it exits. `parameter.time` is ignored; each job has a time limit of its own.
+export class CompileServer {
+    private server: ArrayBuffer;
+
+    constructor(public readonly parameter: SandboxParameter) {
+        this.server = sandboxAddon.createCompileServer(parameter);
+    }
+
+    // Queue a job; `time` is its time limit in milliseconds, -1 for none.
+    // The jobs are run in order, so the next submission can be queued while the last one is running.
+    compile(job: string, time: number = -1): Promise<CompileResult> {
+        return new Promise((res, rej) => {
+            sandboxAddon.compile(this.server, job, time, (err, compileResult) => {
+                if (err) {
+                    rej(err);
+                    return;
+                }
+                const result: CompileResult = {
+                    reply: compileResult.reply,
+                    time: compileResult.time,
+                    timeLimitExceeded: compileResult.timeLimitExceeded,
+                    helperExited: compileResult.helperExited
+                };
+                if (compileResult.helperResult) {
+                    result.helperResult = toSandboxResult({ ...this.parameter, time: -1 }, compileResult.helperResult, false);
+                }
+                res(result);
+            });
+        });
+    }
+
+    // Kill the helper. The jobs not yet done are rejected.
+    destroy(): void {
+        sandboxAddon.destroyCompileServer(this.server);
+    }
+};
@@ -0,0 +1,52 @@
+import { SandboxParameter, SandboxRunParameter, CoreSchedulerStats } from './interfaces';
+import sandboxAddon from './nativeAddon';
+import { SandboxProcess, CoreLease, startSandboxProcess } from './sandboxProcess';
+import { SandboxPool } from './sandboxPool';
+
+// Owns a set of CPUs and gives each of them to one sandbox at a time, so that no two timed runs share a core.
+// A sandbox is started (pinned to its core) only once a core is free; until then, it's queued.
+// The core is released as soon as the sandbox is reaped, and goes to the first sandbox in the queue.
+// With `isolateSiblings`, only one logical CPU of each physical core is used, and its SMT siblings are kept idle.
+// `cpus` defaults to all the CPUs this process may run on; leave some out of it for Node.js itself, if possible.
+export class CoreScheduler {
+    private scheduler: ArrayBuffer;
+
+    constructor(cpus?: number[], isolateSiblings: boolean = false) {
+        this.scheduler = sandboxAddon.createCoreScheduler(cpus, isolateSiblings);
+    }
+
+    // For runBatch().
+    get handle(): ArrayBuffer {
+        return this.scheduler;
+    }
+
+    private async withCore(start: (lease: CoreLease) => SandboxProcess): Promise<SandboxProcess> {
+        const lease: CoreLease = await new Promise<CoreLease>(res =>
+            sandboxAddon.requestCore(this.scheduler, (cpu: number, handle: ArrayBuffer) => res({ handle, cpu })));
+        try {
+            return start(lease);
+        } catch (e) {
+            // Nothing is released if the sandbox has taken the core already.
+            sandboxAddon.releaseCore(lease.handle);
+            throw e;
+        }
+    }
+
+    // The `cpuAffinity` of `parameter` is replaced with the core.
+    start(parameter: SandboxParameter): Promise<SandboxProcess> {
+        return this.withCore(lease => startSandboxProcess(Object.assign({}, parameter, { cpuAffinity: [lease.cpu] }), lease));
+    }
+
+    startFromPool(pool: SandboxPool, runParameter: SandboxRunParameter): Promise<SandboxProcess> {
+        return this.withCore(lease => pool.start(Object.assign({}, runParameter, { cpuAffinity: [lease.cpu] }), lease));
+    }
+
+    getStats(): CoreSchedulerStats {
+        return sandboxAddon.getCoreSchedulerStats(this.scheduler);
+    }
+
+    // No more sandboxes can be started from the scheduler; those running or queued are not affected.
+    destroy(): void {
+        sandboxAddon.destroyCoreScheduler(this.scheduler);
+    }
+};
@@ -1,40 +1,110 @@
-import { SandboxParameter } from './interfaces';
+import { SandboxParameter, SandboxRunParameter, SandboxResult, SandboxTelemetry } from './interfaces';
 import nativeAddon from './nativeAddon';
-import { SandboxProcess } from './sandboxProcess';
+import { SandboxProcess, getSandboxStatus, getComparison, startSandboxProcess } from './sandboxProcess';
+import { SandboxPool } from './sandboxPool';
+import { SandboxTemplate } from './sandboxTemplate';
+import { CoreScheduler } from './coreScheduler';
+import { InteractiveProcess, startInteractiveProcess } from './interactiveProcess';
+import { CompileServer } from './compileServer';
 import { existsSync } from 'fs';
-import * as randomString from 'randomstring';
-import * as path from 'path';
 
 export * from './interfaces';
+export { SandboxPool, SandboxTemplate, CoreScheduler, InteractiveProcess, CompileServer };
 
-if (!existsSync('/sys/fs/cgroup/memory/memory.memsw.usage_in_bytes')) {
+// cgroup v2 always accounts swap.
+if (nativeAddon.cgroupVersion === 1 && !existsSync('/sys/fs/cgroup/memory/memory.memsw.usage_in_bytes')) {
     throw new Error("Your linux kernel doesn't support memory-swap account. Please turn it on following the readme.");
 }
 
-const MAX_RETRY_TIMES = 20;
 export function startSandbox(parameter: SandboxParameter): SandboxProcess {
-    const doStart = () => {
-        const actualParameter = Object.assign({}, parameter);
-        actualParameter.cgroup = path.join(actualParameter.cgroup, randomString.generate(9));
-        const startResult: { pid: number; execParam: ArrayBuffer } = nativeAddon.startSandbox(actualParameter);
-        return new SandboxProcess(actualParameter, startResult.pid, startResult.execParam);
-    };
-
-    let retryTimes = MAX_RETRY_TIMES;
-    while (1) {
-        try {
-            return doStart();
-        } catch (e) {
-            // Retry if the child process fails
-            if ("message" in e && typeof e.message === "string" && e.message.startsWith("The child process ")) {
-                if (retryTimes-- > 0)
-                    continue;
+    return startSandboxProcess(parameter);
+};
+
+// Start a small native helper process (the zygote), from which `startSandbox` clones the sandboxes from now on,
+// instead of from this process, whose large address space makes cloning slower as the heap grows.
+// `executable` is `sandbox-zygote`, built next to the addon, by default.
+// The zygote lives as long as this process does. Sandbox pools and batches are not started from it.
+export function startZygote(executable?: string): void {
+    nativeAddon.startZygote(executable);
+}
+
+// Start the contestant and the interactor of an interactive problem, with the stdout of each connected to the stdin
+// of the other natively (their `stdin` and `stdout` are ignored), and reap them together.
+// Their output can't be limited or compared. With `countTraffic`, the bytes each side writes to the other are counted,
+// at the cost of an extra hop through the native monitor thread for every message.
+// Neither is started from the zygote.
+export function startInteractive(contestant: SandboxParameter, interactor: SandboxParameter, countTraffic: boolean = false): InteractiveProcess {
+    return startInteractiveProcess(contestant, interactor, countTraffic);
+}
+
+export function compileSandboxTemplate(parameter: SandboxParameter): SandboxTemplate {
+    return new SandboxTemplate(parameter);
+}
+
+export function createSandboxPool(parameter: SandboxParameter, size: number): SandboxPool {
+    return new SandboxPool(parameter, size);
+}
+
+export function createCompileServer(parameter: SandboxParameter): CompileServer {
+    return new CompileServer(parameter);
+}
+
+// Run each of `cases` in a sandbox made from `parameter`, at most `concurrency` at a time, all on native threads.
+// The sandboxes are put in cgroups under `parameter.cgroup`, as with a SandboxPool.
+// With a `scheduler`, each case also waits for a core of its own, and is pinned to it.
+// `onResult` is called as soon as each case finishes. The promise resolves to the results in the order of `cases`,
+// or rejects with the first error after all the cases have finished.
+export function runBatch(
+    parameter: SandboxParameter,
+    cases: SandboxRunParameter[],
+    concurrency: number,
+    onResult?: (index: number, result: SandboxResult) => void,
+    scheduler?: CoreScheduler
+): Promise<SandboxResult[]> {
+    return new Promise((res, rej) => {
+        const results: SandboxResult[] = new Array(cases.length);
+        let firstError: Error = null;
+        nativeAddon.runBatch(parameter, cases, concurrency, (err, index: number, runResult) => {
+            if (err) {
+                firstError = firstError || err;
+                return;
             }
 
-            throw e;
-        }
-    }
-};
+            const result: SandboxResult = {
+                ...getComparison(parameter, runResult),
+                status: getSandboxStatus(parameter, runResult, runResult.time, runResult.memory, runResult.oomKilled, false),
+                time: runResult.time,
+                memory: runResult.memory,
+                memoryPeaks: runResult.memoryPeaks,
+                code: runResult.code,
+                resourceUsage: runResult.resourceUsage,
+                killedSyscall: runResult.killedSyscall
+            };
+            results[index] = result;
+            if (onResult) {
+                onResult(index, result);
+            }
+        }, (err) => {
+            if (err || firstError) {
+                rej(err || firstError);
+            } else {
+                res(results);
+            }
+        }, scheduler ? scheduler.handle : undefined);
+    });
+}
+
+// Histograms of how long each phase of starting a sandbox has taken in this process, of the latest 4096 starts
+// on each native thread. The sandboxes started from the zygote are not included.
+export function getSandboxTelemetry(): SandboxTelemetry {
+    const telemetry: { phases: string[]; histograms: Float64Array } = nativeAddon.getSandboxTelemetry();
+    const result: SandboxTelemetry = {};
+    telemetry.phases.forEach((phase, i) => {
+        const [count, p50, p99, max] = telemetry.histograms.subarray(i * 4, i * 4 + 4);
+        result[phase] = { count, p50, p99, max };
+    });
+    return result;
+}
 
 export function getUidAndGidInSandbox(rootfs: string, username: string): { uid: number; gid: number } {
     try {
@@ -0,0 +1,113 @@
+import { SandboxParameter, SandboxResult, SandboxStatus, InteractiveResult } from './interfaces';
+import sandboxAddon from './nativeAddon';
+import { toSandboxResult, retryStart } from './sandboxProcess';
+import * as randomString from 'randomstring';
+import * as path from 'path';
+
+const CONTESTANT_FAILURES = [
+    SandboxStatus.TimeLimitExceeded,
+    SandboxStatus.MemoryLimitExceeded,
+    SandboxStatus.OutputLimitExceeded,
+    SandboxStatus.DisallowedSyscall,
+    SandboxStatus.Cancelled
+];
+
+// See InteractiveResult.status for the precedence.
+export function getInteractiveStatus(contestant: SandboxResult, interactor: SandboxResult, interactorFirst: boolean): SandboxStatus {
+    const rejected = interactor.status === SandboxStatus.OK && interactor.code !== 0;
+    if (rejected && interactorFirst) {
+        return SandboxStatus.WrongAnswer;
+    } else if (CONTESTANT_FAILURES.includes(contestant.status)) {
+        return contestant.status;
+    } else if (interactor.status !== SandboxStatus.OK) {
+        return SandboxStatus.InteractorFailed;
+    } else if (rejected) {
+        return SandboxStatus.WrongAnswer;
+    }
+    return contestant.status;
+}
+
+// A contestant and an interactor started by `startInteractive`, with the stdout of each connected to the stdin of the other.
+export class InteractiveProcess {
+    private readonly stopCallback: () => void;
+
+    private cancelled: boolean = false;
+    private waitPromise: Promise<InteractiveResult> = null;
+
+    public running: boolean = true;
+
+    constructor(
+        public readonly contestant: SandboxParameter,
+        public readonly interactor: SandboxParameter,
+        public readonly contestantPid: number,
+        public readonly interactorPid: number,
+        handle: ArrayBuffer
+    ) {
+        this.stopCallback = () => {
+            this.stop();
+        };
+        process.on('exit', this.stopCallback);
+
+        // Both sides are reaped natively, and reported together.
+        this.waitPromise = new Promise((res, rej) => {
+            sandboxAddon.waitForInteractive(handle, (err, runResult) => {
+                try {
+                    this.cleanup();
+                } catch (e) {
+                    err = err || e;
+                }
+                if (err) {
+                    rej(err);
+                    return;
+                }
+
+                const contestantResult = toSandboxResult(this.contestant, runResult.contestant, this.cancelled);
+                const interactorResult = toSandboxResult(this.interactor, runResult.interactor, this.cancelled);
+                const result: InteractiveResult = {
+                    status: getInteractiveStatus(contestantResult, interactorResult, runResult.interactorFirst),
+                    contestant: contestantResult,
+                    interactor: interactorResult,
+                    interactorFirst: runResult.interactorFirst
+                };
+                if (runResult.contestantBytes !== -1) {
+                    result.traffic = { contestant: runResult.contestantBytes, interactor: runResult.interactorBytes };
+                }
+                res(result);
+            });
+        });
+    }
+
+    private cleanup(): void {
+        if (this.running) {
+            process.removeListener('exit', this.stopCallback);
+            this.running = false;
+            sandboxAddon.removeSandboxCgroups(this.contestant.cgroup);
+            sandboxAddon.removeSandboxCgroups(this.interactor.cgroup);
+        }
+    }
+
+    stop(): void {
+        this.cancelled = true;
+        for (const pid of [this.contestantPid, this.interactorPid]) {
+            try {
+                process.kill(pid, "SIGKILL");
+            } catch (err) {}
+        }
+    }
+
+    async waitForStop(): Promise<InteractiveResult> {
+        return await this.waitPromise;
+    }
+};
+
+// Each side is put in a new cgroup under its own `cgroup`, both named after the same random string.
+export function startInteractiveProcess(contestant: SandboxParameter, interactor: SandboxParameter, countTraffic: boolean): InteractiveProcess {
+    return retryStart(() => {
+        const name = randomString.generate(9);
+        const contestantParameter = Object.assign({}, contestant, { cgroup: path.join(contestant.cgroup, name) });
+        const interactorParameter = Object.assign({}, interactor, { cgroup: path.join(interactor.cgroup, name + '-interactor') });
+        const startResult: { contestantPid: number; interactorPid: number; handle: ArrayBuffer } =
+            sandboxAddon.startInteractive(contestantParameter, interactorParameter, countTraffic);
+        return new InteractiveProcess(contestantParameter, interactorParameter, startResult.contestantPid, startResult.interactorPid, startResult.handle);
+    });
+};
@@ -5,17 +5,33 @@ export interface MountInfo {
     dst: string;
     // The maximum length (in bytes) the sandboxed process may write to the mount.
     // 0 for readonly; -1 for no limit.
-    // Length limit requires fuse and has not yet been implemented! (Readonly works, however)
+    // If limited, `src` is not mounted: an empty tmpfs of that size is mounted at `dst` instead,
+    // which is discarded with the sandbox. It's in memory, and counts towards the memory limit too.
     limit: number;
+    // For a limited mount, copy what's in it into `src` once the sandbox has exited.
+    // Only directories and regular files are copied.
+    copyOut?: boolean;
 }
 
 export interface SandboxParameter {
     // Time limit, in milliseconds. -1 for no limit.
+    // The CPU time is checked every min(time / 10, 50) ms, counting at least 40% of the elapsed wall time,
+    // so a sandbox that keeps sleeping is also stopped, after 2.5 times the limit.
     time: number;
 
     // Memory limit, in bytes. -1 for no limit.
     memory: number;
 
+    // cgroup v2 only; ignored with v1. Throttle the sandbox at `memory` (with `memory.high`) instead of letting it run
+    // up to the hard limit (25% more) and be OOM-killed, and kill it as soon as its usage (excluding the page cache)
+    // exceeds `memory`, which is watched through `memory.events` and PSI, and reported as MemoryLimitExceeded right away.
+    throttleMemory?: boolean;
+
+    // Output limit of stdout and stderr in total, in bytes. -1 (the default) for no limit.
+    // If limited, the sandbox writes to pipes, whose content is relayed to `stdout` and `stderr` natively,
+    // and it's stopped as soon as it exceeds the limit (with exactly `output` bytes written).
+    output?: number;
+
     // The maximum child process count that may be created by the executable. Typically less than 10. -1 for no limit.
     process: number;
 
@@ -28,6 +44,15 @@ export interface SandboxParameter {
     // so you can have any number of sandboxes using the same chroot synchronously.
     chroot: string;
 
+    // The maximum length (in bytes) the sandboxed program may write to its root filesystem.
+    // 0 (the default) for readonly; -1 for no limit.
+    // If not 0, an overlay is mounted on the chroot, with a private tmpfs as its upper layer,
+    // so each sandbox gets a writable root (e.g. for `/tmp` or `$HOME`) without copying anything,
+    // which is discarded with the sandbox. The tmpfs counts towards the memory limit too.
+    // The `dst` directories of `mounts` don't need to exist in the chroot then.
+    // Mounts under the chroot directory (e.g. a bind-mounted `/dev`) are not seen through the overlay; use `mounts` for them.
+    chrootLimit?: number;
+
     // The hostname inside the sandbox, by default equals to the hostname outside.
     hostname: string;
 
@@ -98,8 +123,43 @@ export interface SandboxParameter {
 
     // sched_setaffinity
     cpuAffinity?: number[];
+
+    // The CPU bandwidth, in milliseconds: at most `cpuQuota` of CPU time (of all the processes) every `cpuPeriod` (100 by default).
+    // E.g. a quota of twice the period allows the sandbox 2 CPUs. No limit if not set.
+    cpuQuota?: number;
+    cpuPeriod?: number;
+
+    // The CPUs and NUMA memory nodes the sandbox is confined to (cgroup cpuset), which it can't change, unlike `cpuAffinity`.
+    // If only the CPUs are given, the memory is placed on the nodes local to them.
+    cpuset?: number[];
+    memoryNodes?: number[];
+
+    // The seccomp profile to filter the syscalls of the sandboxed program with: "c/cpp", "python" or "jvm".
+    // Dangerous syscalls (ptrace, mount, unshare, bpf, etc.) kill it in all profiles; creating processes kills it with "c/cpp",
+    // and fails with EPERM with the others. The filter is compiled once, and checked by the kernel without a tracer.
+    seccomp?: string;
+
+    // Compare the stdout with the file `expectedOutput` natively, as it's written (it's still written to `stdout`),
+    // instead of reading it back. The result is in `outputMatched` and `mismatchOffset` of the SandboxResult.
+    // "exact": byte by byte; "lines": ignoring the whitespace at the end of lines and the empty lines at the end;
+    // "tokens": line by line, each as whitespace-separated tokens; "float": as "tokens", and numbers are equal
+    // if their absolute or relative error is at most `compareEpsilon` (1e-6 by default).
+    compareMode?: 'exact' | 'lines' | 'tokens' | 'float';
+    expectedOutput?: string;
+    compareEpsilon?: number;
+    // Kill the sandbox as soon as its output differs, with the status WrongAnswer.
+    stopOnMismatch?: boolean;
 };
 
+// The parameters that may vary between the sandboxes started from a SandboxPool.
+// See SandboxParameter for their meanings.
+// `cpuAffinity` and `expectedOutput`, if given, override those of the template.
+export type SandboxRunParameter = Pick<SandboxParameter, 'executable' | 'parameters' | 'environments' | 'stdin' | 'stdout' | 'stderr' | 'cpuAffinity' | 'expectedOutput'>;
+
+// The parameters that may vary between the sandboxes started from a SandboxTemplate.
+// `expectedOutput`, if given, overrides that of the template.
+export type SandboxTemplateRunParameter = Pick<SandboxParameter, 'stdin' | 'stdout' | 'stderr' | 'expectedOutput'>;
+
 export enum SandboxStatus {
     Unknown = 0,
     OK = 1,
@@ -107,12 +167,102 @@ export enum SandboxStatus {
     MemoryLimitExceeded = 3,
     RuntimeError = 4,
     Cancelled = 5,
-    OutputLimitExceeded = 6
+    OutputLimitExceeded = 6,
+    DisallowedSyscall = 7,
+    // Killed as soon as the output differs from the expected one, with `stopOnMismatch`.
+    WrongAnswer = 8,
+    // Of an interactive pair (see `startInteractive`): the interactor has been killed, or has crashed.
+    InteractorFailed = 9
 };
 
+// Collected by `wait4` when the sandbox is reaped, for the sandboxed process and all its descendants.
+export interface SandboxResourceUsage {
+    // CPU time spent in user and kernel mode, in nanoseconds.
+    userTime: number;
+    systemTime: number;
+    // The maximum resident set size of a single process, in bytes.
+    maxResidentSetSize: number;
+    minorPageFaults: number;
+    majorPageFaults: number;
+    voluntaryContextSwitches: number;
+    involuntaryContextSwitches: number;
+}
+
+export interface SandboxMemoryPeaks {
+    anon: number;
+    file: number;
+    shmem: number;
+}
+
 export interface SandboxResult {
     status: SandboxStatus;
+    // CPU time of the cgroup, in nanoseconds.
     time: number;
+    // Peak memory usage of the sandbox excluding the page cache, in bytes: the larger one of the (sampled) peak of
+    // anonymous plus shared memory, and `resourceUsage.maxResidentSetSize`, but no more than the total peak of the cgroup.
     memory: number;
+    // The peaks of each kind of memory, sampled 5ms after the start, then less and less often, down to every 100ms, in bytes. `file` is the page cache, including `shmem`.
+    memoryPeaks: SandboxMemoryPeaks;
     code: number;
+    resourceUsage: SandboxResourceUsage;
+    // The syscall the sandbox has been killed for by its seccomp profile, e.g. "ptrace".
+    // Only reported with Linux 5.0+; before that, the sandbox is killed by SIGSYS, as a runtime error.
+    killedSyscall?: string;
+    // With a `compareMode`, whether the stdout is the same as the expected output, and if not, the offset where it first differs.
+    outputMatched?: boolean;
+    mismatchOffset?: number;
+};
+
+// The results of an interactive pair (see `startInteractive`).
+export interface InteractiveResult {
+    // The verdict of the pair: if the interactor has exited first with a non-zero code, WrongAnswer, whatever happens
+    // to the contestant afterwards (e.g. it's killed by SIGPIPE); otherwise, the contestant exceeding a limit
+    // (or being cancelled), then InteractorFailed, then WrongAnswer for a non-zero exit code of the interactor,
+    // and the status of the contestant at last.
+    status: SandboxStatus;
+    contestant: SandboxResult;
+    // Its time and memory are accounted separately, in its own cgroup.
+    interactor: SandboxResult;
+    // Whether the interactor is reaped before the contestant.
+    interactorFirst: boolean;
+    // With `countTraffic`, the bytes each side has written to the other.
+    traffic?: { contestant: number; interactor: number };
+};
+
+// The result of a job of a CompileServer.
+export interface CompileResult {
+    // The line the helper has answered the job with.
+    reply: string;
+    // CPU time of the helper (and the compilers it has run) during the job, in nanoseconds.
+    time: number;
+    timeLimitExceeded: boolean;
+    // Whether the helper has exited (or been killed for the time limit) during the job; it's started again for the next one.
+    helperExited: boolean;
+    // If it has exited, e.g. its `memory` and `status`.
+    helperResult?: SandboxResult;
+};
+
+// See CoreScheduler.getStats().
+export interface CoreSchedulerStats {
+    // The cores handed out to running sandboxes, and all the cores owned.
+    running: number;
+    cores: number;
+    // The number of sandboxes waiting for a core.
+    queued: number;
+    // The number of sandboxes admitted so far, and the total and maximum time they have waited, in nanoseconds.
+    admitted: number;
+    totalWaitTime: number;
+    maxWaitTime: number;
 };
+
+// See getSandboxTelemetry().
+export interface PhaseHistogram {
+    // The number of samples, and their percentiles and maximum, in nanoseconds.
+    count: number;
+    p50: number;
+    p99: number;
+    max: number;
+};
+
+// The phases of starting a sandbox, by name: setup, mount, cgroup, killScan, clone, handshake, release and exec.
+export type SandboxTelemetry = { [phase: string]: PhaseHistogram };
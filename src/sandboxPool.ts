@@ -0,0 +1,29 @@
+import { SandboxParameter, SandboxRunParameter } from './interfaces';
+import sandboxAddon from './nativeAddon';
+import { SandboxProcess, CoreLease } from './sandboxProcess';
+
+// Keeps `size` sandboxes prepared with `parameter` (the chroot, mounts, limits, user, etc.),
+// parked right before running, so that starting one only has to pass the executable and IO.
+// The sandboxes are put in cgroups under `parameter.cgroup`.
+export class SandboxPool {
+    private pool: ArrayBuffer;
+
+    constructor(
+        public readonly parameter: SandboxParameter,
+        public readonly size: number
+    ) {
+        this.pool = sandboxAddon.createSandboxPool(parameter, size);
+    }
+
+    // `core` is released once the sandbox is reaped (see CoreScheduler).
+    start(runParameter: SandboxRunParameter, core?: CoreLease): SandboxProcess {
+        const startResult: { pid: number; execParam: ArrayBuffer; cgroup: string } = sandboxAddon.startSandboxFromPool(this.pool, runParameter);
+        const actualParameter: SandboxParameter = Object.assign({}, this.parameter, runParameter, { cgroup: startResult.cgroup });
+        return new SandboxProcess(actualParameter, startResult.pid, startResult.execParam, false, core);
+    }
+
+    // Kill the parked sandboxes. The sandboxes already started are not affected.
+    destroy(): void {
+        sandboxAddon.destroySandboxPool(this.pool);
+    }
+};
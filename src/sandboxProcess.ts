@@ -1,14 +1,69 @@
 import { SandboxParameter, SandboxResult, SandboxStatus } from './interfaces';
 import sandboxAddon from './nativeAddon';
 import * as utils from './utils';
+import * as randomString from 'randomstring';
+import * as path from 'path';
+
+// The result of the comparison of the output, if any, for a SandboxResult.
+export function getComparison(parameter: SandboxParameter, runResult: { mismatchOffset: number }): { outputMatched?: boolean; mismatchOffset?: number } {
+    if (!parameter.compareMode) {
+        return {};
+    }
+    return runResult.mismatchOffset === -1 ? { outputMatched: true } : { outputMatched: false, mismatchOffset: runResult.mismatchOffset };
+}
+
+// A core granted to a sandbox by a CoreScheduler, which is released once the sandbox is reaped.
+// `handle` holds the scheduler too, so it may be destroyed meanwhile.
+export interface CoreLease {
+    handle: ArrayBuffer;
+    cpu: number;
+}
+
+// `runResult` is what the native side reports on exit; `time` is in nanoseconds and `memory` in bytes.
+export function getSandboxStatus(
+    parameter: SandboxParameter,
+    runResult: { status: string; timeLimitExceeded: boolean; outputLimitExceeded: boolean; memoryLimitExceeded?: boolean; killedOnMismatch?: boolean; killedSyscall?: string },
+    time: number,
+    memory: number,
+    oomKilled: boolean,
+    cancelled: boolean
+): SandboxStatus {
+    if (runResult.timeLimitExceeded || (parameter.time !== -1 && time > utils.milliToNano(parameter.time))) {
+        return SandboxStatus.TimeLimitExceeded;
+    } else if (cancelled) {
+        return SandboxStatus.Cancelled;
+    } else if (runResult.outputLimitExceeded) {
+        return SandboxStatus.OutputLimitExceeded;
+    } else if (runResult.killedSyscall) {
+        return SandboxStatus.DisallowedSyscall;
+    } else if (runResult.memoryLimitExceeded || (parameter.memory != -1 && (memory > parameter.memory || oomKilled))) {
+        return SandboxStatus.MemoryLimitExceeded;
+    } else if (runResult.killedOnMismatch) {
+        return SandboxStatus.WrongAnswer;
+    } else if (runResult.status === 'signaled') {
+        return SandboxStatus.RuntimeError;
+    } else if (runResult.status === 'exited') {
+        return SandboxStatus.OK;
+    }
+    return SandboxStatus.Unknown;
+}
+
+// The SandboxResult of a sandbox reaped outside a SandboxProcess, without the comparison of the output.
+export function toSandboxResult(parameter: SandboxParameter, runResult, cancelled: boolean): SandboxResult {
+    return {
+        status: getSandboxStatus(parameter, runResult, runResult.time, runResult.memory, runResult.oomKilled, cancelled),
+        time: runResult.time,
+        memory: runResult.memory,
+        memoryPeaks: runResult.memoryPeaks,
+        code: runResult.code,
+        resourceUsage: runResult.resourceUsage,
+        killedSyscall: runResult.killedSyscall
+    };
+}
 
 export class SandboxProcess {
-    private readonly cancellationToken: NodeJS.Timer = null;
     private readonly stopCallback: () => void;
 
-    private countedCpuTime: number = 0;
-    private actualCpuTime: number = 0;
-    private timeout: boolean = false;
     private cancelled: boolean = false;
     private waitPromise: Promise<SandboxResult> = null;
 
@@ -17,7 +72,10 @@ export class SandboxProcess {
     constructor(
         public readonly parameter: SandboxParameter,
         public readonly pid: number,
-        execParam: ArrayBuffer
+        execParam: ArrayBuffer,
+        // Whether the sandbox is started from the zygote (see `startZygote`).
+        zygote: boolean = false,
+        core?: CoreLease
     ) {
         const myFather = this;
         // Stop the sandboxed process on Node.js exit.
@@ -25,33 +83,10 @@ export class SandboxProcess {
             myFather.stop();
         }
 
-        let checkIfTimedOut = () => { };
-        if (this.parameter.time !== -1) {
-            // Check every 50ms.
-            const checkInterval = Math.min(this.parameter.time / 10, 50);
-            let lastCheck = new Date().getTime();
-            checkIfTimedOut = () => {
-                let current = new Date().getTime();
-                const spent = current - lastCheck;
-                lastCheck = current;
-                const val: number = Number(sandboxAddon.getCgroupProperty("cpuacct", myFather.parameter.cgroup, "cpuacct.usage"));
-                myFather.countedCpuTime += Math.max(
-                    val - myFather.actualCpuTime,  // The real time, or if less than 40%,
-                    utils.milliToNano(spent) * 0.4 // 40% of actually elapsed time
-                );
-                myFather.actualCpuTime = val;
-
-                // Time limit exceeded
-                if (myFather.countedCpuTime > utils.milliToNano(parameter.time)) {
-                    myFather.timeout = true;
-                    myFather.stop();
-                }
-            };
-            this.cancellationToken = setInterval(checkIfTimedOut, checkInterval);
-        }
-
+        // The time limit is enforced by the native side, which tells us in `runResult.timeLimitExceeded`.
+        // The usage is read from the cgroups by the native side too, right after reaping.
         this.waitPromise = new Promise((res, rej) => {
-            sandboxAddon.waitForProcess(pid, execParam, (err, runResult) => {
+            const callback = (err, runResult) => {
                 if (err) {
                     try {
                         myFather.stop();
@@ -62,52 +97,40 @@ export class SandboxProcess {
                     rej(err);    
                 } else {
                     try {
-                        const memUsageWithCache: number = Number(sandboxAddon.getCgroupProperty("memory", myFather.parameter.cgroup, "memory.memsw.max_usage_in_bytes"));
-                        const cache: number = Number(sandboxAddon.getCgroupProperty2("memory", myFather.parameter.cgroup, "memory.stat", "cache"));
-                        const memUsage = memUsageWithCache - cache;
-    
-                        myFather.actualCpuTime = Number(sandboxAddon.getCgroupProperty("cpuacct", myFather.parameter.cgroup, "cpuacct.usage"));
                         myFather.cleanup();
     
                         const result: SandboxResult = {
-                            status: SandboxStatus.Unknown,
-                            time: myFather.actualCpuTime,
-                            memory: memUsage,
-                            code: runResult.code
+                            ...getComparison(myFather.parameter, runResult),
+                            status: getSandboxStatus(myFather.parameter, runResult, runResult.time, runResult.memory, runResult.oomKilled, myFather.cancelled),
+                            time: runResult.time,
+                            memory: runResult.memory,
+                            memoryPeaks: runResult.memoryPeaks,
+                            code: runResult.code,
+                            resourceUsage: runResult.resourceUsage,
+                            killedSyscall: runResult.killedSyscall
                         };
     
-                        if (myFather.timeout || myFather.actualCpuTime > utils.milliToNano(myFather.parameter.time)) {
-                            result.status = SandboxStatus.TimeLimitExceeded;
-                        } else if (myFather.cancelled) {
-                            result.status = SandboxStatus.Cancelled;
-                        } else if (myFather.parameter.memory != -1 && memUsage > myFather.parameter.memory) {
-                            result.status = SandboxStatus.MemoryLimitExceeded;
-                        } else if (runResult.status === 'signaled') {
-                            result.status = SandboxStatus.RuntimeError;
-                        } else if (runResult.status === 'exited') {
-                            result.status = SandboxStatus.OK;
-                        }
-    
                         res(result);
                     } catch (e) {
                         rej(e);
                     }    
                 }
-            })
+            };
+            const coreArguments = core ? [core.handle] : [];
+            if (zygote) {
+                sandboxAddon.waitForZygoteProcess(execParam, callback, ...coreArguments);
+            } else {
+                sandboxAddon.waitForProcess(pid, execParam, callback, ...coreArguments);
+            }
         });
     }
 
     private removeCgroup(): void {
-        sandboxAddon.removeCgroup("memory", this.parameter.cgroup);
-        sandboxAddon.removeCgroup("cpuacct", this.parameter.cgroup);
-        sandboxAddon.removeCgroup("pids", this.parameter.cgroup);
+        sandboxAddon.removeSandboxCgroups(this.parameter.cgroup);
     }
 
     private cleanup(): void {
         if (this.running) {
-            if (this.cancellationToken) {
-                clearInterval(this.cancellationToken);
-            }
             process.removeListener('exit', this.stopCallback);
             this.removeCgroup();
             this.running = false;
@@ -125,3 +148,41 @@ export class SandboxProcess {
         return await this.waitPromise;
     }
 };
+
+// Only a child that has died or hung while setting up is retried (e.g. killed on a loaded host);
+// an error it has reported (e.g. a missing directory) would happen again.
+const MAX_RETRY_TIMES = 2;
+const RETRIED_ERRORS = ["The child process is not responding.", "The child process has exited unexpectedly."];
+
+// A new cgroup under `cgroup` for a sandbox.
+export function sandboxCgroup(cgroup: string): string {
+    return path.join(cgroup, randomString.generate(9));
+}
+
+// Start a sandbox in a new cgroup under `parameter.cgroup`, with the `core` (if any) released once it's reaped.
+export function startSandboxProcess(parameter: SandboxParameter, core?: CoreLease): SandboxProcess {
+    return retryStart(() => {
+        const actualParameter = Object.assign({}, parameter);
+        actualParameter.cgroup = sandboxCgroup(actualParameter.cgroup);
+        const startResult: { pid: number; execParam: ArrayBuffer; zygote?: boolean } = sandboxAddon.startSandbox(actualParameter);
+        return new SandboxProcess(actualParameter, startResult.pid, startResult.execParam, startResult.zygote, core);
+    });
+};
+
+// Call `doStart` again if the child has died or hung while setting up (see above).
+export function retryStart<T>(doStart: () => T): T {
+    let retryTimes = MAX_RETRY_TIMES;
+    while (1) {
+        try {
+            return doStart();
+        } catch (e) {
+            // Retry if the child process fails
+            if ("message" in e && typeof e.message === "string" && RETRIED_ERRORS.includes(e.message)) {
+                if (retryTimes-- > 0)
+                    continue;
+            }
+
+            throw e;
+        }
+    }
+};
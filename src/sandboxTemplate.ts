@@ -0,0 +1,30 @@
+import { SandboxParameter, SandboxTemplateRunParameter } from './interfaces';
+import sandboxAddon from './nativeAddon';
+import { SandboxProcess, CoreLease, retryStart, sandboxCgroup } from './sandboxProcess';
+
+// `parameter` converted to its native form once, so that starting a sandbox from it only has to pass the IO,
+// which is cheaper than `startSandbox` when many sandboxes are started with the same parameter.
+// Each sandbox is put in a new cgroup under `parameter.cgroup`, and started from the zygote, if any.
+export class SandboxTemplate {
+    private template: ArrayBuffer;
+
+    constructor(public readonly parameter: SandboxParameter) {
+        this.template = sandboxAddon.compileSandboxTemplate(parameter);
+    }
+
+    // `core` is released once the sandbox is reaped (see CoreScheduler).
+    start(runParameter: SandboxTemplateRunParameter, core?: CoreLease): SandboxProcess {
+        return retryStart(() => {
+            const cgroup = sandboxCgroup(this.parameter.cgroup);
+            const startResult: { pid: number; execParam: ArrayBuffer; zygote?: boolean } =
+                sandboxAddon.startSandboxFromTemplate(this.template, { ...runParameter, cgroup });
+            const actualParameter: SandboxParameter = Object.assign({}, this.parameter, runParameter, { cgroup });
+            return new SandboxProcess(actualParameter, startResult.pid, startResult.execParam, startResult.zygote, core);
+        });
+    }
+
+    // Free the native parameter. The sandboxes already started are not affected.
+    destroy(): void {
+        sandboxAddon.destroySandboxTemplate(this.template);
+    }
+};